@@ -21,10 +21,20 @@
 
 #include "cifsd.h"
 #include "netlink.h"
+#include "worker.h"
+#include "trace.h"
+#include "stats.h"
 #include <pwd.h>
+#include <limits.h>
+#include <libgen.h>
+#include <sys/inotify.h>
 
 struct list_head cifsd_share_list;
 int cifsd_num_shares;
+pthread_rwlock_t cifsd_share_lock = PTHREAD_RWLOCK_INITIALIZER;
+unsigned int cifsd_share_gen;
+
+static char *cifsconf = PATH_SHARECONF;
 
 char workgroup[MAX_SERVER_WRKGRP_LEN];
 char server_string[MAX_SERVER_NAME_LEN];
@@ -33,7 +43,20 @@ void usage(void)
 {
 	fprintf(stderr,
 		"Usage: cifsd [-h|--help] [-v|--version] [-d |--debug]\n"
-		"       [-c smb.conf|--configure=smb.conf] [-i usrs-db|--import-users=cifspwd.db\n");
+		"       [-c smb.conf|--configure=smb.conf] [-i usrs-db|--import-users=cifspwd.db\n"
+		"       [-e events] max kernel events handled per wakeup\n"
+		"       [-b events] max kernel events read per batch\n"
+		"       [-r slots] receive ring depth\n"
+		"       [-w workers] request handling threads, 0 for none\n"
+		"       [-R bytes] netlink socket receive buffer size\n"
+		"       [-S bytes] netlink socket send buffer size\n"
+		"       [-l] shed LANMAN requests while overloaded\n"
+		"       [-u path] talk to a local kernel stand-in on an AF_UNIX socket\n"
+		"       [-T file] capture kernel events to a trace file\n"
+		"       [-P file] replay a trace in place of the kernel, report timings\n"
+		"       [-s path] serve latency stats on an AF_UNIX socket\n"
+		"       [-L ttl=s,clients=n,pipes=n,bytes=n] reap pipes idle for ttl, cap clients, pipes and memory (0 no cap)\n"
+		"       [-L client_pipes=n,client_bytes=n,client_rate=n,client_cpu=ms] per client quotas, rate per second, cpu ms per second\n");
 	exit(0);
 }
 
@@ -459,7 +482,9 @@ int config_shares(char *conf_path)
 		return CIFS_FAIL;
 	}
 
-	fd_conf = open(PATH_CIFSD_CONFIG, O_WRONLY);
+	/* the share list is still built for a kernel stand-in */
+	fd_conf = open(cifsd_nl_has_kernel() ? PATH_CIFSD_CONFIG : "/dev/null",
+			O_WRONLY);
 	if (fd_conf < 0) {
 		cifsd_err("cifsd is not available, err %d\n", errno);
 		fclose(fd_share);
@@ -598,16 +623,106 @@ out:
 	return CIFS_SUCCESS;
 }
 
+/**
+ * reload_share_config() - rebuild the share list from the config file
+ */
+static void reload_share_config(void)
+{
+	cifsd_debug("reloading %s\n", cifsconf);
+	pthread_rwlock_wrlock(&cifsd_share_lock);
+	exit_share_config();
+	memset(workgroup, 0, MAX_SERVER_WRKGRP_LEN);
+	memset(server_string, 0, MAX_SERVER_NAME_LEN);
+	init_share_config();
+	config_shares(cifsconf);
+	cifsd_share_gen++;
+	pthread_rwlock_unlock(&cifsd_share_lock);
+}
+
+/**
+ * config_watch_handler() - event loop callback for the config-reload fd
+ * @fd:		inotify fd watching the directory of the config file
+ */
+static void config_watch_handler(int fd)
+{
+	char buf[sizeof(struct inotify_event) + NAME_MAX + 1]
+		__attribute__((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *event;
+	char *conf, *name;
+	int reload = 0;
+	ssize_t len;
+	char *ptr;
+
+	conf = strdup(cifsconf);
+	if (!conf)
+		return;
+	name = basename(conf);
+
+	while ((len = read(fd, buf, sizeof(buf))) > 0) {
+		for (ptr = buf; ptr < buf + len;
+				ptr += sizeof(struct inotify_event) + event->len) {
+			event = (const struct inotify_event *)ptr;
+			if (event->len && !strcmp(event->name, name))
+				reload = 1;
+		}
+	}
+	free(conf);
+
+	if (reload)
+		reload_share_config();
+}
+
+/**
+ * config_watch() - register the config-reload fd with the event loop
+ *
+ * The directory is watched rather than the file itself, so that editors
+ * which replace the file through a rename are noticed as well.
+ *
+ * Return:	0 on success, -1 on error
+ */
+static int config_watch(void)
+{
+	char *conf;
+	int fd;
+
+	fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (fd < 0) {
+		perror("Failed to create inotify fd\n");
+		return -1;
+	}
+
+	conf = strdup(cifsconf);
+	if (!conf)
+		goto close_fd;
+
+	if (inotify_add_watch(fd, dirname(conf),
+				IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+		perror("Failed to watch config directory\n");
+		free(conf);
+		goto close_fd;
+	}
+	free(conf);
+
+	if (cifsd_nl_add_fd(fd, config_watch_handler))
+		goto close_fd;
+	return 0;
+
+close_fd:
+	close(fd);
+	return -1;
+}
+
 int main(int argc, char**argv)
 {
 	char *cifspwd = PATH_PWDDB;
-	char *cifsconf = PATH_SHARECONF;
+	char *tracefile = NULL;
+	char *statsock = NULL;
 	int c;
 	int ret;
 
 	/* Parse the command line options and arguments. */
 	opterr = 0;
-	while ((c = getopt(argc, argv, "c:i:vh")) != EOF)
+	while ((c = getopt(argc, argv, "c:i:e:b:r:w:R:S:lu:T:P:s:L:vh")) != EOF)
 		switch (c) {
 		case 'c':
 			cifsconf = strdup(optarg);
@@ -615,6 +730,49 @@ int main(int argc, char**argv)
 		case 'i':
 			cifspwd = strdup(optarg);
 			break;
+		case 'e':
+			cifsd_nl_budget = strtoul(optarg, NULL, 0);
+			if (!cifsd_nl_budget)
+				usage();
+			break;
+		case 'b':
+			cifsd_nl_batch = strtoul(optarg, NULL, 0);
+			if (!cifsd_nl_batch)
+				usage();
+			break;
+		case 'r':
+			cifsd_nl_ring_depth = strtoul(optarg, NULL, 0);
+			if (!cifsd_nl_ring_depth)
+				usage();
+			break;
+		case 'w':
+			cifsd_nr_workers = strtoul(optarg, NULL, 0);
+			break;
+		case 'R':
+			cifsd_nl_rcvbuf = strtoul(optarg, NULL, 0);
+			break;
+		case 'S':
+			cifsd_nl_sndbuf = strtoul(optarg, NULL, 0);
+			break;
+		case 'l':
+			cifsd_nl_shed = 1;
+			break;
+		case 'u':
+			cifsd_nl_unix_path = strdup(optarg);
+			break;
+		case 'T':
+			tracefile = strdup(optarg);
+			break;
+		case 'P':
+			cifsd_nl_replay_path = strdup(optarg);
+			break;
+		case 's':
+			statsock = strdup(optarg);
+			break;
+		case 'L':
+			if (cifsd_reaper_parse(optarg))
+				usage();
+			break;
 		case 'v':
 			if (argc <= 2) {
 				printf("[option] needed with verbose\n");
@@ -630,10 +788,12 @@ int main(int argc, char**argv)
 
 	init_share_config();
 
-	/* import user account */
-	ret = config_users(cifspwd);
-	if (ret != CIFS_SUCCESS)
-		goto out;
+	/* import user account, there is no kernel to take them on -u/-P */
+	if (cifsd_nl_has_kernel()) {
+		ret = config_users(cifspwd);
+		if (ret != CIFS_SUCCESS)
+			goto out;
+	}
 
 	/* import shares info */
 	ret = config_shares(cifsconf);
@@ -642,10 +802,24 @@ int main(int argc, char**argv)
 
 	//cifsd_debug("cifsd version : %d\n", cifsd_version);
 
-	/* netlink communication loop */
-	cifsd_netlink_setup();
+	/* reload shares when the config file changes */
+	config_watch();
+
+	if (tracefile && cifsd_trace_open(tracefile))
+		goto out;
+
+	/* a stats reader is not worth failing the daemon for */
+	cifsd_stats_init(statsock);
+
+	if (cifsd_reaper_init())
+		goto out;
+
+	/* netlink communication loop, only a replay returns from it */
+	ret = cifsd_netlink_setup();
 
 	exit_share_config();
+	if (!ret)
+		exit(0);
 
 out:
 	cifsd_debug("cifsd terminated\n");
@@ -107,7 +107,8 @@ char *smb_strndup_from_utf16(char *src, const int maxlen,
 			return ERR_PTR(-EINVAL);
 
 		dstlen = UNICODE_LEN(srclen);
-		dst = (char*) malloc(dstlen);
+		/* room for a terminator if @src has none */
+		dst = (char*) malloc(dstlen + 1);
 		if (!dst) {
 			close_conversion(conv);
 			return ERR_PTR(-ENOMEM);
@@ -122,6 +123,7 @@ char *smb_strndup_from_utf16(char *src, const int maxlen,
 			return ERR_PTR(-EINVAL);
 		}
 		close_conversion(conv);
+		*dst = '\0';
 		dst = start_dst;
 	} else {
 		dstlen = strnlen(src, srclen);
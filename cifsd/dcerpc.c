@@ -22,6 +22,8 @@
 #include"dcerpc.h"
 #include"winreg.h"
 #include"ntlmssp.h"
+#include"stats.h"
+#include"ndr.h"
 
 struct cifsd_pipe_table cifsd_pipes[] = {
 	{"\\srvsvc", SRVSVC},
@@ -54,30 +56,226 @@ unsigned int get_pipe_type(char *pipename)
 	return pipetype;
 }
 
+/*
+ * Free the pending response of @pipe as the rpc_read_*() functions would
+ * have once it went out.
+ */
+static void rpc_free_response(struct cifsd_pipe *pipe)
+{
+	RPC_BIND_RSP *bind_rsp;
+
+	if (!pipe->data)
+		goto out;
+
+	/* request responses are encoded in one buffer */
+	if (pipe->pkt_type == RPC_BIND) {
+		bind_rsp = (RPC_BIND_RSP *)pipe->data;
+		free(bind_rsp->addr.sec_addr);
+		free(bind_rsp->transfer);
+		if (pipe->pipe_type == WINREG)
+			free(bind_rsp->Buffer);
+	}
+	free(pipe->data);
+	pipe->data = NULL;
+
+out:
+	pipe->sent = 0;
+	pipe->datasize = 0;
+}
+
+/* drop the fragments of a request not complete yet */
+static void rpc_free_frags(struct cifsd_pipe *pipe)
+{
+	free(pipe->frag_buf);
+	pipe->frag_buf = NULL;
+	pipe->frag_len = 0;
+}
+
+/* move the pending response of @pipe to @call, leaving none on the pipe */
+static void rpc_call_save(struct cifsd_pipe *pipe,
+		struct cifsd_rpc_call *call)
+{
+	call->call_id = pipe->call_id;
+	call->pkt_type = pipe->pkt_type;
+	call->opnum = pipe->opnum;
+	call->data = pipe->data;
+	call->datasize = pipe->datasize;
+	call->sent = pipe->sent;
+
+	pipe->data = NULL;
+	pipe->datasize = 0;
+	pipe->sent = 0;
+}
+
+static void rpc_call_load(struct cifsd_pipe *pipe,
+		struct cifsd_rpc_call *call)
+{
+	pipe->call_id = call->call_id;
+	pipe->pkt_type = call->pkt_type;
+	pipe->opnum = call->opnum;
+	pipe->data = call->data;
+	pipe->datasize = call->datasize;
+	pipe->sent = call->sent;
+}
+
+/* make the oldest queued call the pending response */
+static void rpc_next_call(struct cifsd_pipe *pipe)
+{
+	struct cifsd_rpc_call *call;
+
+	if (!pipe->nr_calls)
+		return;
+
+	call = list_entry(pipe->calls.next, struct cifsd_rpc_call, list);
+	list_del(&call->list);
+	pipe->nr_calls--;
+	pipe->queued_bytes -= call->datasize;
+	rpc_call_load(pipe, call);
+	free(call);
+}
+
+/* free the response of call @call_id, pending or queued */
+static void rpc_drop_call(struct cifsd_pipe *pipe, __u32 call_id)
+{
+	struct cifsd_rpc_call head, *call, *tmp;
+
+	if (pipe->data && pipe->call_id == call_id) {
+		rpc_free_response(pipe);
+		rpc_next_call(pipe);
+		return;
+	}
+
+	list_for_each_entry_safe(call, tmp, &pipe->calls, list) {
+		if (call->call_id != call_id)
+			continue;
+
+		list_del(&call->list);
+		pipe->nr_calls--;
+		pipe->queued_bytes -= call->datasize;
+		rpc_call_save(pipe, &head);
+		rpc_call_load(pipe, call);
+		rpc_free_response(pipe);
+		rpc_call_load(pipe, &head);
+		free(call);
+		return;
+	}
+}
+
 /**
- * process_rpc() - process a RPC request
- * @server:     TCP server instance of connection
- * @data:	RPC request packet - data
+ * rpc_free_pipe_data() - release the responses built but not read yet
+ * @pipe:	pipe holding the responses
  *
- * Return:      0 on success, error number on error
+ * For pipes destroyed or reaped before their responses went out.
  */
-int process_rpc(struct cifsd_pipe *pipe, char *data)
+void rpc_free_pipe_data(struct cifsd_pipe *pipe)
 {
-	RPC_HDR *rpc_hdr;
+	do {
+		rpc_free_response(pipe);
+		rpc_next_call(pipe);
+	} while (pipe->data);
+	rpc_free_frags(pipe);
+}
+
+/**
+ * rpc_reassemble() - collect the fragments of a request
+ * @pipe:	pipe the fragment came in on
+ * @data:	RPC PDU, set to the whole request once its last fragment is in
+ * @len:	length of @data, set to the whole request length along
+ *
+ * A request sent in several fragments is collected on @pipe until the
+ * fragment flagged last comes in. The whole request is then handed out
+ * as one flagged first and last, in a buffer the caller frees. Anything
+ * else is handed out as is.
+ *
+ * Return:	1 when @data holds a PDU to process, 0 while fragments are
+ *		missing, otherwise error number
+ */
+static int rpc_reassemble(struct cifsd_pipe *pipe, char **data, int *len)
+{
+	RPC_REQUEST_REQ *req = (RPC_REQUEST_REQ *)*data;
+	int stub_len;
+	char *buf;
+
+	if (req->hdr.pkt_type != RPC_REQUEST)
+		return 1;
+	/* a call started again replaces its fragments received so far */
+	if (req->hdr.flags & RPC_FLAG_FIRST)
+		rpc_free_frags(pipe);
+	if (!pipe->frag_buf && (req->hdr.flags & RPC_FLAG_LAST))
+		return 1;
+
+	if (*len < (int)sizeof(*req) ||
+	    (!pipe->frag_buf && !(req->hdr.flags & RPC_FLAG_FIRST)) ||
+	    (pipe->frag_buf &&
+	     ((RPC_HDR *)pipe->frag_buf)->call_id != req->hdr.call_id)) {
+		cifsd_debug("unexpected fragment of call %u\n",
+				req->hdr.call_id);
+		rpc_free_frags(pipe);
+		return -EINVAL;
+	}
+
+	/* the first fragment keeps its header for the whole request */
+	stub_len = *len;
+	if (pipe->frag_buf)
+		stub_len -= sizeof(*req);
+	if (pipe->frag_len + stub_len > RPC_MAX_REQ_SIZE) {
+		cifsd_debug("request over %d bytes\n", RPC_MAX_REQ_SIZE);
+		rpc_free_frags(pipe);
+		return -EINVAL;
+	}
+
+	buf = realloc(pipe->frag_buf, pipe->frag_len + stub_len);
+	if (!buf) {
+		rpc_free_frags(pipe);
+		return -ENOMEM;
+	}
+	memcpy(buf + pipe->frag_len, *data + *len - stub_len, stub_len);
+	pipe->frag_buf = buf;
+	pipe->frag_len += stub_len;
+	if (!(req->hdr.flags & RPC_FLAG_LAST))
+		return 0;
+
+	req = (RPC_REQUEST_REQ *)buf;
+	req->hdr.flags |= RPC_FLAG_LAST;
+	req->hdr.frag_len = pipe->frag_len;
+	req->alloc_hint = pipe->frag_len - sizeof(*req);
+	*data = buf;
+	*len = pipe->frag_len;
+	pipe->frag_buf = NULL;
+	pipe->frag_len = 0;
+	return 1;
+}
+
+/* build the response to a whole RPC request on @pipe */
+static int rpc_process_call(struct cifsd_pipe *pipe, char *data, int len)
+{
+	RPC_HDR *rpc_hdr = (RPC_HDR *)data;
+	struct cifsd_rpc_call head = { .data = NULL }, *call;
 	int ret = 0;
 
-	rpc_hdr = (RPC_HDR *)data;
+	/* a call sent again replaces its response not read yet */
+	rpc_drop_call(pipe, rpc_hdr->call_id);
+
+	/* build behind the pending response, queued once done */
+	if (pipe->data) {
+		if (pipe->nr_calls >= CIFSD_PIPE_MAX_CALLS) {
+			cifsd_debug("%u calls pending on pipe %p\n",
+					pipe->nr_calls, pipe);
+			return -EBUSY;
+		}
+		rpc_call_save(pipe, &head);
+	}
 
 	cifsd_debug("DCERPC pktype = %u\n", rpc_hdr->pkt_type);
 
 	switch (rpc_hdr->pkt_type) {
 	case RPC_REQUEST:
 		cifsd_debug("GOT RPC_REQUEST\n");
-		ret = rpc_request(pipe, data);
+		ret = rpc_request(pipe, data, len);
 		break;
 	case RPC_BIND:
 		cifsd_debug("GOT RPC_BIND\n");
-		ret = rpc_bind(pipe, data);
+		ret = rpc_bind(pipe, data, len);
 		break;
 	default:
 		cifsd_debug("rpc type = %d Not Implemented\n",
@@ -85,9 +283,56 @@ int process_rpc(struct cifsd_pipe *pipe, char *data)
 		ret = -EOPNOTSUPP;
 	}
 
-	if (!ret)
+	if (!ret) {
 		pipe->pkt_type = rpc_hdr->pkt_type;
+		pipe->call_id = rpc_hdr->call_id;
+	} else {
+		/* builders free what they allocated when they fail */
+		pipe->data = NULL;
+	}
+
+	if (!head.data)
+		return ret;
 
+	if (pipe->data) {
+		call = malloc(sizeof(*call));
+		if (call) {
+			rpc_call_save(pipe, call);
+			list_add_tail(&call->list, &pipe->calls);
+			pipe->nr_calls++;
+			pipe->queued_bytes += call->datasize;
+		} else {
+			rpc_free_response(pipe);
+			ret = -ENOMEM;
+		}
+	}
+	rpc_call_load(pipe, &head);
+	return ret;
+}
+
+/**
+ * process_rpc() - process a RPC request
+ * @pipe:	pipe the request came in on
+ * @data:	RPC request packet - data
+ * @len:	length of @data
+ *
+ * Return:      0 on success, error number on error
+ */
+int process_rpc(struct cifsd_pipe *pipe, char *data, int len)
+{
+	char *req = data;
+	int ret;
+
+	if (len < (int)sizeof(RPC_HDR))
+		return -EINVAL;
+
+	ret = rpc_reassemble(pipe, &req, &len);
+	if (ret <= 0)
+		return ret;
+
+	ret = rpc_process_call(pipe, req, len);
+	if (req != data)
+		free(req);
 	return ret;
 }
 
@@ -105,23 +350,17 @@ int process_rpc_rsp(struct cifsd_pipe *pipe, char *data_buf, int size)
 
 	cifsd_debug("pipe %p, pipe->pkt_type = %d, pipe->pipe_type %d\n",
 			pipe, pipe->pkt_type, pipe->pipe_type);
+	if (!pipe->data) {
+		cifsd_debug("no response pending on pipe %p\n", pipe);
+		return -EINVAL;
+	}
+
 	switch (pipe->pkt_type) {
 	case RPC_REQUEST:
-		switch (pipe->pipe_type) {
-		case SRVSVC:
-			nbytes = rpc_read_srvsvc_data(pipe, data_buf, size);
-			break;
-		case WINREG:
-			nbytes = rpc_read_winreg_data(pipe, data_buf, size);
-			break;
-		default:
-			cifsd_debug("rpc pipe = %d Not Implemented\n",
-				pipe->pipe_type);
-			return -EINVAL;
-		}
+		nbytes = rpc_read_request_data(pipe, data_buf, size);
 		break;
 	case RPC_BIND:
-		nbytes = rpc_read_bind_data(pipe, data_buf);
+		nbytes = rpc_read_bind_data(pipe, data_buf, size);
 		break;
 	default:
 		cifsd_debug("rpc type = %d Not Implemented\n",
@@ -129,1303 +368,1023 @@ int process_rpc_rsp(struct cifsd_pipe *pipe, char *data_buf, int size)
 		return -EINVAL;
 	}
 
+	/* read out, the next pipelined response comes up */
+	if (!pipe->data)
+		rpc_next_call(pipe);
+
 	return nbytes;
 }
 
+/* RPC_RESPONSE header, frag_len and alloc_hint are set by rpc_rsp_done */
+static void rpc_rsp_hdr(struct cifsd_ndr *ndr, RPC_REQUEST_REQ *req)
+{
+	RPC_REQUEST_RSP *rsp;
+
+	rsp = (RPC_REQUEST_RSP *)cifsd_ndr_reserve(ndr, sizeof(*rsp));
+	if (!rsp)
+		return;
 
+	memset(rsp, 0, sizeof(*rsp));
+	dcerpc_header_init(&rsp->hdr, RPC_RESPONSE,
+			RPC_FLAG_FIRST | RPC_FLAG_LAST, req->hdr.call_id);
+	rsp->context_id = req->context_id;
+}
 
-int rpc_read_winreg_data(struct cifsd_pipe *pipe, char *outdata, int buf_len)
+/* response fragment size for a client taking @max_rsize at most */
+static __u16 rpc_xmit_frag(__u16 max_rsize)
 {
-	RPC_REQUEST_RSP *rpc_request_rsp = (RPC_REQUEST_RSP *)outdata;
-	int offset = 0;
-
-	if (pipe->opnum == WINREG_OPENHKCR ||
-			pipe->opnum == WINREG_OPENHKCU ||
-			pipe->opnum == WINREG_OPENHKLM ||
-			pipe->opnum == WINREG_OPENHKU ||
-			pipe->opnum == WINREG_OPENKEY ||
-			pipe->opnum == WINREG_CLOSEKEY) {
-
-		OPENHKEY_RSP *winreg_rsp;
-
-		winreg_rsp = (OPENHKEY_RSP *)pipe->data;
-		memcpy(outdata + offset, &winreg_rsp->rpc_request_rsp,
-						sizeof(RPC_REQUEST_RSP));
-		offset += sizeof(RPC_REQUEST_RSP);
-		memcpy(outdata + offset, &winreg_rsp->key_handle,
-						sizeof(KEY_HANDLE));
-		offset += sizeof(KEY_HANDLE);
-		memcpy(outdata + offset, &winreg_rsp->werror, sizeof(__u32));
-		offset += sizeof(__u32);
-		free(winreg_rsp);
-	}
+	return max_rsize < RPC_MIN_FRAG_SIZE ? RPC_MIN_FRAG_SIZE : max_rsize;
+}
 
-	if (pipe->opnum == WINREG_GETVERSION) {
-		GET_VERSION_RSP *winreg_rsp;
+/* largest response fragment a read of @size can take */
+static int rpc_frag_size(struct cifsd_pipe *pipe, int size)
+{
+	/* frag_len is 16 bits, the default before a bind is the largest */
+	int max = pipe->max_xmit_frag ? pipe->max_xmit_frag : 0xffff;
 
-		winreg_rsp = (GET_VERSION_RSP *)pipe->data;
+	return size < max ? size : max;
+}
 
-		memcpy(outdata + offset, &winreg_rsp->rpc_request_rsp,
-						sizeof(RPC_REQUEST_RSP));
-		offset += sizeof(RPC_REQUEST_RSP);
+/* fill in the lengths of a response started at the beginning of @ndr */
+static int rpc_rsp_done(struct cifsd_ndr *ndr)
+{
+	RPC_REQUEST_RSP *rsp = (RPC_REQUEST_RSP *)ndr->buf;
 
-		memcpy(outdata + offset, &winreg_rsp->version, sizeof(__u32));
-		offset += sizeof(__u32);
-		memcpy(outdata + offset, &winreg_rsp->werror, sizeof(__u32));
-		offset += sizeof(__u32);
-		free(winreg_rsp);
-	}
+	if (ndr->err)
+		return ndr->err;
 
-	if (pipe->opnum == WINREG_DELETEKEY ||
-			pipe->opnum == WINREG_FLUSHKEY ||
-			pipe->opnum == WINREG_SETVALUE ||
-			pipe->opnum == WINREG_NOTIFYCHANGEKEYVALUE ||
-			pipe->opnum == WINREG_DELETEVALUE) {
-		WINREG_COMMON_RSP *winreg_rsp;
-
-		winreg_rsp = (WINREG_COMMON_RSP *)pipe->data;
-		memcpy(outdata + offset, &winreg_rsp->rpc_request_rsp,
-						sizeof(RPC_REQUEST_RSP));
-		offset += sizeof(RPC_REQUEST_RSP);
-		memcpy(outdata + offset, &winreg_rsp->werror, sizeof(__u32));
-		offset += sizeof(__u32);
-		free(winreg_rsp);
-	}
+	rsp->hdr.frag_len = ndr->offset;
+	rsp->alloc_hint = ndr->offset - sizeof(RPC_REQUEST_RSP);
+	return ndr->offset;
+}
 
-	if (pipe->opnum == WINREG_CREATEKEY) {
-		CREATE_KEY_RSP *winreg_rsp;
-
-		winreg_rsp = (CREATE_KEY_RSP *)pipe->data;
-		memcpy(outdata + offset, &winreg_rsp->rpc_request_rsp,
-						sizeof(RPC_REQUEST_RSP));
-		offset += sizeof(RPC_REQUEST_RSP);
-		memcpy(outdata + offset, &winreg_rsp->key_handle,
-						sizeof(KEY_HANDLE));
-		offset += sizeof(KEY_HANDLE);
-		memcpy(outdata + offset, &winreg_rsp->ref_id, sizeof(__u32));
-		offset += sizeof(__u32);
-		memcpy(outdata + offset, &winreg_rsp->action_taken,
-								sizeof(__u32));
-		offset += sizeof(__u32);
-		memcpy(outdata + offset, &winreg_rsp->werror, sizeof(__u32));
-		offset += sizeof(__u32);
-		free(winreg_rsp);
-	}
+/* Windows expects a comment, the share name stands in for none */
+static const char *srvsvc_share_comment(struct cifsd_share *share)
+{
+	return share->config.comment ? share->config.comment :
+		share->sharename;
+}
 
-	if (pipe->opnum == WINREG_ENUMKEY) {
-		ENUM_KEY_RSP *winreg_rsp;
-
-		winreg_rsp = (ENUM_KEY_RSP *)pipe->data;
-		memcpy(outdata + offset, &winreg_rsp->rpc_request_rsp,
-						sizeof(RPC_REQUEST_RSP));
-		offset += sizeof(RPC_REQUEST_RSP);
-		memcpy(outdata + offset, &winreg_rsp->key_name,
-						sizeof(CLASSNAME_INFO));
-		offset += sizeof(CLASSNAME_INFO);
-		memcpy(outdata + offset, &winreg_rsp->key_class_ref_id,
-							sizeof(__u32));
-		offset += sizeof(__u32);
-		memcpy(outdata + offset, &winreg_rsp->key_class,
-						sizeof(NAME_INFO));
-		offset += sizeof(NAME_INFO);
-		memcpy(outdata + offset, &winreg_rsp->last_changed_time_ref_id,
-								sizeof(__u32));
-		offset += sizeof(__u32);
-		memcpy(outdata + offset, &winreg_rsp->last_changed_time,
-						sizeof(__u64));
-		offset += sizeof(__u64);
-		memcpy(outdata + offset, &winreg_rsp->werror, sizeof(__u32));
-		offset += sizeof(__u32);
-		free(winreg_rsp);
-	}
+/* skip the server name a srvsvc call starts with, it is always us */
+static void srvsvc_pull_server_unc(struct cifsd_ndr_reader *r)
+{
+	struct cifsd_ndr_str server_unc;
 
-	if (pipe->opnum == WINREG_ENUMVALUE) {
-		ENUM_VALUE_RSP *winreg_rsp;
-
-		winreg_rsp = (ENUM_VALUE_RSP *)pipe->data;
-		memcpy(outdata + offset, &winreg_rsp->rpc_request_rsp,
-						sizeof(RPC_REQUEST_RSP));
-		offset += sizeof(RPC_REQUEST_RSP);
-		memcpy(outdata + offset, &winreg_rsp->name_len, sizeof(__u16));
-		offset += sizeof(__u16);
-		memcpy(outdata + offset, &winreg_rsp->name_size,
-								sizeof(__u16));
-		offset += sizeof(__u16);
-		memcpy(outdata + offset, &winreg_rsp->name_ref_id,
-								sizeof(__u32));
-		offset += sizeof(__u32);
-		memcpy(outdata + offset, &winreg_rsp->name_str_info,
-							sizeof(UNISTR_INFO));
-		offset += sizeof(UNISTR_INFO);
-		memcpy(outdata + offset, &winreg_rsp->type_info,
-							sizeof(DATA_INFO));
-		offset += sizeof(DATA_INFO);
-		memcpy(outdata + offset, &winreg_rsp->value_ptr,
-								sizeof(__u32));
-		offset += sizeof(__u32);
-		memcpy(outdata + offset, &winreg_rsp->size_info,
-							sizeof(DATA_INFO));
-		offset += sizeof(DATA_INFO);
-		memcpy(outdata + offset, &winreg_rsp->length_info,
-							sizeof(DATA_INFO));
-		offset += sizeof(DATA_INFO);
-		memcpy(outdata + offset, &winreg_rsp->werror,
-							sizeof(__u32));
-		offset += sizeof(__u32);
-		free(winreg_rsp);
-	}
+	cifsd_ndr_pull_ptr_unistr(r, &server_unc);
+}
 
-	if (pipe->opnum == WINREG_QUERYINFOKEY) {
-		QUERY_INFO_KEY_RSP *winreg_rsp;
-
-		winreg_rsp = (QUERY_INFO_KEY_RSP *)pipe->data;
-		memcpy(outdata + offset, &winreg_rsp->rpc_request_rsp,
-						sizeof(RPC_REQUEST_RSP));
-		offset += sizeof(RPC_REQUEST_RSP);
-		memcpy(outdata + offset, &winreg_rsp->class_info,
-						sizeof(CLASSNAME_INFO));
-		offset += sizeof(CLASSNAME_INFO);
-		memcpy(outdata + offset, &winreg_rsp->key_info,
-							sizeof(KEY_INFO));
-		offset += sizeof(KEY_INFO);
-		memcpy(outdata + offset, &winreg_rsp->werror, sizeof(__u32));
-		offset += sizeof(__u32);
-		free(winreg_rsp);
-	}
+/* share list part of a NetShareEnumAll info 1 response */
+static void srvsvc_share_enum_all_body(struct cifsd_ndr *ndr)
+{
+	struct cifsd_share *share;
+	struct list_head *tmp;
+	int num_shares = cifsd_num_shares, cnt = 0, i;
 
-	if (pipe->opnum == WINREG_QUERYVALUE) {
-		QUERY_VALUE_RSP *winreg_rsp;
+	cifsd_ndr_u32(ndr, 1);		/* info_level */
+	cifsd_ndr_u32(ndr, 1);		/* switch_value */
+	cifsd_ndr_u32(ndr, 1);		/* ptr_share_info */
+	cifsd_ndr_u32(ndr, num_shares);
+	cifsd_ndr_u32(ndr, 1);		/* ptr_entries */
+	cifsd_ndr_u32(ndr, num_shares);
 
-		winreg_rsp = (QUERY_VALUE_RSP *)pipe->data;
-		memcpy(outdata + offset, &winreg_rsp->rpc_request_rsp,
-					sizeof(RPC_REQUEST_RSP));
-		offset += sizeof(RPC_REQUEST_RSP);
+	/* shares with names too long for LANMAN are left as empty entries */
+	list_for_each(tmp, &cifsd_share_list) {
+		share = list_entry(tmp, struct cifsd_share, list);
+		if (strlen(share->sharename) + 1 > 13)
+			continue;
 
-		if (winreg_rsp->query_val_info == NULL) {
-			memset(outdata + offset, 0, (sizeof(__u32)*4));
-			offset += (sizeof(__u32)*4);
+		cifsd_ndr_ptr_unistr(ndr, share->sharename);
+		if (!strcmp(share->sharename, STR_IPC)) {
+			cifsd_ndr_u32(ndr, STYPE_IPC_HIDDEN);
+			cifsd_ndr_ptr_unistr(ndr, "IPC SHARE");
 		} else {
-			memcpy(outdata + offset,
-				&winreg_rsp->query_val_info->type_info,
-				sizeof(DATA_INFO));
-			offset += sizeof(DATA_INFO);
-			memcpy(outdata + offset,
-				&winreg_rsp->query_val_info->data_ref_id,
-				sizeof(__u32));
-			offset += sizeof(__u32);
-			memcpy(outdata + offset,
-				&winreg_rsp->query_val_info->data_info,
-				sizeof(UNISTR_INFO));
-			offset += sizeof(UNISTR_INFO);
-			if (winreg_rsp->query_val_info->size_info.info <
-								sizeof(__u32)) {
-				memcpy(outdata + offset,
-					winreg_rsp->query_val_info->Buffer,
-					sizeof(__u32));
-				offset += sizeof(__u32);
-			} else if ((winreg_rsp->query_val_info->size_info.info
-								%2) == 1) {
-				memcpy(outdata + offset,
-				winreg_rsp->query_val_info->Buffer,
-				(winreg_rsp->query_val_info->size_info.info+1));
-				offset +=
-				(winreg_rsp->query_val_info->size_info.info+1);
-			} else {
-				memcpy(outdata + offset,
-				winreg_rsp->query_val_info->Buffer,
-				winreg_rsp->query_val_info->size_info.info);
-				offset +=
-				winreg_rsp->query_val_info->size_info.info;
-			}
-			memcpy(outdata + offset,
-				&winreg_rsp->query_val_info->size_info,
-				sizeof(DATA_INFO));
-			offset += sizeof(DATA_INFO);
-			memcpy(outdata + offset,
-				&winreg_rsp->query_val_info->length_info,
-				sizeof(DATA_INFO));
-			offset += sizeof(DATA_INFO);
-			free(winreg_rsp->query_val_info->Buffer);
-			free(winreg_rsp->query_val_info);
+			cifsd_ndr_u32(ndr, STYPE_DISKTREE);
+			cifsd_ndr_ptr_unistr(ndr, srvsvc_share_comment(share));
 		}
-
-		memcpy(outdata + offset, &winreg_rsp->werror, sizeof(__u32));
-		offset += sizeof(__u32);
-		free(winreg_rsp);
+		cnt++;
 	}
+	for (i = cnt; i < num_shares; i++) {
+		cifsd_ndr_ptr_unistr(ndr, NULL);
+		cifsd_ndr_u32(ndr, 0);
+		cifsd_ndr_ptr_unistr(ndr, NULL);
+	}
+	cifsd_ndr_flush(ndr);
 
-	rpc_request_rsp->hdr.frag_len = offset;
-	rpc_request_rsp->alloc_hint = offset - sizeof(RPC_REQUEST_RSP);
-
-	cifsd_debug("offset = %d size of RPC_REQUEST_RSP = %d\n",
-	offset, sizeof(RPC_REQUEST_RSP));
-	cifsd_debug("frag len = %d alloc_hint = %d\n",
-	rpc_request_rsp->hdr.frag_len, rpc_request_rsp->alloc_hint);
-
-	return offset;
+	cifsd_ndr_u32(ndr, num_shares);	/* total_entries */
+	cifsd_ndr_u32(ndr, 0);		/* resume_handle */
+	cifsd_ndr_u32(ndr, WERR_OK);
 }
 
-/**
- * rpc_read_bind_data() - create RPC response buffer for RPC_BIND request
- * @server:     TCP server instance of connection
- * @out_data:	RPC response out buffer
- *
- * Return:      response length on success, otherwise error number
+/*
+ * NetShareEnumAll responses only change with the share list, their body
+ * is marshalled once per codepage and info level and copied behind the
+ * response header of each call. Entries built for an older share list
+ * generation are rebuilt on use.
  */
-int rpc_read_bind_data(struct cifsd_pipe *pipe, char *out_data)
-{
-	RPC_HDR *hdr = (RPC_HDR *)out_data;
-	int offset = 0;
-	int pipe_type = pipe->pipe_type;
-	RPC_BIND_RSP *rpc_bind_rsp;
-
-	rpc_bind_rsp = (RPC_BIND_RSP *)pipe->data;
-
-	memcpy(out_data, &rpc_bind_rsp->hdr, sizeof(RPC_HDR));
-	offset += sizeof(RPC_HDR);
-
-	memcpy(out_data + offset, &rpc_bind_rsp->bind_info,
-	       sizeof(BIND_ACK_INFO));
-	offset += sizeof(BIND_ACK_INFO);
-
-	memcpy(out_data + offset, &rpc_bind_rsp->addr.sec_addr_len,
-	       sizeof(__u16));
-	offset += sizeof(__u16);
-
-	memcpy(out_data + offset, rpc_bind_rsp->addr.sec_addr,
-		rpc_bind_rsp->addr.sec_addr_len);
-	offset += rpc_bind_rsp->addr.sec_addr_len;
-	offset += (((offset + 3) & ~3) - offset);
-
-	memcpy(out_data + offset, &rpc_bind_rsp->results, sizeof(RPC_RESULTS));
-	offset += sizeof(RPC_RESULTS);
-
-	memcpy(out_data + offset, rpc_bind_rsp->transfer, sizeof(RPC_IFACE));
-	offset += sizeof(RPC_IFACE);
+#define SRVSVC_ENUM_CACHE_SIZE	8
+
+struct srvsvc_enum_cache {
+	char		codepage[CIFSD_CODEPAGE_LEN];
+	__u32		info_level;
+	unsigned int	gen;
+	char		*body;	/* NULL for an unused entry */
+	int		len;
+};
 
-	if (pipe_type == WINREG) {
-		memcpy(out_data + offset, &rpc_bind_rsp->auth,
-							sizeof(RPC_AUTH_INFO));
-		offset += sizeof(RPC_AUTH_INFO);
+static struct srvsvc_enum_cache enum_cache[SRVSVC_ENUM_CACHE_SIZE];
+static unsigned int enum_cache_victim;	/* entry replaced next when full */
+static pthread_mutex_t enum_cache_lock = PTHREAD_MUTEX_INITIALIZER;
 
-		memcpy(out_data + offset, rpc_bind_rsp->Buffer,
-						rpc_bind_rsp->BufferLength);
-		offset += rpc_bind_rsp->BufferLength;
+static int srvsvc_enum_cache_build(struct srvsvc_enum_cache *ent)
+{
+	struct cifsd_ndr ndr;
+	int size = 4096;
+	char *buf;
+
+	for (;;) {
+		buf = malloc(size);
+		if (!buf)
+			return -ENOMEM;
+
+		cifsd_ndr_init(&ndr, buf, size, ent->codepage);
+		srvsvc_share_enum_all_body(&ndr);
+		if (!ndr.err)
+			break;
 
-		free(rpc_bind_rsp->Buffer);
+		free(buf);
+		if (ndr.err != -ENOSPC || size >= RPC_MAX_RSP_SIZE)
+			return ndr.err;
+		size *= 2;
 	}
 
-	hdr->frag_len = offset;
-	hdr->auth_len = rpc_bind_rsp->BufferLength;
-	free(rpc_bind_rsp->addr.sec_addr);
-	free(rpc_bind_rsp->transfer);
-	free(rpc_bind_rsp);
-
-	return offset;
+	free(ent->body);
+	ent->body = buf;
+	ent->len = ndr.offset;
+	ent->gen = cifsd_share_gen;
+	return 0;
 }
 
 /**
- * rpc_read_srvsvc_data() - create RPC response buffer for RPC_REQUEST
- * @server:     TCP server instance of connection
- * @out_data:	RPC response out buffer
- * @buf_len:	RPC response buffer length
+ * srvsvc_enum_cache_get() - look up the NetShareEnumAll response body
+ * @codepage:	codepage the strings are encoded from, of a pipe
+ * @info_level:	info level of the request
+ * @entp:	cache entry found or built
  *
- * Return:      response length on success, otherwise error number
+ * Called with enum_cache_lock and the share lock held, @entp stays valid
+ * until enum_cache_lock is dropped.
+ *
+ * Return:	0 on success, otherwise error number
  */
-int rpc_read_srvsvc_data(struct cifsd_pipe *pipe, char *outdata, int buf_len)
+static int srvsvc_enum_cache_get(char *codepage, __u32 info_level,
+		struct srvsvc_enum_cache **entp)
 {
-	RPC_REQUEST_RSP *rpc_request_rsp = (RPC_REQUEST_RSP *)outdata;
-	int offset = 0, string_len = 0;
-	int i = 0, resume_handle = 0, data_sent = 0, datasize = 0;
-	SRVSVC_SHARE_INFO_CTR *sharectr;
-	SRVSVC_SHARE_GETINFO *shareinfo;
-	WKSSVC_SHARE_GETINFO *wkssvc_info;
-	char *buf = NULL;
-
-
-	sharectr = (SRVSVC_SHARE_INFO_CTR *)pipe->data;
-	memcpy(outdata, &sharectr->rpc_request_rsp, sizeof(RPC_REQUEST_RSP));
-	offset += sizeof(RPC_REQUEST_RSP);
-
-
-	if (pipe->opnum == SRV_NET_SHARE_GETINFO) {
-		shareinfo = (SRVSVC_SHARE_GETINFO *)pipe->data;
-
-		memcpy(outdata + offset, &shareinfo->info_level,
-				sizeof(shareinfo->info_level));
-		offset += sizeof(shareinfo->info_level);
-		memcpy(outdata + offset, &shareinfo->switch_value,
-				sizeof(shareinfo->switch_value));
-		offset += sizeof(shareinfo->switch_value);
-		if (shareinfo->status == WERR_INVALID_NAME)
-			goto out;
-		memcpy(outdata + offset, shareinfo->ptrs,
-				sizeof(PTR_INFO1));
-		offset += sizeof(PTR_INFO1);
-
-		for (i = 0; i < 1; i++) {
-			memcpy(outdata + offset,
-			&shareinfo->shares[i].str_info1, sizeof(UNISTR_INFO));
-			offset += sizeof(UNISTR_INFO);
-
-			string_len =
-				shareinfo->shares[i].str_info1.actual_count * 2;
-
-			memcpy(outdata + offset, shareinfo->shares[i].sharename,
-					string_len);
-			offset += ((string_len + 3) & ~3);
-
-			memcpy(outdata + offset,
-			       &shareinfo->shares[i].str_info2,
-			       sizeof(UNISTR_INFO));
-			offset += sizeof(UNISTR_INFO);
-
-			string_len =
-				shareinfo->shares[i].str_info2.actual_count * 2;
-
-			memcpy(outdata + offset, shareinfo->shares[i].comment,
-					string_len);
-			offset += ((string_len + 3) & ~3);
-		}
-out:
-		memcpy(outdata + offset, &shareinfo->status,
-				sizeof(shareinfo->status));
-		offset += sizeof(shareinfo->status);
-
-		rpc_request_rsp->hdr.frag_len = offset;
-		rpc_request_rsp->alloc_hint = offset - sizeof(RPC_REQUEST_RSP);
-
-		cifsd_debug("frag len = %d alloc_hint = %d\n",
-			       rpc_request_rsp->hdr.frag_len,
-			       rpc_request_rsp->alloc_hint);
-
-		free(shareinfo->shares);
-		free(shareinfo->ptrs);
-		free(shareinfo);
-	}
-
-	if (pipe->opnum == SRV_NET_SHARE_ENUM_ALL) {
-		sharectr = (SRVSVC_SHARE_INFO_CTR *)pipe->data;
-		buf = pipe->buf;
-		data_sent = pipe->sent;
-		datasize = pipe->datasize;
-		resume_handle = sharectr->resume_handle;
-
-		cifsd_debug("num entries = %d\n", sharectr->info.num_entries);
-		if (resume_handle) {
-			memcpy(outdata, pipe->buf + data_sent, resume_handle);
-			datasize = resume_handle;
-			goto finish;
-		}
+	struct srvsvc_enum_cache *ent = NULL;
+	int i, ret;
 
-		if (datasize > buf_len) {
-			memcpy(outdata, buf, buf_len);
-			resume_handle = datasize - buf_len;
-			pipe->sent = buf_len;
-			sharectr->resume_handle = resume_handle;
-		} else {
-			memcpy(outdata, buf, datasize);
+	for (i = 0; i < SRVSVC_ENUM_CACHE_SIZE; i++) {
+		if (!enum_cache[i].body) {
+			if (!ent)
+				ent = &enum_cache[i];
+			continue;
 		}
-
-		rpc_request_rsp->hdr.frag_len = datasize;
-		rpc_request_rsp->alloc_hint = datasize -
-					sizeof(RPC_REQUEST_RSP);
-		cifsd_debug("frag len = %d alloc_hint = %d\n",
-				       rpc_request_rsp->hdr.frag_len,
-				       rpc_request_rsp->alloc_hint);
-		if (resume_handle) {
-			pipe->sent = buf_len;
-			cifsd_debug("Pipe data is outstanding, "
-			"sent %d, remaining %d\n", buf_len, datasize - buf_len);
-			return datasize;
+		if (enum_cache[i].info_level == info_level &&
+		    !strcmp(enum_cache[i].codepage, codepage)) {
+			ent = &enum_cache[i];
+			if (ent->gen == cifsd_share_gen) {
+				*entp = ent;
+				return 0;
+			}
+			break;
 		}
-finish:
-		free(sharectr->shares);
-		free(sharectr->ptrs);
-		free(sharectr);
-		free(pipe->buf);
-		pipe->buf = NULL;
-		pipe->sent = 0;
-		pipe->datasize = 0;
-		return datasize;
 	}
 
-	if (pipe->opnum == 0) {
-		wkssvc_info = (WKSSVC_SHARE_GETINFO *)pipe->data;
-
-		memcpy(outdata + offset, &wkssvc_info->info_level,
-				sizeof(wkssvc_info->info_level));
-		offset += sizeof(wkssvc_info->info_level);
-
-		memcpy(outdata + offset, &wkssvc_info->platform_id,
-					sizeof(wkssvc_info->platform_id));
-		offset += sizeof(wkssvc_info->platform_id);
+	if (!ent) {
+		ent = &enum_cache[enum_cache_victim];
+		enum_cache_victim = (enum_cache_victim + 1) %
+			SRVSVC_ENUM_CACHE_SIZE;
+	}
 
-		memcpy(outdata + offset, &wkssvc_info->refid,
-						sizeof(wkssvc_info->refid));
-		offset += sizeof(wkssvc_info->refid);
+	if (strcmp(ent->codepage, codepage) || ent->info_level != info_level) {
+		free(ent->body);
+		ent->body = NULL;
+		/* the codepage of a pipe, NUL terminated in the array */
+		memcpy(ent->codepage, codepage, CIFSD_CODEPAGE_LEN);
+		ent->info_level = info_level;
+	}
 
-		memcpy(outdata + offset, &wkssvc_info->ref_id1,
-						sizeof(wkssvc_info->ref_id1));
-		offset += sizeof(wkssvc_info->ref_id1);
+	ret = srvsvc_enum_cache_build(ent);
+	if (ret)
+		return ret;
 
-		memcpy(outdata + offset, &wkssvc_info->ref_id2,
-						sizeof(wkssvc_info->ref_id2));
-		offset += sizeof(wkssvc_info->ref_id2);
+	cifsd_debug("share enum response for %s level %u cached, %d bytes\n",
+			codepage, info_level, ent->len);
+	*entp = ent;
+	return 0;
+}
 
-		memcpy(outdata + offset, &wkssvc_info->maj,
-						sizeof(wkssvc_info->maj));
-		offset += sizeof(wkssvc_info->maj);
+static int srvsvc_share_enum_all_encode(struct cifsd_pipe *pipe,
+		RPC_REQUEST_REQ *req, struct cifsd_ndr_reader *r,
+		struct cifsd_ndr *ndr)
+{
+	struct srvsvc_enum_cache *ent;
+	__u32 info_level;
+	int ret;
+
+	srvsvc_pull_server_unc(r);
+	info_level = cifsd_ndr_pull_u32(r);
+	if (r->err)
+		return r->err;
+	if (info_level != INFO_1)
+		return -EOPNOTSUPP;
 
-		memcpy(outdata + offset, &wkssvc_info->min,
-						sizeof(wkssvc_info->min));
-		offset += sizeof(wkssvc_info->min);
+	pthread_mutex_lock(&enum_cache_lock);
+	ret = srvsvc_enum_cache_get(pipe->codepage, INFO_1, &ent);
+	if (!ret) {
+		rpc_rsp_hdr(ndr, req);
+		cifsd_ndr_write(ndr, ent->body, ent->len);
+	}
+	pthread_mutex_unlock(&enum_cache_lock);
 
-		for (i = 0; i < 1; i++) {
-			memcpy(outdata + offset,
-			&wkssvc_info->shares[i].str_info1, sizeof(UNISTR_INFO));
-			offset += sizeof(UNISTR_INFO);
+	if (ret)
+		return ret;
+	return rpc_rsp_done(ndr);
+}
 
-			string_len =
-			wkssvc_info->shares[i].str_info1.actual_count * 2;
+static int srvsvc_share_info_encode(struct cifsd_pipe *pipe,
+		RPC_REQUEST_REQ *req, struct cifsd_ndr_reader *r,
+		struct cifsd_ndr *ndr)
+{
+	struct cifsd_share *share, *found = NULL;
+	struct cifsd_ndr_str share_name;
+	struct list_head *tmp;
+	__u32 info_level;
+
+	srvsvc_pull_server_unc(r);
+	cifsd_ndr_pull_unistr(r, &share_name);
+	info_level = cifsd_ndr_pull_u32(r);
+	if (r->err)
+		return r->err;
+	if (info_level != INFO_1)
+		return -EOPNOTSUPP;
 
-			memcpy(outdata + offset,
-				wkssvc_info->shares[i].server_name, string_len);
-			offset += ((string_len + 3) & ~3);
+	/* compared in place, the name is not copied out */
+	list_for_each(tmp, &cifsd_share_list) {
+		share = list_entry(tmp, struct cifsd_share, list);
+		if (strlen(share->sharename) + 1 <= 13 &&
+		    cifsd_ndr_str_eq(&share_name, share->sharename,
+				    pipe->codepage))
+			found = share;
+	}
 
-			memcpy(outdata + offset,
-			&wkssvc_info->shares[i].str_info2, sizeof(UNISTR_INFO));
-			offset += sizeof(UNISTR_INFO);
+	rpc_rsp_hdr(ndr, req);
+	cifsd_ndr_u32(ndr, 1);		/* info_level */
+	cifsd_ndr_u32(ndr, found ? 1 : 0);	/* switch_value */
+	if (!found) {
+		cifsd_ndr_u32(ndr, WERR_INVALID_NAME);
+		return rpc_rsp_done(ndr);
+	}
 
-			string_len =
-			wkssvc_info->shares[i].str_info2.actual_count * 2;
+	cifsd_ndr_ptr_unistr(ndr, found->sharename);
+	cifsd_ndr_u32(ndr, STYPE_DISKTREE);
+	cifsd_ndr_ptr_unistr(ndr, srvsvc_share_comment(found));
+	cifsd_ndr_flush(ndr);
+	cifsd_ndr_u32(ndr, WERR_OK);
+	return rpc_rsp_done(ndr);
+}
 
-			memcpy(outdata + offset,
-			wkssvc_info->shares[i].domain_name, string_len);
-			offset += ((string_len + 3) & ~3);
-		}
+static int wkssvc_share_info_encode(struct cifsd_pipe *pipe,
+		RPC_REQUEST_REQ *req, struct cifsd_ndr_reader *r,
+		struct cifsd_ndr *ndr)
+{
+	__u32 info_level;
 
-		memcpy(outdata + offset, &wkssvc_info->status,
-				sizeof(wkssvc_info->status));
-		offset += sizeof(wkssvc_info->status);
+	srvsvc_pull_server_unc(r);
+	info_level = cifsd_ndr_pull_u32(r);
+	if (r->err)
+		return r->err;
+	if (info_level != INFO_100)
+		return -EOPNOTSUPP;
 
-		rpc_request_rsp->hdr.frag_len = offset;
-		rpc_request_rsp->alloc_hint = offset - sizeof(RPC_REQUEST_RSP);
+	rpc_rsp_hdr(ndr, req);
+	cifsd_ndr_u32(ndr, INFO_100);
+	cifsd_ndr_u32(ndr, 500);	/* platform_id */
+	cifsd_ndr_u32(ndr, CIFSD_NDR_REF_ID);	/* info */
+	cifsd_ndr_ptr_unistr(ndr, server_string);
+	cifsd_ndr_ptr_unistr(ndr, workgroup);
+	cifsd_ndr_u32(ndr, 4);		/* version major */
+	cifsd_ndr_u32(ndr, 9);		/* version minor */
+	cifsd_ndr_flush(ndr);
+	cifsd_ndr_u32(ndr, WERR_OK);
+	return rpc_rsp_done(ndr);
+}
 
-		cifsd_debug("frag len = %d alloc_hint = %d\n",
-		rpc_request_rsp->hdr.frag_len, rpc_request_rsp->alloc_hint);
+/* srvsvc and wkssvc calls, called with the share lock held */
+static const struct cifsd_rpc_op srvsvc_ops[] = {
+	[WKSSVC_NET_SHARE_GETINFO] = {
+		.name		= "NetWkstaGetInfo",
+		.transact	= wkssvc_share_info_encode,
+		.rsp_size	= 512,
+	},
+	[SRV_NET_SHARE_ENUM_ALL] = {
+		.name		= "NetShareEnumAll",
+		.transact	= srvsvc_share_enum_all_encode,
+		.rsp_size	= 4096,
+	},
+	[SRV_NET_SHARE_GETINFO] = {
+		.name		= "NetShareGetInfo",
+		.transact	= srvsvc_share_info_encode,
+		.rsp_size	= 512,
+	},
+};
 
-		free(wkssvc_info->shares);
-		free(wkssvc_info);
+#ifdef WINREG_SUPPORT
+/* the registry tree is shared by all winreg pipes */
+static pthread_mutex_t winreg_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
 
-	}
-	return offset;
+/* srvsvc calls read the share list, winreg ones change the registry */
+static void rpc_call_lock(unsigned int pipe_type)
+{
+	if (pipe_type == SRVSVC)
+		pthread_rwlock_rdlock(&cifsd_share_lock);
+#ifdef WINREG_SUPPORT
+	else if (pipe_type == WINREG)
+		pthread_mutex_lock(&winreg_lock);
+#endif
 }
 
-/**
- * pipe_data_size() - determine data size on pipe for share list enumeration
- * @server:     TCP server instance of connection
- * @data:	share control specific data
- * @num_shares:	number of shares points on given share control
- *
- * Return:      data size used for share enumeration so far
- */
-int pipe_data_size(struct cifsd_pipe *pipe, void *data, int num_shares)
+static void rpc_call_unlock(unsigned int pipe_type)
 {
-	int size = 0, i, string_len;
-	SRVSVC_SHARE_INFO_CTR *sharectr;
-
-	if (pipe->opnum == SRV_NET_SHARE_ENUM_ALL) {
-		sharectr = (SRVSVC_SHARE_INFO_CTR *)data;
-
-		size += sizeof(RPC_REQUEST_RSP);
-		size += sizeof(SRVSVC_SHARE_COMMON_INFO);
-		size += num_shares * sizeof(PTR_INFO1);
-
-		/* determine the size of share info */
-		for (i = 0; i < num_shares; i++) {
-			size += sizeof(UNISTR_INFO);
-			string_len =
-				sharectr->shares[i].str_info1.actual_count * 2;
-			size += ((string_len + 3) & ~3);
-			size += sizeof(UNISTR_INFO);
-			string_len =
-				sharectr->shares[i].str_info2.actual_count * 2;
-
-			size += ((string_len + 3) & ~3);
-		}
-
-		size += sizeof(sharectr->total_entries);
-		size += sizeof(sharectr->resume_handle);
-		size += sizeof(sharectr->status);
-	}
-	cifsd_debug("Total data length in pipe %d\n", size);
-	return size;
+	if (pipe_type == SRVSVC)
+		pthread_rwlock_unlock(&cifsd_share_lock);
+#ifdef WINREG_SUPPORT
+	else if (pipe_type == WINREG)
+		pthread_mutex_unlock(&winreg_lock);
+#endif
 }
 
-/**
- * pipe_data_copy() - copy share info data on rpc pipe
- * @server:     TCP server instance of connection
- * @buf:	buffer to copy share data
- *
- * Return:      data size copied on buffer
- */
-int pipe_data_copy(struct cifsd_pipe *pipe, char *buf)
+static int rpc_bind_transact(struct cifsd_pipe *pipe,
+		struct cifsd_ndr_reader *r, struct cifsd_ndr *ndr)
 {
-	int offset = 0, i, str_len, num_shares;
-	SRVSVC_SHARE_INFO_CTR *sharectr;
-
-	if (pipe->opnum == SRV_NET_SHARE_ENUM_ALL) {
-		sharectr = (SRVSVC_SHARE_INFO_CTR *)pipe->data;
-		num_shares = sharectr->info.num_entries;
-
-		cifsd_debug("num entries = %d\n", sharectr->info.num_entries);
-		memcpy(buf, &sharectr->rpc_request_rsp,
-						sizeof(RPC_REQUEST_RSP));
-		offset += sizeof(RPC_REQUEST_RSP);
-
-		memcpy(buf + offset, &sharectr->info,
-				sizeof(SRVSVC_SHARE_COMMON_INFO));
-		offset += sizeof(SRVSVC_SHARE_COMMON_INFO);
-
-		memcpy(buf + offset, sharectr->ptrs,
-				num_shares * sizeof(PTR_INFO1));
-		offset += num_shares * sizeof(PTR_INFO1);
+	const RPC_BIND_REQ *req;
+	const RPC_CONTEXT *rpc_context;
+	const RPC_IFACE *transfer;
+	RPC_HDR *hdr;
+	BIND_ACK_INFO bind_info;
+	RPC_RESULTS results;
+	RPC_AUTH_INFO auth;
+	char *pipe_name = NULL;
 
-		for (i = 0; i < num_shares; i++) {
+	req = cifsd_ndr_pull(r, sizeof(*req));
+	rpc_context = cifsd_ndr_pull(r, sizeof(*rpc_context));
+	transfer = cifsd_ndr_pull(r, sizeof(*transfer));
+	if (r->err)
+		return r->err;
 
-			memcpy(buf + offset, &sharectr->shares[i].str_info1,
-					sizeof(UNISTR_INFO));
-			offset += sizeof(UNISTR_INFO);
+	if (pipe->pipe_type == SRVSVC) {
+		if (rpc_context->abstract.version_maj == 3)
+			pipe_name = "\\PIPE\\srvsvc";
+		else if (rpc_context->abstract.version_maj == 1)
+			pipe_name = "\\PIPE\\wkssvc";
+	} else if (pipe->pipe_type == WINREG && !req->hdr.auth_len) {
+		pipe_name = "\\PIPE\\winreg";
+	}
+	/* NTLMSSP binds and bad versions take the two-step path */
+	if (!pipe_name)
+		return -EOPNOTSUPP;
 
-			str_len =
-				sharectr->shares[i].str_info1.actual_count * 2;
+	hdr = (RPC_HDR *)cifsd_ndr_reserve(ndr, sizeof(RPC_HDR));
+	if (!hdr)
+		return ndr->err;
+	dcerpc_header_init(hdr, RPC_BINDACK, RPC_FLAG_FIRST | RPC_FLAG_LAST,
+			req->hdr.call_id);
+
+	pipe->max_xmit_frag = rpc_xmit_frag(req->max_rsize);
+	bind_info.max_tsize = pipe->max_xmit_frag;
+	bind_info.max_rsize = req->max_tsize;
+	bind_info.assoc_gid = 0x53f0;
+	cifsd_ndr_write(ndr, &bind_info, sizeof(bind_info));
+
+	cifsd_ndr_u16(ndr, strlen(pipe_name) + 1);
+	cifsd_ndr_write(ndr, pipe_name, strlen(pipe_name) + 1);
+	cifsd_ndr_align(ndr, 4);
+
+	memset(&results, 0, sizeof(results));
+	results.num_results = 1;
+	cifsd_ndr_write(ndr, &results, sizeof(results));
+	cifsd_ndr_write(ndr, transfer, sizeof(*transfer));
+
+	if (pipe->pipe_type == WINREG) {
+		memset(&auth, 0, sizeof(auth));
+		cifsd_ndr_write(ndr, &auth, sizeof(auth));
+	}
 
-			memcpy(buf + offset, sharectr->shares[i].sharename,
-					str_len);
-			offset += ((str_len + 3) & ~3);
+	if (ndr->err)
+		return ndr->err;
+	hdr->frag_len = ndr->offset;
+	return ndr->offset;
+}
 
-			memcpy(buf + offset, &sharectr->shares[i].str_info2,
-					sizeof(UNISTR_INFO));
-			offset += sizeof(UNISTR_INFO);
+static int rpc_request_transact(struct cifsd_pipe *pipe,
+		struct cifsd_ndr_reader *r, struct cifsd_ndr *ndr)
+{
+	const struct cifsd_rpc_op *op;
+	RPC_REQUEST_REQ *req;
+	int opnum, ret;
 
-			str_len =
-				sharectr->shares[i].str_info2.actual_count * 2;
+	req = (RPC_REQUEST_REQ *)cifsd_ndr_pull(r, sizeof(*req));
+	if (!req)
+		return r->err;
 
-			memcpy(buf + offset, sharectr->shares[i].comment,
-					str_len);
-			offset += ((str_len + 3) & ~3);
+	opnum = le16_to_cpu(req->opnum);
+	op = rpc_find_op(pipe->pipe_type, opnum);
+	if (!op || !op->transact)
+		return -EOPNOTSUPP;
 
-		}
-		memcpy(buf + offset, &sharectr->total_entries,
-				sizeof(sharectr->total_entries));
-		offset += sizeof(sharectr->total_entries);
-		memcpy(buf + offset, &sharectr->resume_handle,
-				sizeof(sharectr->resume_handle));
-		offset += sizeof(sharectr->resume_handle);
-		memcpy(buf + offset, &sharectr->status,
-				sizeof(sharectr->status));
-		offset += sizeof(sharectr->status);
-	}
+	cifsd_stats_set_op(pipe->pipe_type, opnum);
+	rpc_call_lock(pipe->pipe_type);
+	ret = op->transact(pipe, req, r, ndr);
+	rpc_call_unlock(pipe->pipe_type);
 
-	return offset;
+	if (ret >= 0)
+		pipe->opnum = opnum;
+	return ret;
 }
 
 /**
- * dcerpc_header_init() - initialize the header for rpc response
- * @header: pointer to header in response packet
- * @packet_type : DCE/RPC Packet type
- * @flags : DCE/RPC flags
- * @call_id: call_id from RPC request
+ * rpc_transact() - handle a RPC request and encode its response at once
+ * @pipe:	pipe the request came in on
+ * @in_data:	RPC request packet
+ * @in_len:	length of @in_data
+ * @out_data:	RPC response out buffer
+ * @size:	response buffer size
  *
- */
-void dcerpc_header_init(RPC_HDR *header, int packet_type,
-				int flags, int call_id)
-{
-	header->major = RPC_MAJOR_VER;
-	header->minor = RPC_MINOR_VER;
-	header->pkt_type = packet_type;
-	header->flags = flags;
-	header->pack_type[0] = 0x10;
-	header->pack_type[1] = 0;
-	header->pack_type[2] = 0;
-	header->pack_type[3] = 0;
-	header->auth_len = 0;
-	header->call_id  = call_id;
-}
-
-/**
- * init_srvsvc_share_info1() - initialize srvsvc pipe share information
- * @server:		TCP server instance of connection
- * @rpc_request_req:	rpc request
+ * Binds and srvsvc/wkssvc share info requests are encoded straight into
+ * @out_data without building the response on the pipe first. Others, and
+ * responses not fitting in one fragment, go through the process_rpc() and
+ * process_rpc_rsp() path which also reports the errors. The fragments
+ * past the first are left on the pipe for the reads that follow.
  *
- * Return:      0 on success or error number
+ * Responses of pipelined calls still pending on the pipe go out first:
+ * the call is then queued behind them and the oldest one is answered.
+ *
+ * Return:      response length on success, 0 for a request fragment
+ *		other than the last, otherwise error number
  */
-static int init_srvsvc_share_info1(struct cifsd_pipe *pipe,
-				RPC_REQUEST_REQ *rpc_request_req)
+int rpc_transact(struct cifsd_pipe *pipe, char *in_data, int in_len,
+		char *out_data, int size)
 {
-	int num_shares = 0, cnt = 0, len = 0, ret;
-	int total_pipe_data = 0, data_copied = 0;
-	struct list_head *tmp;
-	struct cifsd_share *share;
-	SRVSVC_SHARE_INFO1 *share_info;
-	PTR_INFO1 *ptr_info;
-	int share_name_len, comment_len = 0;
-	RPC_REQUEST_RSP *rpc_request_rsp;
-	SRVSVC_SHARE_INFO_CTR *sharectr;
-	char *buf = NULL;
-
-	num_shares = cifsd_num_shares; // TBD: cifsd_num_shares;
-	sharectr = (SRVSVC_SHARE_INFO_CTR *)
-			calloc(1, sizeof(SRVSVC_SHARE_INFO_CTR));
-	if (!sharectr) {
-		return -ENOMEM;
-	}
-	pipe->data = (char *)sharectr;
+	RPC_HDR *rpc_hdr;
+	struct cifsd_ndr_reader r;
+	struct cifsd_ndr ndr;
+	char *req = in_data;
+	int ret;
 
-	sharectr->ptrs = calloc(1, (num_shares * sizeof(PTR_INFO1)));
+	if (in_len < (int)sizeof(RPC_HDR))
+		return -EINVAL;
 
-	if (!sharectr->ptrs) {
-		free(sharectr);
-		return -ENOMEM;
-	}
-	sharectr->shares = calloc(1, (num_shares * sizeof(SRVSVC_SHARE_INFO1)));
+	ret = rpc_reassemble(pipe, &req, &in_len);
+	if (ret <= 0)
+		return ret;
 
-	if (!sharectr->shares) {
-		free(sharectr->ptrs);
-		free(sharectr);
-		return -ENOMEM;
+	rpc_hdr = (RPC_HDR *)req;
+	cifsd_ndr_reader_init(&r, req, in_len);
+	/* the fast path never answers ahead of the pending responses */
+	if (pipe->data)
+		goto process;
+
+	ret = -EOPNOTSUPP;
+	if (rpc_hdr->pkt_type == RPC_REQUEST) {
+		cifsd_ndr_init(&ndr, out_data, rpc_frag_size(pipe, size),
+				pipe->codepage);
+		ret = rpc_request_transact(pipe, &r, &ndr);
+	} else if (rpc_hdr->pkt_type == RPC_BIND) {
+		cifsd_ndr_init(&ndr, out_data, size, pipe->codepage);
+		ret = rpc_bind_transact(pipe, &r, &ndr);
 	}
 
-	rpc_request_rsp = &sharectr->rpc_request_rsp;
+	if (ret >= 0) {
+		pipe->pkt_type = rpc_hdr->pkt_type;
+		goto out;
+	}
+	/* a request too short for the fast path is for the slow one too */
+	if (ret == -EINVAL)
+		goto out;
 
-	dcerpc_header_init(&rpc_request_rsp->hdr, RPC_RESPONSE,
-				RPC_FLAG_FIRST | RPC_FLAG_LAST,
-				rpc_request_req->hdr.call_id);
-	rpc_request_rsp->context_id = rpc_request_req->context_id;
+process:
+	ret = rpc_process_call(pipe, req, in_len);
+	if (!ret)
+		ret = process_rpc_rsp(pipe, out_data, size);
+out:
+	if (req != in_data)
+		free(req);
+	return ret;
+}
 
-	sharectr->info.info_level = cpu_to_le32(1);
-	sharectr->info.switch_value = cpu_to_le32(1);
-	sharectr->info.ptr_share_info = cpu_to_le32(1);
-	sharectr->info.num_entries = cpu_to_le32(num_shares);
-	sharectr->info.ptr_entries = cpu_to_le32(1);
-	sharectr->info.num_entries2 = cpu_to_le32(num_shares);
+#ifdef WINREG_SUPPORT
+static void winreg_encode_unistr_info(struct cifsd_ndr *ndr,
+		UNISTR_INFO *info)
+{
+	cifsd_ndr_u32(ndr, info->max_count);
+	cifsd_ndr_u32(ndr, info->offset);
+	cifsd_ndr_u32(ndr, info->actual_count);
+}
 
-/*
- * TBD: To replace with actual user configuration part,
- * need to decide complete logic to get this information
- */
-#if 1
-	list_for_each(tmp, &cifsd_share_list) {
-		share_info = &sharectr->shares[cnt];
-		ptr_info = &sharectr->ptrs[cnt];
-		share = list_entry(tmp, struct cifsd_share, list);
-		share_name_len = strlen(share->sharename) + 1;
+static void winreg_encode_data_info(struct cifsd_ndr *ndr, DATA_INFO *info)
+{
+	cifsd_ndr_u32(ndr, info->ref_id);
+	cifsd_ndr_u32(ndr, info->info);
+}
 
-		if (share_name_len > 13) {
-			cifsd_debug("Not displaying share = %s",
-					share->sharename);
-			continue;
-		}
+static void winreg_encode_classname(struct cifsd_ndr *ndr,
+		CLASSNAME_INFO *info)
+{
+	cifsd_ndr_u16(ndr, info->len);
+	cifsd_ndr_u16(ndr, info->size);
+	cifsd_ndr_u32(ndr, info->name);
+}
 
-		if (strcmp(share->sharename, STR_IPC) == 0) {
-			ptr_info->type = STYPE_IPC_HIDDEN;
-			ret = smbConvertToUTF16((__le16 *)share_info->comment,
-					"IPC SHARE", strlen("IPC SHARE"), 256,
-					pipe->codepage);
-			if (ret < 0) {
-				free(sharectr->ptrs);
-				free(sharectr);
-				return -EINVAL;
-			}
-			comment_len = strlen("IPC SHARE") + 1;
-			cifsd_debug("IPC share %s added len = %d\n",
-				       share->sharename, len);
-		} else {
-			ptr_info->type = STYPE_DISKTREE;
-			if (share->config.comment) {
-				ret = smbConvertToUTF16((__le16 *)share_info->comment,
-				share->config.comment, strlen(share->config.comment),
-				256, pipe->codepage);
-				if (ret < 0) {
-					free(sharectr->ptrs);
-					free(sharectr);
-					return -EINVAL;
-				}
-				comment_len = strlen(share->config.comment) + 1;
-			} else {
-				/* Windows expect comment to be non-null
-				   In case comment is not given in conf file,
-				   using sharename as comment */
-				ret = smbConvertToUTF16((__le16 *)share_info->comment,
-				share->sharename, strlen(share->sharename), 256,
-				pipe->codepage);
-				if (ret < 0) {
-					free(sharectr->ptrs);
-					free(sharectr);
-					return -EINVAL;			
-				}
-				comment_len = strlen(share->sharename) + 1;
-			}
-			cifsd_debug("share %s added\n", share->sharename);
-		}
+static void winreg_encode_key(struct cifsd_ndr *ndr, void *rsp)
+{
+	OPENHKEY_RSP *winreg_rsp = rsp;
 
-		cifsd_debug("comment len = %d share len = %d uni len = %d\n",
-				comment_len, share_name_len, len);
+	cifsd_ndr_write(ndr, &winreg_rsp->key_handle, sizeof(KEY_HANDLE));
+	cifsd_ndr_u32(ndr, winreg_rsp->werror);
+}
 
-		/* Since sharename and comment are non-null*/
-		ptr_info->ptr_netname = 1;
-		ptr_info->ptr_remark = 1;
+static void winreg_encode_version(struct cifsd_ndr *ndr, void *rsp)
+{
+	GET_VERSION_RSP *winreg_rsp = rsp;
 
-		ret = smbConvertToUTF16((__le16 *)share_info->sharename,
-				share->sharename, strlen(share->sharename),
-				256, pipe->codepage);
-		if (ret < 0) {
-			free(sharectr->ptrs);
-			free(sharectr);
-			return -EINVAL;
-		}
-		share_info->str_info1.max_count = share_name_len;
-		share_info->str_info1.offset = 0;
-		share_info->str_info1.actual_count = share_name_len;
+	cifsd_ndr_u32(ndr, winreg_rsp->version);
+	cifsd_ndr_u32(ndr, winreg_rsp->werror);
+}
 
-		share_info->str_info2.max_count = comment_len;
-		share_info->str_info2.offset = 0;
-		share_info->str_info2.actual_count = comment_len;
-		cnt++;
-	}
-#endif
+static void winreg_encode_common(struct cifsd_ndr *ndr, void *rsp)
+{
+	WINREG_COMMON_RSP *winreg_rsp = rsp;
 
-	sharectr->total_entries = cpu_to_le32(num_shares);
-	sharectr->resume_handle = 0;
-	sharectr->status = 0;
+	cifsd_ndr_u32(ndr, winreg_rsp->werror);
+}
 
-	total_pipe_data = pipe_data_size(pipe, (void *)sharectr, num_shares);
-	if (total_pipe_data == 0)
-		return 0;
-	buf =  calloc(1, total_pipe_data);
-	if (buf == NULL)
-		return -ENOMEM;
-	pipe->buf = buf;
+static void winreg_encode_create_key(struct cifsd_ndr *ndr, void *rsp)
+{
+	CREATE_KEY_RSP *winreg_rsp = rsp;
 
-	data_copied = pipe_data_copy(pipe, buf);
-	cifsd_debug("data_copied %d, total_pipe_data %d\n", data_copied,
-							total_pipe_data);
-	pipe->datasize = data_copied;
-	return 0;
+	cifsd_ndr_write(ndr, &winreg_rsp->key_handle, sizeof(KEY_HANDLE));
+	cifsd_ndr_u32(ndr, winreg_rsp->ref_id);
+	cifsd_ndr_u32(ndr, winreg_rsp->action_taken);
+	cifsd_ndr_u32(ndr, winreg_rsp->werror);
 }
 
-/**
- * srvsvc_net_share_enum_all() - srvsvc pipe for share list enumeration
- * @server:     TCP server instance of connection
- * @data:	SRVSVC_REQ data
- * @rpc_request_req:	rpc request
- *
- * Return:      0 on success or error number
- */
-static int srvsvc_net_share_enum_all(struct cifsd_pipe *pipe, char *data,
-				RPC_REQUEST_REQ *rpc_request_req)
+static void winreg_encode_enum_key(struct cifsd_ndr *ndr, void *rsp)
 {
-	SRVSVC_REQ *req = (SRVSVC_REQ *)data;
-	SERVER_HANDLE handle;
-	char *server_unc_ptr, *server_unc;
-	int server_unc_len = 0;
-	int ret = 0;
+	ENUM_KEY_RSP *winreg_rsp = rsp;
+
+	winreg_encode_classname(ndr, &winreg_rsp->key_name);
+	cifsd_ndr_u32(ndr, winreg_rsp->key_class_ref_id);
+	cifsd_ndr_u16(ndr, winreg_rsp->key_class.key_packet_len);
+	cifsd_ndr_u16(ndr, winreg_rsp->key_class.key_packet_size);
+	cifsd_ndr_u32(ndr, winreg_rsp->key_class.ref_id);
+	winreg_encode_unistr_info(ndr, &winreg_rsp->key_class.str_info);
+	cifsd_ndr_u32(ndr, winreg_rsp->last_changed_time_ref_id);
+	cifsd_ndr_u64(ndr, winreg_rsp->last_changed_time);
+	cifsd_ndr_u32(ndr, winreg_rsp->werror);
+}
 
-	handle = req->server_unc_handle;
-	server_unc_ptr = (char *)(data + sizeof(SERVER_HANDLE));
-	server_unc = smb_strndup_from_utf16(server_unc_ptr,
-			req->server_unc_handle.handle_info.actual_count, 1,
-			pipe->codepage);
-	if (IS_ERR(server_unc))
-		return PTR_ERR(server_unc);
+static void winreg_encode_enum_value(struct cifsd_ndr *ndr, void *rsp)
+{
+	ENUM_VALUE_RSP *winreg_rsp = rsp;
+
+	cifsd_ndr_u16(ndr, winreg_rsp->name_len);
+	cifsd_ndr_u16(ndr, winreg_rsp->name_size);
+	cifsd_ndr_u32(ndr, winreg_rsp->name_ref_id);
+	winreg_encode_unistr_info(ndr, &winreg_rsp->name_str_info);
+	winreg_encode_data_info(ndr, &winreg_rsp->type_info);
+	cifsd_ndr_u32(ndr, winreg_rsp->value_ptr);
+	winreg_encode_data_info(ndr, &winreg_rsp->size_info);
+	winreg_encode_data_info(ndr, &winreg_rsp->length_info);
+	cifsd_ndr_u32(ndr, winreg_rsp->werror);
+}
 
-	cifsd_debug("server_unc = %s unc size = %d\n", server_unc,
-			handle.handle_info.actual_count);
-	free(server_unc);
+static void winreg_encode_query_info_key(struct cifsd_ndr *ndr, void *rsp)
+{
+	QUERY_INFO_KEY_RSP *winreg_rsp = rsp;
+	KEY_INFO *key_info = &winreg_rsp->key_info;
+
+	winreg_encode_classname(ndr, &winreg_rsp->class_info);
+	cifsd_ndr_u32(ndr, key_info->ptr_num_subkeys);
+	cifsd_ndr_u32(ndr, key_info->ptr_max_subkeylen);
+	cifsd_ndr_u32(ndr, key_info->ptr_max_classlen);
+	cifsd_ndr_u32(ndr, key_info->ptr_num_values);
+	cifsd_ndr_u32(ndr, key_info->ptr_num_valnamelen);
+	cifsd_ndr_u32(ndr, key_info->ptr_max_valbufsize);
+	cifsd_ndr_u32(ndr, key_info->ptr_secdescsize);
+	cifsd_ndr_u64(ndr, key_info->last_changed_time);
+	cifsd_ndr_u32(ndr, winreg_rsp->werror);
+}
 
-	server_unc_len = 2 * handle.handle_info.actual_count;
-	server_unc_len = ((server_unc_len + 3) & ~3);
-	/* Add 2 for Pad */
-	req->info_level = le32_to_cpu(*(server_unc_ptr + server_unc_len));
+static void winreg_encode_query_value(struct cifsd_ndr *ndr, void *rsp)
+{
+	QUERY_VALUE_RSP *winreg_rsp = rsp;
+	QUERY_INFO *info = winreg_rsp->query_val_info;
+	int len;
 
-	switch (req->info_level) {
+	if (!info) {
+		cifsd_ndr_u32(ndr, 0);
+		cifsd_ndr_u32(ndr, 0);
+		cifsd_ndr_u32(ndr, 0);
+		cifsd_ndr_u32(ndr, 0);
+		cifsd_ndr_u32(ndr, winreg_rsp->werror);
+		return;
+	}
 
-	case INFO_1:
-		cifsd_debug("GOT SRVSVC pipe info level %u\n",
-			       req->info_level);
+	winreg_encode_data_info(ndr, &info->type_info);
+	cifsd_ndr_u32(ndr, info->data_ref_id);
+	winreg_encode_unistr_info(ndr, &info->data_info);
+
+	/* the value is padded to 2, and to 4 when shorter than that */
+	len = info->size_info.info;
+	if (len < sizeof(__u32))
+		len = sizeof(__u32);
+	else if (len % 2)
+		len++;
+	cifsd_ndr_write(ndr, info->Buffer, len);
+
+	winreg_encode_data_info(ndr, &info->size_info);
+	winreg_encode_data_info(ndr, &info->length_info);
+	cifsd_ndr_u32(ndr, winreg_rsp->werror);
+}
 
-		ret = init_srvsvc_share_info1(pipe, rpc_request_req);
-		break;
+static void winreg_release_query_value(void *rsp)
+{
+	QUERY_VALUE_RSP *winreg_rsp = rsp;
 
-	default:
-		cifsd_debug("SRVSVC pipe info level %u  not supported\n",
-				req->info_level);
-		return -EOPNOTSUPP;
+	if (winreg_rsp->query_val_info) {
+		free(winreg_rsp->query_val_info->Buffer);
+		free(winreg_rsp->query_val_info);
 	}
-
-	return ret;
 }
 
+/* winreg calls, called with winreg_lock held */
+static const struct cifsd_rpc_op winreg_ops[] = {
+	[WINREG_OPENHKCR] = {
+		.name		= "OpenHKCR",
+		.execute	= winreg_open_root_key,
+		.encode		= winreg_encode_key,
+	},
+	[WINREG_OPENHKCU] = {
+		.name		= "OpenHKCU",
+		.execute	= winreg_open_root_key,
+		.encode		= winreg_encode_key,
+	},
+	[WINREG_OPENHKLM] = {
+		.name		= "OpenHKLM",
+		.execute	= winreg_open_root_key,
+		.encode		= winreg_encode_key,
+	},
+	[WINREG_OPENHKU] = {
+		.name		= "OpenHKU",
+		.execute	= winreg_open_root_key,
+		.encode		= winreg_encode_key,
+	},
+	[WINREG_CLOSEKEY] = {
+		.name		= "CloseKey",
+		.execute	= winreg_close_key,
+		.encode		= winreg_encode_key,
+	},
+	[WINREG_CREATEKEY] = {
+		.name		= "CreateKey",
+		.execute	= winreg_create_key,
+		.encode		= winreg_encode_create_key,
+	},
+	[WINREG_DELETEKEY] = {
+		.name		= "DeleteKey",
+		.execute	= winreg_delete_key,
+		.encode		= winreg_encode_common,
+	},
+	[WINREG_DELETEVALUE] = {
+		.name		= "DeleteValue",
+		.execute	= winreg_delete_value,
+		.encode		= winreg_encode_common,
+	},
+	[WINREG_ENUMKEY] = {
+		.name		= "EnumKey",
+		.execute	= winreg_enum_key,
+		.encode		= winreg_encode_enum_key,
+	},
+	[WINREG_ENUMVALUE] = {
+		.name		= "EnumValue",
+		.execute	= winreg_enum_value,
+		.encode		= winreg_encode_enum_value,
+	},
+	[WINREG_FLUSHKEY] = {
+		.name		= "FlushKey",
+		.execute	= winreg_flush_key,
+		.encode		= winreg_encode_common,
+	},
+	[WINREG_NOTIFYCHANGEKEYVALUE] = {
+		.name		= "NotifyChangeKeyValue",
+		.execute	= winreg_notify_change_key_value,
+		.encode		= winreg_encode_common,
+	},
+	[WINREG_OPENKEY] = {
+		.name		= "OpenKey",
+		.execute	= winreg_open_key,
+		.encode		= winreg_encode_key,
+	},
+	[WINREG_QUERYINFOKEY] = {
+		.name		= "QueryInfoKey",
+		.execute	= winreg_query_info_key,
+		.encode		= winreg_encode_query_info_key,
+	},
+	[WINREG_QUERYVALUE] = {
+		.name		= "QueryValue",
+		.execute	= winreg_query_value,
+		.encode		= winreg_encode_query_value,
+		.release	= winreg_release_query_value,
+	},
+	[WINREG_SETVALUE] = {
+		.name		= "SetValue",
+		.execute	= winreg_set_value,
+		.encode		= winreg_encode_common,
+	},
+	[WINREG_GETVERSION] = {
+		.name		= "GetVersion",
+		.execute	= winreg_get_version,
+		.encode		= winreg_encode_version,
+	},
+};
+#endif
+
+/* supported calls per pipe type, none on LANMAN */
+static const struct {
+	const struct cifsd_rpc_op	*ops;
+	unsigned int			nr_ops;
+} rpc_ifaces[MAX_PIPE] = {
+	[SRVSVC] = {
+		.ops	= srvsvc_ops,
+		.nr_ops	= sizeof(srvsvc_ops) / sizeof(srvsvc_ops[0]),
+	},
+#ifdef WINREG_SUPPORT
+	[WINREG] = {
+		.ops	= winreg_ops,
+		.nr_ops	= sizeof(winreg_ops) / sizeof(winreg_ops[0]),
+	},
+#endif
+};
+
 /**
- * init_srvsvc_share_info2() - get a share information on srvsvc pipe
- * @server:		TCP server instance of connection
- * @rpc_request_req:	rpc request
- * @share_name:		share_name for which information is requested
+ * rpc_find_op() - look up a call of the interface bound to a pipe
+ * @pipe_type:	SRVSVC, WINREG or LANMAN
+ * @opnum:	opnum of the call
  *
- * Return:      0 on success or error number
+ * Return:	the call, NULL if it is not supported
  */
-int init_srvsvc_share_info2(struct cifsd_pipe *pipe,
-			RPC_REQUEST_REQ *rpc_request_req, char *share_name)
+const struct cifsd_rpc_op *rpc_find_op(unsigned int pipe_type,
+		unsigned int opnum)
 {
-	int num_shares = 1, cnt = 0, len = 0;
-	struct list_head *tmp;
-	struct cifsd_share *share;
-	SRVSVC_SHARE_INFO1 *share_info;
-	SRVSVC_SHARE_GETINFO *shareinfo;
-	PTR_INFO1 *ptr_info;
-	int share_name_len, comment_len = 0;
-	RPC_REQUEST_RSP *rpc_request_rsp;
-
-	shareinfo = (SRVSVC_SHARE_GETINFO *)
-			calloc(1, sizeof(SRVSVC_SHARE_GETINFO));
-	if (!shareinfo) {
-		return -ENOMEM;
-	}
+	if (pipe_type >= MAX_PIPE || opnum >= rpc_ifaces[pipe_type].nr_ops)
+		return NULL;
 
-	pipe->data = (char *)shareinfo;
-	shareinfo->ptrs = calloc(1, (num_shares * sizeof(PTR_INFO1)));
-	if (!shareinfo->ptrs) {
-		free(shareinfo);
-		return -ENOMEM;
-	}
+	if (!rpc_ifaces[pipe_type].ops[opnum].name)
+		return NULL;
+	return &rpc_ifaces[pipe_type].ops[opnum];
+}
 
-	shareinfo->shares = calloc(1, num_shares * sizeof(SRVSVC_SHARE_INFO1));
-	if (!shareinfo->shares) {
-		free(shareinfo->ptrs);
-		free(shareinfo);
-		return -ENOMEM;
+/**
+ * rpc_read_bind_data() - create RPC response buffer for RPC_BIND request
+ * @pipe:	pipe holding the response
+ * @out_data:	RPC response out buffer
+ * @size:	response buffer size
+ *
+ * Return:      response length on success, otherwise error number
+ */
+int rpc_read_bind_data(struct cifsd_pipe *pipe, char *out_data, int size)
+{
+	RPC_BIND_RSP *rpc_bind_rsp = (RPC_BIND_RSP *)pipe->data;
+	struct cifsd_ndr ndr;
+	RPC_HDR *hdr;
+
+	cifsd_ndr_init(&ndr, out_data, size, NULL);
+	cifsd_ndr_write(&ndr, &rpc_bind_rsp->hdr, sizeof(RPC_HDR));
+	cifsd_ndr_write(&ndr, &rpc_bind_rsp->bind_info,
+			sizeof(BIND_ACK_INFO));
+	cifsd_ndr_u16(&ndr, rpc_bind_rsp->addr.sec_addr_len);
+	cifsd_ndr_write(&ndr, rpc_bind_rsp->addr.sec_addr,
+			rpc_bind_rsp->addr.sec_addr_len);
+	cifsd_ndr_align(&ndr, 4);
+	cifsd_ndr_write(&ndr, &rpc_bind_rsp->results, sizeof(RPC_RESULTS));
+	cifsd_ndr_write(&ndr, rpc_bind_rsp->transfer, sizeof(RPC_IFACE));
+
+	if (pipe->pipe_type == WINREG) {
+		cifsd_ndr_write(&ndr, &rpc_bind_rsp->auth,
+				sizeof(RPC_AUTH_INFO));
+		cifsd_ndr_write(&ndr, rpc_bind_rsp->Buffer,
+				rpc_bind_rsp->BufferLength);
 	}
 
-	rpc_request_rsp = &shareinfo->rpc_request_rsp;
+	if (ndr.err)
+		return ndr.err;
 
-	dcerpc_header_init(&rpc_request_rsp->hdr, RPC_RESPONSE,
-				RPC_FLAG_FIRST | RPC_FLAG_LAST,
-				rpc_request_req->hdr.call_id);
-	rpc_request_rsp->context_id = rpc_request_req->context_id;
-
-	shareinfo->status = cpu_to_le32(WERR_INVALID_NAME);
-	shareinfo->info_level = cpu_to_le32(1);
-	shareinfo->switch_value = cpu_to_le32(0);
+	hdr = (RPC_HDR *)out_data;
+	hdr->frag_len = ndr.offset;
+	hdr->auth_len = rpc_bind_rsp->BufferLength;
+	rpc_free_response(pipe);
+	return ndr.offset;
+}
 
 /*
- * TBD: To replace with actual user configuration part,
- * need to decide complete logic to get this information
+ * Next fragment of the response on @pipe, of the size negotiated at bind
+ * or of @buf_len if smaller. Stub data of all but the last fragment is a
+ * multiple of 8 bytes.
  */
-#if 1
-	list_for_each(tmp, &cifsd_share_list) {
-		share_info = &shareinfo->shares[cnt];
-		ptr_info = &shareinfo->ptrs[cnt];
-		share = list_entry(tmp, struct cifsd_share, list);
-		share_name_len = strlen(share->sharename) + 1;
-
-		if (share_name_len > 13) {
-			cifsd_err("Not displaying share = %s",
-					share->sharename);
-			continue;
-		}
+static int rpc_read_frag(struct cifsd_pipe *pipe, char *outdata, int buf_len)
+{
+	RPC_REQUEST_RSP *frag = (RPC_REQUEST_RSP *)outdata;
+	int hdr_len = sizeof(RPC_REQUEST_RSP);
+	int left = pipe->datasize - hdr_len - pipe->sent;
+	int len = rpc_frag_size(pipe, buf_len) - hdr_len;
+
+	if (len < 8) {
+		cifsd_debug("read of %d bytes too short for a fragment\n",
+				buf_len);
+		return -ENOSPC;
+	}
 
-		if (strcmp(share->sharename, share_name) == 0) {
-			ptr_info->type = STYPE_DISKTREE;
-			if (share->config.comment) {
-				len =
-				smbConvertToUTF16((__le16 *)share_info->comment,
-				share->config.comment,
-				strlen(share->config.comment),
-				256, pipe->codepage);
-				comment_len = strlen(share->config.comment) + 1;
-			} else {
-				len =
-				smbConvertToUTF16((__le16 *)share_info->comment,
-				share->sharename, strlen(share->sharename),
-				256, pipe->codepage);
-				comment_len = strlen(share->sharename) + 1;
-			}
-			cifsd_debug("share %s added\n", share->sharename);
-
-			shareinfo->switch_value = cpu_to_le32(1);
-			cifsd_debug("comment len = %d share len = %d uni len = %d\n",
-				      comment_len, share_name_len, len);
-
-			/* Since sharename and comment are non-null*/
-			ptr_info->ptr_netname = 1;
-			ptr_info->ptr_remark = 1;
-
-			smbConvertToUTF16((__le16 *)share_info->sharename,
-					  share->sharename,
-					  strlen(share->sharename),
-					  256, pipe->codepage);
-			share_info->str_info1.max_count = share_name_len;
-			share_info->str_info1.offset = 0;
-			share_info->str_info1.actual_count = share_name_len;
-
-			share_info->str_info2.max_count = comment_len;
-			share_info->str_info2.offset = 0;
-			share_info->str_info2.actual_count = comment_len;
-			shareinfo->status = cpu_to_le32(WERR_OK);
-		}
+	if (left > len)
+		len &= ~7;
+	else
+		len = left;
+
+	memcpy(frag, pipe->data, hdr_len);
+	memcpy(outdata + hdr_len, pipe->data + hdr_len + pipe->sent, len);
+	frag->hdr.flags = (pipe->sent ? 0 : RPC_FLAG_FIRST) |
+		(len == left ? RPC_FLAG_LAST : 0);
+	frag->hdr.frag_len = hdr_len + len;
+	frag->alloc_hint = left;
+
+	if (len < left) {
+		pipe->sent += len;
+		cifsd_debug("Pipe data is outstanding, sent %d, remaining %d\n",
+				pipe->sent, left - len);
+	} else {
+		rpc_free_response(pipe);
 	}
-#endif
-	return 0;
+	return hdr_len + len;
 }
 
 /**
- * srvsvc_net_share_info() - get share information on srvsvc pipe
- * @server:		TCP server instance of connection
- * @data:		SRVSVC_REQ data
- * @rpc_request_req:	rpc request
+ * rpc_read_request_data() - read out the fragments of a response
+ * @pipe:	pipe holding the response
+ * @outdata:	RPC response out buffer
+ * @buf_len:	RPC response buffer length
  *
- * parse srvspc packet for share_name. Get share information on requested
- * share_name
+ * The response encoded on the pipe is handed out in fragments of the size
+ * negotiated at bind, each with its own header. A read takes as many of
+ * them back to back as fit in @buf_len, so a response over the fragment
+ * size still goes out in one read when the kernel takes a fragmented
+ * netlink response.
  *
- * Return:      0 on success or error number
+ * Return:      length of the fragments on success, otherwise error number
  */
-int srvsvc_net_share_info(struct cifsd_pipe *pipe, char *data,
-				RPC_REQUEST_REQ *rpc_request_req)
+int rpc_read_request_data(struct cifsd_pipe *pipe, char *outdata, int buf_len)
 {
-	SRVSVC_REQ *req = (SRVSVC_REQ *)data;
-	char *server_unc_ptr, *server_unc;
-	int server_unc_len = 0;
-	int ret = 0;
-	int infolevel_len;
-	UNISTR_INFO *istr_info;
-	char *ptr, *share_name_ptr, *share_name;
-
-	server_unc_ptr = (char *)(data + sizeof(SERVER_HANDLE));
-	server_unc = smb_strndup_from_utf16(server_unc_ptr,
-			req->server_unc_handle.handle_info.actual_count, 1,
-			pipe->codepage);
-	if (IS_ERR(server_unc))
-		return PTR_ERR(server_unc);
-
-	cifsd_debug("server_unc = %s unc size = %d\n", server_unc,
-			req->server_unc_handle.handle_info.actual_count);
-	free(server_unc);
-
-	server_unc_len = 2 * req->server_unc_handle.handle_info.actual_count;
-	server_unc_len = ((server_unc_len + 3) & ~3);
-	/* Add 2 for Pad */
-	istr_info = (UNISTR_INFO *)((char *)(server_unc_ptr + server_unc_len));
-
-	infolevel_len = 2 * istr_info->actual_count;
-	infolevel_len = ((infolevel_len + 3) & ~3);
-
-	cifsd_debug("istr_info->max_count %u, offset %u, actual count %u\n",
-	istr_info->max_count, istr_info->offset, istr_info->actual_count);
-	share_name_ptr = (char *)((char *)istr_info + sizeof(UNISTR_INFO));
-	share_name = smb_strndup_from_utf16(share_name_ptr,
-			istr_info->actual_count, 1, pipe->codepage);
-	if (IS_ERR(share_name))
-		return PTR_ERR(share_name);
-
-	ptr = (char *)((char *)istr_info + infolevel_len + sizeof(UNISTR_INFO));
-	cifsd_debug("Share name is %s\n", share_name);
-	switch (le32_to_cpu(*(ptr))) {
-	case INFO_1:
-		cifsd_debug("GOT SRVSVC pipe info level %u\n",
-			       req->info_level);
-		ret = init_srvsvc_share_info2(pipe, rpc_request_req,
-								share_name);
-		free(share_name);
-		break;
+	int len, nbytes = 0;
 
-	default:
-		cifsd_debug("SRVSVC pipe info level %u  not supported\n",
-				req->info_level);
-		return -EOPNOTSUPP;
+	while (pipe->data) {
+		len = rpc_read_frag(pipe, outdata + nbytes, buf_len - nbytes);
+		if (len < 0)
+			return nbytes ? nbytes : len;
+		nbytes += len;
 	}
-
-	return ret;
+	return nbytes;
 }
 
 /**
- * init_wkssvc_share_info2() - helper function to initialize share info
- *			response on wkssvc pipe
- * @server:		TCP server instance of connection
- * @rpc_request_req:	rpc request
+ * dcerpc_header_init() - initialize the header for rpc response
+ * @header: pointer to header in response packet
+ * @packet_type : DCE/RPC Packet type
+ * @flags : DCE/RPC flags
+ * @call_id: call_id from RPC request
  *
- * Return:      0 on success or error number
  */
-int init_wkssvc_share_info2(struct cifsd_pipe *pipe,
-				RPC_REQUEST_REQ *rpc_request_req)
+void dcerpc_header_init(RPC_HDR *header, int packet_type,
+				int flags, int call_id)
 {
-	WKSSVC_SHARE_INFO1 *share_info;
-	WKSSVC_SHARE_GETINFO *shareinfo;
-	int share_name_len, comment_len, ret;
-	RPC_REQUEST_RSP *rpc_request_rsp;
-
-	shareinfo = (WKSSVC_SHARE_GETINFO *)
-			calloc(1, sizeof(WKSSVC_SHARE_GETINFO));
-	if (!shareinfo) {
-		return -ENOMEM;
-	}
-	pipe->data = (char *)shareinfo;
-	shareinfo->shares = calloc(1, sizeof(WKSSVC_SHARE_INFO1));
+	header->major = RPC_MAJOR_VER;
+	header->minor = RPC_MINOR_VER;
+	header->pkt_type = packet_type;
+	header->flags = flags;
+	header->pack_type[0] = 0x10;
+	header->pack_type[1] = 0;
+	header->pack_type[2] = 0;
+	header->pack_type[3] = 0;
+	header->auth_len = 0;
+	header->call_id  = call_id;
+}
 
-	if (!shareinfo->shares) {
-		free(shareinfo);
-		return -ENOMEM;
+/*
+ * Encode the response of a call up front, rpc_read_request_data() hands it
+ * out in fragments. A transacting call decodes its request from @in over
+ * again for each buffer size tried, an executing one builds its response
+ * on the pipe once, which is then encoded. @in is left as is.
+ */
+static int rpc_encode_call(struct cifsd_pipe *pipe,
+		const struct cifsd_rpc_op *op, RPC_REQUEST_REQ *req,
+		const struct cifsd_ndr_reader *in)
+{
+	struct cifsd_ndr_reader r = *in;
+	struct cifsd_ndr ndr;
+	int size = op->rsp_size ? op->rsp_size : 256, ret;
+	char *rsp = NULL, *buf;
+
+	if (op->execute) {
+		ret = op->execute(pipe, req, &r);
+		rsp = pipe->data;
+		pipe->data = NULL;
+		/* builders free what they allocated when they fail */
+		if (ret || !rsp)
+			return ret;
 	}
 
-	rpc_request_rsp = &shareinfo->rpc_request_rsp;
-
-	dcerpc_header_init(&rpc_request_rsp->hdr, RPC_RESPONSE,
-				RPC_FLAG_FIRST | RPC_FLAG_LAST,
-				rpc_request_req->hdr.call_id);
-	rpc_request_rsp->context_id = rpc_request_req->context_id;
-
-	shareinfo->info_level = cpu_to_le32(100);
-	shareinfo->refid = cpu_to_le32(1);
-	shareinfo->platform_id = cpu_to_le32(500);
-	shareinfo->ref_id1 = cpu_to_le32(1);
-	shareinfo->ref_id2 = cpu_to_le32(1);
-	shareinfo->maj =	cpu_to_le32(4);
-	shareinfo->min = cpu_to_le32(9);
-	share_info = &shareinfo->shares[0];
-
-
-	ret = smbConvertToUTF16((__le16 *)share_info->domain_name,
-			workgroup, strlen(workgroup), 256, pipe->codepage);
-	if (ret < 0) {
-		free(shareinfo);
-		return -EINVAL;
-	}
-	comment_len = strlen(workgroup) + 1;
+	for (;;) {
+		buf = malloc(size);
+		if (!buf) {
+			ret = -ENOMEM;
+			break;
+		}
 
-	share_name_len = strlen(server_string) + 1;
-	cifsd_debug("comment len = %d share len = %d \n",
-			comment_len, share_name_len);
+		cifsd_ndr_init(&ndr, buf, size, pipe->codepage);
+		if (rsp) {
+			/* laid out behind the header it was built with */
+			cifsd_ndr_write(&ndr, rsp, sizeof(RPC_REQUEST_RSP));
+			op->encode(&ndr, rsp);
+			ret = rpc_rsp_done(&ndr);
+		} else {
+			r = *in;
+			ret = op->transact(pipe, req, &r, &ndr);
+		}
+		if (ret >= 0)
+			break;
 
-	ret = smbConvertToUTF16((__le16 *)share_info->server_name,
-			server_string, strlen(server_string), 256,
-			pipe->codepage);
-	if (ret < 0) {
-		free(shareinfo);
-		return -EINVAL;
+		free(buf);
+		if (ret != -ENOSPC || size >= RPC_MAX_RSP_SIZE)
+			break;
+		size *= 2;
 	}
 
-	share_info->str_info1.max_count = share_name_len;
-	share_info->str_info1.offset = 0;
-	share_info->str_info1.actual_count = share_name_len;
-
-	share_info->str_info2.max_count = comment_len;
-	share_info->str_info2.offset = 0;
-	share_info->str_info2.actual_count = comment_len;
-
-	shareinfo->status = cpu_to_le32(0);
-	return 0;
-}
-
-/**
- * wkkssvc_net_share_info() - get share info on wkssvc pipe
- * @server:		TCP server instance of connection
- * @data:		wkssvc request data
- * @rpc_request_req:	rpc request
- *
- * Return:      0 on success or error number
- */
-int wkkssvc_net_share_info(struct cifsd_pipe *pipe, char *data,
-				RPC_REQUEST_REQ *rpc_request_req)
-{
-	SRVSVC_REQ *req = (SRVSVC_REQ *)data;
-	char *server_unc_ptr, *server_unc;
-	int server_unc_len = 0;
-	int ret = 0;
-	int *info_level;
-
-	server_unc_ptr = (char *)(data + sizeof(SERVER_HANDLE));
-	server_unc = smb_strndup_from_utf16(server_unc_ptr,
-			req->server_unc_handle.handle_info.actual_count, 1,
-			pipe->codepage);
-	if (IS_ERR(server_unc))
-		return PTR_ERR(server_unc);
-
-	cifsd_debug("server_unc = %s unc size = %d\n", server_unc,
-			req->server_unc_handle.handle_info.actual_count);
-	free(server_unc);
-
-	server_unc_len = 2 * req->server_unc_handle.handle_info.actual_count;
-	server_unc_len = ((server_unc_len + 3) & ~3);
-	/* Add 2 for Pad */
-	info_level = (int *)((char *)(server_unc_ptr + server_unc_len));
-
-	switch (le32_to_cpu(*info_level)) {
-	case INFO_100:
-		cifsd_debug("GOT WKSSVC pipe info level %u\n",
-			       le32_to_cpu(*info_level));
-
-		ret = init_wkssvc_share_info2(pipe, rpc_request_req);
-		break;
-
-	default:
-		cifsd_err("WKSSVC pipe info level %u  not supported\n",
-				req->info_level);
-		return -EOPNOTSUPP;
+	if (rsp) {
+		if (op->release)
+			op->release(rsp);
+		free(rsp);
 	}
+	if (ret < 0)
+		return ret;
 
-	return ret;
+	pipe->data = buf;
+	pipe->datasize = ret;
+	pipe->sent = 0;
+	return 0;
 }
 
 /**
  * rpc_request() - rpc request dispatcher
- * @server:	TCP server instance of connection
- * @in_data:	wkssvc request data
+ * @pipe:	pipe the request came in on
+ * @in_data:	rpc request data
+ * @in_len:	length of @in_data
  *
- * parse rpc request command number, and call corresponding
- * command handler
+ * Look up the call for the request opnum in the interface table of the
+ * pipe and run it.
  *
  * Return:      0 on success or error number
  */
-static int srvsvc_rpc_request(struct cifsd_pipe *pipe, char *in_data)
+int rpc_request(struct cifsd_pipe *pipe, char *in_data, int in_len)
 {
-	RPC_REQUEST_REQ *rpc_request_req = (RPC_REQUEST_REQ *)in_data;
-	int opnum;
-	char *data;
-	int ret = 0;
-
-	opnum = cpu_to_le16(rpc_request_req->opnum);
-	pipe->opnum = opnum;
-	switch (opnum) {
-	case SRV_NET_SHARE_ENUM_ALL:
-		cifsd_debug("Got SRV_NET_SHARE_ENUM_ALL\n");
-		data = in_data + sizeof(RPC_REQUEST_REQ);
-		ret = srvsvc_net_share_enum_all(pipe, data, rpc_request_req);
-		break;
-	case SRV_NET_SHARE_GETINFO:
-		cifsd_debug("Got SRV_NET_SHARE_GETINFO\n");
-		data = in_data + sizeof(RPC_REQUEST_REQ);
-		ret = srvsvc_net_share_info(pipe, data, rpc_request_req);
-		break;
-	case WKSSVC_NET_SHARE_GETINFO:
-		cifsd_debug("Got WKSSVC_SHARE_GETINFO\n");
-		data = in_data + sizeof(RPC_REQUEST_REQ);
-		ret = wkkssvc_net_share_info(pipe, data, rpc_request_req);
-		break;
-	default:
-		cifsd_debug("WKSSVC pipe opnum not supported = %d\n", opnum);
+	const struct cifsd_rpc_op *op;
+	struct cifsd_ndr_reader r;
+	RPC_REQUEST_REQ *req;
+	int opnum, ret;
+
+	cifsd_ndr_reader_init(&r, in_data, in_len);
+	req = (RPC_REQUEST_REQ *)cifsd_ndr_pull(&r, sizeof(*req));
+	if (!req)
+		return r.err;
+
+	opnum = le16_to_cpu(req->opnum);
+	cifsd_stats_set_op(pipe->pipe_type, opnum);
+	op = rpc_find_op(pipe->pipe_type, opnum);
+	if (!op) {
+		cifsd_debug("pipe %d opnum %d not supported\n",
+				pipe->pipe_type, opnum);
 		return -EOPNOTSUPP;
 	}
-	return ret;
-}
-
-int winreg_rpc_request(struct cifsd_pipe *pipe, char *in_data)
-{
-	RPC_REQUEST_REQ *rpc_request_req = (RPC_REQUEST_REQ *)in_data;
-	int opnum;
-	char *data;
-	int ret = 0;
 
-	opnum = cpu_to_le16(rpc_request_req->opnum);
+	cifsd_debug("pipe %d %s\n", pipe->pipe_type, op->name);
 	pipe->opnum = opnum;
-	data = in_data + sizeof(RPC_REQUEST_REQ);
-	cifsd_debug("Opnum %d\n", opnum);
-
-	switch (opnum) {
-	case WINREG_OPENHKCR:
-		cifsd_debug("Got WINREG_OPENHKCR\n");
-		/* fall through */
-	case WINREG_OPENHKCU:
-		cifsd_debug("Got WINREG_OPENHKCU\n");
-		/* fall through */
-	case WINREG_OPENHKLM:
-		cifsd_debug("Got WINREG_OPENHKLM\n");
-		/* fall through */
-	case WINREG_OPENHKU:
-		cifsd_debug("Got WINREG_OPENHKU\n");
-		ret = winreg_open_root_key(pipe,
-				opnum, rpc_request_req, data);
-		break;
-	case WINREG_GETVERSION:
-		cifsd_debug("Got WINREG_GETVERSION\n");
-		ret = winreg_get_version(pipe, rpc_request_req, data);
-		break;
-	case WINREG_DELETEKEY:
-		cifsd_debug("Got WINREG_DELETEKEY\n");
-		ret = winreg_delete_key(pipe, rpc_request_req, data);
-		break;
-	case WINREG_FLUSHKEY:
-		cifsd_debug("Got WINREG_FLUSHKEY\n");
-		ret = winreg_flush_key(pipe, rpc_request_req, data);
-		break;
-	case WINREG_OPENKEY:
-		cifsd_debug("Got WINREG_OPENKEY\n");
-		ret = winreg_open_key(pipe, rpc_request_req, data);
-		break;
-	case WINREG_CREATEKEY:
-		cifsd_debug("Got WINREG_CREATEKEY\n");
-		ret = winreg_create_key(pipe, rpc_request_req, data);
-		break;
-	case WINREG_CLOSEKEY:
-		cifsd_debug("Got WINREG_CLOSEKEY\n");
-		ret = winreg_close_key(pipe, rpc_request_req, data);
-		break;
-	case WINREG_ENUMKEY:
-		cifsd_debug("Got WINREG_CLOSEKEY\n");
-		ret = winreg_enum_key(pipe, rpc_request_req, data);
-		break;
-	case WINREG_ENUMVALUE:
-		cifsd_debug("Got WINREG_ENUMVALUE\n");
-		ret = winreg_enum_value(pipe, rpc_request_req, data);
-		break;
-	case WINREG_QUERYINFOKEY:
-		cifsd_debug("Got WINREG_QUERYINFOKEY\n");
-		ret = winreg_query_info_key(pipe, rpc_request_req, data);
-		break;
-	case WINREG_NOTIFYCHANGEKEYVALUE:
-		cifsd_debug("Got WINREG_NOTIFYCHANGEKEYVALUE\n");
-		ret = winreg_notify_change_key_value(pipe, rpc_request_req,
-									data);
-		break;
-	case WINREG_SETVALUE:
-		cifsd_debug("Got WINREG_SETVALUE\n");
-		ret = winreg_set_value(pipe, rpc_request_req, data);
-		break;
-	case WINREG_QUERYVALUE:
-		cifsd_debug("Got WINREG_QUERYVALUE\n");
-		ret = winreg_query_value(pipe, rpc_request_req, data);
-		break;
-	case WINREG_DELETEVALUE:
-		cifsd_debug("Got WINREG_DELETEVALUE\n");
-		ret = winreg_delete_value(pipe, rpc_request_req, data);
-		break;
-	default:
-		cifsd_debug("WINREG pipe opnum not supported = %d\n", opnum);
-		return -EOPNOTSUPP;
-	}
-	return ret;
-}
-
-int rpc_request(struct cifsd_pipe *pipe, char *in_data)
-{
-	int ret = 0;
-	cifsd_debug("server pipe request %d\n", pipe->pipe_type);
-	switch (pipe->pipe_type) {
-	case SRVSVC:
-		cifsd_debug("SRVSVC pipe\n");
-		ret = srvsvc_rpc_request(pipe, in_data);
-		break;
-	case WINREG:
-		cifsd_debug("WINREG pipe\n");
-#ifdef WINREG_SUPPORT
-		ret = winreg_rpc_request(pipe, in_data);
-		break;
-#else
-		return -EOPNOTSUPP;
-#endif
-	default:
-		cifsd_debug("pipe not supported\n");
-		return -EOPNOTSUPP;
-	}
+	rpc_call_lock(pipe->pipe_type);
+	ret = rpc_encode_call(pipe, op, req, &r);
+	rpc_call_unlock(pipe->pipe_type);
 	return ret;
 }
 
@@ -1433,26 +1392,30 @@ int rpc_request(struct cifsd_pipe *pipe, char *in_data)
  * rpc_bind() - rpc bind request handler
  * @server:	TCP server instance of connection
  * @in_data:	rpc bind request data
+ * @in_len:	length of @in_data
  *
  * Return:      0 on success or error number
  */
-int rpc_bind(struct cifsd_pipe *pipe, char *in_data)
+int rpc_bind(struct cifsd_pipe *pipe, char *in_data, int in_len)
 {
-	RPC_BIND_REQ *rpc_bind_req = (RPC_BIND_REQ *)in_data;
+	const RPC_BIND_REQ *rpc_bind_req;
 	char *pipe_name = NULL;
 	int len;
-	RPC_CONTEXT *rpc_context;
-	RPC_IFACE *transfer;
+	const RPC_CONTEXT *rpc_context;
+	const RPC_IFACE *transfer;
 	RPC_BIND_RSP *rpc_bind_rsp;
+	struct cifsd_ndr_reader r;
 	int version_maj;
 	int pipe_type;
 	int num_ctx;
-	int i = 0;
-	int offset = 0;
 
-	rpc_context = (RPC_CONTEXT *)(((char *)in_data) + sizeof(RPC_BIND_REQ));
-	transfer = (RPC_IFACE *)(((char *)in_data) + sizeof(RPC_BIND_REQ) +
-				   sizeof(RPC_CONTEXT));
+	cifsd_ndr_reader_init(&r, in_data, in_len);
+	rpc_bind_req = cifsd_ndr_pull(&r, sizeof(*rpc_bind_req));
+	rpc_context = cifsd_ndr_pull(&r, sizeof(*rpc_context));
+	transfer = cifsd_ndr_pull(&r, sizeof(*transfer));
+	if (r.err)
+		return r.err;
+
 	rpc_bind_rsp = (RPC_BIND_RSP *) calloc(1, sizeof(RPC_BIND_RSP));
 	if (!rpc_bind_rsp)
 		return -ENOMEM;
@@ -1475,9 +1438,10 @@ int rpc_bind(struct cifsd_pipe *pipe, char *in_data)
 	cifsd_debug("incoming call id = %u frag_len = %u\n",
 		      rpc_bind_req->hdr.call_id, rpc_bind_req->hdr.frag_len);
 
-	/* Update bind info */
-	rpc_bind_rsp->bind_info.max_tsize = rpc_bind_req->max_tsize;
-	rpc_bind_rsp->bind_info.max_rsize = rpc_bind_req->max_rsize;
+	/* Update bind info, fragments sent are sized to what the client takes */
+	pipe->max_xmit_frag = rpc_xmit_frag(rpc_bind_req->max_rsize);
+	rpc_bind_rsp->bind_info.max_tsize = pipe->max_xmit_frag;
+	rpc_bind_rsp->bind_info.max_rsize = rpc_bind_req->max_tsize;
 	/* Using hard coded assoc_gid value */
 	rpc_bind_rsp->bind_info.assoc_gid = 0x53f0;
 
@@ -1497,21 +1461,28 @@ int rpc_bind(struct cifsd_pipe *pipe, char *in_data)
 		pipe_name = "\\PIPE\\winreg";
 		rpc_bind_rsp->BufferLength = 0;
 		if (rpc_bind_req->hdr.auth_len != 0) {
-			NEGOTIATE_MESSAGE *negblob;
+			const NEGOTIATE_MESSAGE *negblob;
 			CHALLENGE_MESSAGE *chgblob;
 			__le16 name[8];
-			while (i < num_ctx) {
-				offset  = offset + sizeof(RPC_CONTEXT);
-				i++;
-			}
+
 			rpc_bind_rsp->auth.auth_type = 10;
 			rpc_bind_rsp->auth.auth_level = 6;
 			rpc_bind_rsp->auth.auth_pad_len = 0;
 			rpc_bind_rsp->auth.auth_reserved = 0;
 			rpc_bind_rsp->auth.auth_ctx_id = 1;
-			negblob = (NEGOTIATE_MESSAGE *)(((char *)in_data) +
-						sizeof(RPC_BIND_REQ) +
-						offset + sizeof(RPC_AUTH_INFO));
+
+			/* only the signature and type are looked at */
+			r.offset = sizeof(RPC_BIND_REQ);
+			cifsd_ndr_pull(&r, num_ctx * sizeof(RPC_CONTEXT) +
+					sizeof(RPC_AUTH_INFO));
+			negblob = cifsd_ndr_pull(&r,
+					offsetof(NEGOTIATE_MESSAGE,
+						NegotiateFlags));
+			if (!negblob) {
+				free(rpc_bind_rsp->addr.sec_addr);
+				free(rpc_bind_rsp);
+				return r.err;
+			}
 			if (!memcmp(negblob->Signature, "NTLMSSP", 8))
 				cifsd_debug("%s NTLMSSP present\n", __func__);
 			else
@@ -1569,85 +1540,95 @@ int rpc_bind(struct cifsd_pipe *pipe, char *in_data)
 	return 0;
 }
 
+/* remark listed for a share by RAP_NetshareEnum */
+static const char *lanman_share_remark(struct cifsd_share *share)
+{
+	if (strcmp(share->sharename, STR_IPC) == 0)
+		return "IPC share";
+	if (share->config.comment)
+		return share->config.comment;
+	return share->sharename;
+}
+
 /**
  * handle_netshareenum_info1() - helper function for share info using LANMAN
  *		request
  * @server:	TCP server instance of connection
  * @in_params:	LANMAN request parameters
  * @out_data:	output response buffer
+ * @out_len:	size of @out_data
+ *
+ * Shares not fitting @out_len are left out and reported with
+ * ERROR_MORE_DATA, the entries available still count them.
  *
  * Return:      response buffer size or error number
  */
 static int handle_netshareenum_info1(struct cifsd_pipe *pipe,
-				     LANMAN_PARAMS *in_params, char *out_data)
+				     LANMAN_PARAMS *in_params, char *out_data,
+				     int out_len)
 {
 	LANMAN_NETSHAREENUM_RESP *resp;
 	NETSHAREINFO1 *info1;
-	struct list_head *tmp;
 	struct cifsd_share *share;
-	int out_buffersize, comment_len = 0, comment_offset;
-	int num_shares = 0;
-	char *comment_buf;
+	int out_buffersize, len, comment_offset;
+	int num_shares, nr_entries = 0, i = 0;
+	const char *remark;
 
 	resp = (LANMAN_NETSHAREENUM_RESP *)out_data;
 	info1 = (NETSHAREINFO1 *)resp->RAPOutData;
 	num_shares = cifsd_num_shares;
-	comment_offset = num_shares * sizeof(NETSHAREINFO1);
 
-/*
- * TBD: To replace with actual user configuration part,
- * need to decide complete logic to get this information
- */
-#if 1
-	list_for_each(tmp, &cifsd_share_list) {
-		memset(info1, 0, sizeof(NETSHAREINFO1));
-		share = list_entry(tmp, struct cifsd_share, list);
-		memcpy(info1->NetworkName, share->sharename,
-			strlen(share->sharename));
+	out_buffersize = sizeof(LANMAN_NETSHAREENUM_RESP) - 1;
+	if (out_buffersize > out_len)
+		return -ENOSPC;
 
-		comment_buf = resp->RAPOutData + comment_offset;
+	/* the entries are followed by their remarks, count those fitting */
+	list_for_each_entry(share, &cifsd_share_list, list) {
+		len = sizeof(NETSHAREINFO1) +
+			strlen(lanman_share_remark(share)) + 1;
+		if (len > out_len - out_buffersize)
+			break;
+		out_buffersize += len;
+		nr_entries++;
+	}
 
-		info1->RemarkOffsetLow = comment_offset;
+	comment_offset = nr_entries * sizeof(NETSHAREINFO1);
+	list_for_each_entry(share, &cifsd_share_list, list) {
+		if (i++ == nr_entries)
+			break;
 
-		info1->RemarkOffsetHigh = 0;
+		memset(info1, 0, sizeof(NETSHAREINFO1));
+		/* the last byte of NetworkName stays the terminator */
+		len = strlen(share->sharename);
+		if (len > (int)sizeof(info1->NetworkName) - 1)
+			len = sizeof(info1->NetworkName) - 1;
+		memcpy(info1->NetworkName, share->sharename, len);
 
-		if (strcmp(share->sharename, STR_IPC) == 0) {
+		if (strcmp(share->sharename, STR_IPC) == 0)
 			info1->Type = STYPE_IPC;
-			comment_len = strlen("IPC share");
-			memcpy(comment_buf, "IPC share", comment_len);
-		} else {
-			if (share->config.comment) {
-				comment_len = strlen(share->config.comment);
-				memcpy(comment_buf, share->config.comment,
-				       comment_len);
-			} else {
-				comment_len = strlen(share->sharename);
-				memcpy(comment_buf, share->config.comment,
-				       comment_len);
-			}
+		else
 			info1->Type = STYPE_DISKTREE;
-		}
 
-		/* Increment for '\0' */
-		comment_buf[comment_len] = '\0';
-		comment_len++;
-		comment_offset += comment_len;
+		remark = lanman_share_remark(share);
+		len = strlen(remark) + 1;
+		memcpy(resp->RAPOutData + comment_offset, remark, len);
+		info1->RemarkOffsetLow = comment_offset;
+		info1->RemarkOffsetHigh = 0;
+		comment_offset += len;
 
 		cifsd_debug("share %s added comment_offset = %d\n",
 				share->sharename, comment_offset);
 		info1++;
 	}
-#endif
 
-	out_buffersize = sizeof(LANMAN_NETSHAREENUM_RESP) - 1 + comment_offset;
-
-	resp->Win32ErrorCode = 0;
+	/* same value as ERROR_MORE_DATA of the RAP status */
+	resp->Win32ErrorCode = nr_entries < num_shares ? WERR_MORE_DATA : 0;
 	resp->Converter = 0;
-	resp->EntriesReturned = num_shares;
+	resp->EntriesReturned = nr_entries;
 	resp->EntriesAvailable = num_shares;
 
-	cifsd_debug("num_shares = %d out buffer size = %d\n",
-			num_shares, out_buffersize);
+	cifsd_debug("num_shares = %d returned %d out buffer size = %d\n",
+			num_shares, nr_entries, out_buffersize);
 
 	return out_buffersize;
 }
@@ -1655,38 +1636,31 @@ static int handle_netshareenum_info1(struct cifsd_pipe *pipe,
 /**
  * handle_netshareenum() - get share info using LANMAN request
  * @server:	TCP server instance of connection
- * @req:	LANMAN request
+ * @r:		LANMAN request, positioned behind the opcode
  * @out_data:	output response buffer
+ * @out_len:	size of @out_data
  *
  * Return:      response buffer size or error number
  */
-static int handle_netshareenum(struct cifsd_pipe *pipe, LANMAN_REQ *req,
-				char *out_data)
+static int handle_netshareenum(struct cifsd_pipe *pipe,
+			struct cifsd_ndr_reader *r, char *out_data,
+			int out_len)
 {
-	char *paramdesc, *datadesc;
-	int paramdesc_len, datadesc_len;
+	const char *paramdesc, *datadesc;
 	LANMAN_PARAMS *in_params;
 	int info_level;
 	int ret = 0;
 
-	paramdesc = (char *)req->ParamDesc;
-
-	paramdesc_len = strlen("WrLeh") + 1;
-	cifsd_debug("paramdesc = %s paramdesc_len = %d\n",
-			paramdesc, paramdesc_len);
+	paramdesc = cifsd_ndr_pull_cstr(r);
+	datadesc = cifsd_ndr_pull_cstr(r);
+	in_params = (LANMAN_PARAMS *)cifsd_ndr_pull(r, sizeof(*in_params));
+	if (r->err)
+		return r->err;
 
+	cifsd_debug("paramdesc = %s datadesc = %s\n", paramdesc, datadesc);
 	if (strcmp(paramdesc, "WrLeh") != 0)
 		return -EOPNOTSUPP;
 
-	datadesc = (char *)(req->ParamDesc + paramdesc_len);
-
-	datadesc_len = strlen(datadesc) + 1;
-
-	cifsd_debug("datadesc = %s datadesc_len = %d\n",
-			datadesc, datadesc_len);
-
-	in_params = (LANMAN_PARAMS *)(datadesc + datadesc_len);
-
 	info_level = le16_to_cpu(in_params->InfoLevel);
 
 	cifsd_debug("info_level = %d\n", info_level);
@@ -1694,7 +1668,8 @@ static int handle_netshareenum(struct cifsd_pipe *pipe, LANMAN_REQ *req,
 	switch (info_level) {
 	case INFO_1:
 		cifsd_debug("GOT RAP_NetshareEnum Info1\n");
-		ret = handle_netshareenum_info1(pipe, in_params, out_data);
+		ret = handle_netshareenum_info1(pipe, in_params, out_data,
+				out_len);
 		break;
 	default:
 		cifsd_debug("Info level = %d not supported\n", info_level);
@@ -1799,38 +1774,29 @@ int handle_wkstagetinfo_info10(struct cifsd_pipe *pipe,
  * handle_wkstagetinfo() - handle target info command using
  *			LANMAN request
  * @server:	TCP server instance of connection
- * @in_params:	LANMAN request parameters
+ * @r:		LANMAN request, positioned behind the opcode
  * @out_data:	output response buffer
  *
  * Return:      response buffer size or error number
  */
 int handle_wkstagetinfo(struct cifsd_pipe *pipe,
-			LANMAN_REQ *req, char *out_data)
+			struct cifsd_ndr_reader *r, char *out_data)
 {
-	char *paramdesc, *datadesc;
-	int paramdesc_len, datadesc_len;
+	const char *paramdesc, *datadesc;
 	LANMAN_PARAMS *in_params;
 	int info_level;
 	int ret = 0;
 
-	paramdesc = (char *)req->ParamDesc;
-
-	paramdesc_len = strlen("WrLh") + 1;
-	cifsd_debug("paramdesc = %s paramdesc_len = %d\n",
-			paramdesc, paramdesc_len);
+	paramdesc = cifsd_ndr_pull_cstr(r);
+	datadesc = cifsd_ndr_pull_cstr(r);
+	in_params = (LANMAN_PARAMS *)cifsd_ndr_pull(r, sizeof(*in_params));
+	if (r->err)
+		return r->err;
 
+	cifsd_debug("paramdesc = %s datadesc = %s\n", paramdesc, datadesc);
 	if (strcmp(paramdesc, "WrLh") != 0)
 		return -EOPNOTSUPP;
 
-	datadesc = (char *)(req->ParamDesc + paramdesc_len);
-
-	datadesc_len = strlen(datadesc) + 1;
-
-	cifsd_debug("datadesc = %s datadesc_len = %d\n",
-			datadesc, datadesc_len);
-
-	in_params = (LANMAN_PARAMS *)(datadesc + datadesc_len);
-
 	info_level = le16_to_cpu(in_params->InfoLevel);
 
 	cifsd_debug("info_level = %d\n", info_level);
@@ -1852,24 +1818,31 @@ int handle_wkstagetinfo(struct cifsd_pipe *pipe,
  * handle_lanman_pipe() - dispatcher for LANMAN pipe requests
  * @server:	TCP server instance of connection
  * @in_data:	LANMAN request parameters
+ * @in_len:	length of @in_data
  * @out_data:	output response buffer
+ * @out_len:	size of @out_data
  * @param_len:	LANMAN request parameters length
  *
  * Return:      response buffer size or error number
  */
-int handle_lanman_pipe(struct cifsd_pipe *pipe, char *in_data,
-		       char *out_data, int *param_len)
+int handle_lanman_pipe(struct cifsd_pipe *pipe, char *in_data, int in_len,
+		       char *out_data, int out_len, int *param_len)
 {
-	LANMAN_REQ *req = (LANMAN_REQ *)in_data;
+	struct cifsd_ndr_reader r;
 	int opcode;
 	int ret = 0;
 
-	opcode = le16_to_cpu(req->RAPOpcode);
+	cifsd_ndr_reader_init(&r, in_data, in_len);
+	opcode = cifsd_ndr_pull_u16(&r);
+	if (r.err)
+		return r.err;
+	cifsd_stats_set_op(LANMAN, opcode);
 
+	pthread_rwlock_rdlock(&cifsd_share_lock);
 	switch (opcode) {
 	case RAP_NetshareEnum:
 		cifsd_debug("GOT RAP_NetshareEnum\n");
-		ret = handle_netshareenum(pipe, req, out_data);
+		ret = handle_netshareenum(pipe, &r, out_data, out_len);
 		if (ret < 0)
 			ret = -EOPNOTSUPP;
 		else
@@ -1877,7 +1850,7 @@ int handle_lanman_pipe(struct cifsd_pipe *pipe, char *in_data,
 		break;
 	case RAP_WkstaGetInfo:
 		cifsd_debug("GOT RAP_WkstaGetInfo\n");
-		ret = handle_wkstagetinfo(pipe, req, out_data);
+		ret = handle_wkstagetinfo(pipe, &r, out_data);
 		if (ret < 0)
 			ret = -EOPNOTSUPP;
 		else
@@ -1887,6 +1860,7 @@ int handle_lanman_pipe(struct cifsd_pipe *pipe, char *in_data,
 		cifsd_debug("opcode = %d not supported\n", opcode);
 		ret = -EOPNOTSUPP;
 	}
+	pthread_rwlock_unlock(&cifsd_share_lock);
 
 	return ret;
 }
@@ -24,6 +24,7 @@
 
 #include "cifsd.h"
 #include "ntlmssp.h"
+#include "ndr.h"
 
 /* these are win32 error codes. */
 #define WERR_OK			0x00000000
@@ -199,84 +200,6 @@ typedef struct unistr_info {
 	__u32 actual_count;
 } __attribute__((packed)) UNISTR_INFO;
 
-typedef struct server_handle {
-	__u32 ref_id;
-	UNISTR_INFO handle_info;
-} __attribute__((packed)) SERVER_HANDLE;
-
-typedef struct srvsvc_req {
-	SERVER_HANDLE server_unc_handle;
-	char  *server_unc; /* unicode */
-	__u32 info_level;
-} SRVSVC_REQ;
-
-typedef struct srvsvc_share_ptr_info1 {
-	__u32 ptr_netname; /* pointer to net name. */
-	__u32 type; /* ipc, print, disk ... */
-	__u32 ptr_remark; /* pointer to comment. */
-} __attribute__((packed)) PTR_INFO1;
-
-typedef struct srvsvc_share_info1 {
-	UNISTR_INFO str_info1;
-	char sharename[256];
-	UNISTR_INFO str_info2;
-	char comment[256];
-} SRVSVC_SHARE_INFO1;
-
-typedef struct srvsvc_share_common_info {
-	__u32 info_level;
-	__u32 switch_value;
-	__u32 ptr_share_info;
-
-	__u32 num_entries;
-	__u32 ptr_entries;
-	__u32 num_entries2;
-} __attribute__((packed)) SRVSVC_SHARE_COMMON_INFO;
-
-typedef struct srvsvc_share_info_ctr {
-	RPC_REQUEST_RSP rpc_request_rsp;
-	SRVSVC_SHARE_COMMON_INFO info;
-
-	PTR_INFO1 *ptrs;
-	SRVSVC_SHARE_INFO1 *shares;
-	__u32 total_entries;
-	__u32 resume_handle;
-	__u32 status;
-} SRVSVC_SHARE_INFO_CTR;
-
-typedef struct srvsvc_share_getinfo {
-	RPC_REQUEST_RSP rpc_request_rsp;
-	__u32 info_level;
-	__u32 switch_value;
-	__u32 ptr_share_info;
-
-	PTR_INFO1 *ptrs;
-
-	SRVSVC_SHARE_INFO1 *shares;
-	__u32 status;
-} SRVSVC_SHARE_GETINFO;
-
-typedef struct wkssvc_share_info1 {
-	UNISTR_INFO str_info1;
-	char server_name[256];
-	UNISTR_INFO str_info2;
-	char domain_name[256];
-} WKSSVC_SHARE_INFO1;
-
-
-typedef struct wkssvc_share_getinfo {
-	RPC_REQUEST_RSP rpc_request_rsp;
-	__u32 info_level;
-	__u32 refid;
-	__u32 platform_id;
-	__u32 ref_id1;
-	__u32 ref_id2;
-	__u32 maj;
-	__u32 min;
-	WKSSVC_SHARE_INFO1 *shares;
-	__u32 status;
-} WKSSVC_SHARE_GETINFO;
-
 /* LANMAN PIPE STRUCTURES */
 
 typedef struct lanman_params {
@@ -284,11 +207,6 @@ typedef struct lanman_params {
 	__u16 ReceiveBufferSize;
 } __attribute__((packed)) LANMAN_PARAMS;
 
-typedef struct lanman_req {
-	__u16 RAPOpcode;
-	__u8  ParamDesc[1];
-} __attribute__((packed)) LANMAN_REQ;
-
 typedef struct lanman_netshareenum_resp {
 	__u16 Win32ErrorCode;
 	__u16 Converter;
@@ -324,29 +242,51 @@ typedef struct netwkstageinfo10 {
 
 /* DCERPC Functions */
 
-int process_rpc(struct cifsd_pipe *pipe, char *data);
+#define RPC_MAX_RSP_SIZE	(1 << 20)	/* largest response built */
+#define RPC_MAX_REQ_SIZE	0xffff		/* largest request reassembled */
+#define RPC_MIN_FRAG_SIZE	1432		/* smallest max_rsize honoured */
+
+/*
+ * A call of a DCERPC interface, the interface tables are indexed by opnum.
+ * A call either transacts, decoding its request and encoding the whole
+ * response at once, or executes, building the response on pipe->data for
+ * encode to write out right after.
+ */
+struct cifsd_rpc_op {
+	const char	*name;
+	int		(*transact)(struct cifsd_pipe *pipe, RPC_REQUEST_REQ *req,
+				struct cifsd_ndr_reader *r,
+				struct cifsd_ndr *ndr);
+	int		(*execute)(struct cifsd_pipe *pipe, RPC_REQUEST_REQ *req,
+				struct cifsd_ndr_reader *r);
+	void		(*encode)(struct cifsd_ndr *ndr, void *rsp);
+	void		(*release)(void *rsp);	/* frees what rsp points to */
+	int		rsp_size;	/* encode buffer to start with, 0 for 256 */
+};
+
+const struct cifsd_rpc_op *rpc_find_op(unsigned int pipe_type,
+		unsigned int opnum);
+
+int process_rpc(struct cifsd_pipe *pipe, char *data, int len);
 int process_rpc_rsp(struct cifsd_pipe *pipe, char *data_buf, int size);
+void rpc_free_pipe_data(struct cifsd_pipe *pipe);
+int rpc_transact(struct cifsd_pipe *pipe, char *in_data, int in_len,
+		char *out_data, int size);
 
 void dcerpc_header_init(RPC_HDR *header, int packet_type,
 					int flags, int call_id);
-int rpc_bind(struct cifsd_pipe *pipe, char *data);
-int rpc_request(struct cifsd_pipe *pipe, char *data);
-int rpc_read_bind_data(struct cifsd_pipe *pipe, char *data);
-int rpc_read_winreg_data(struct cifsd_pipe *pipe, char *outdata,
-							int buf_len);
-
-int winreg_rpc_request(struct cifsd_pipe *pipe, char *in_data);
-/* SRVSVC pipe function */
-
-int rpc_read_srvsvc_data(struct cifsd_pipe *pipe,
-					char *data, int buf_len);
+int rpc_bind(struct cifsd_pipe *pipe, char *data, int len);
+int rpc_request(struct cifsd_pipe *pipe, char *data, int len);
+int rpc_read_bind_data(struct cifsd_pipe *pipe, char *data, int size);
+int rpc_read_request_data(struct cifsd_pipe *pipe, char *data, int buf_len);
 
 /* LANMAN pipe function */
 
 int handle_lanman_pipe(struct cifsd_pipe *pipe,
-			char *in_data, char *out_data, int *param_len);
+			char *in_data, int in_len, char *out_data,
+			int out_len, int *param_len);
 int handle_wkstagetinfo(struct cifsd_pipe *pipe,
-			LANMAN_REQ *req, char *out_data);
+			struct cifsd_ndr_reader *r, char *out_data);
 
 extern char workgroup[MAX_SERVER_WRKGRP_LEN];
 extern char server_string[MAX_SERVER_NAME_LEN];
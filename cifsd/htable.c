@@ -0,0 +1,218 @@
+/*
+ *   cifsd-tools/cifsd/htable.c
+ *
+ *   Copyright (C) 2016 Namjae Jeon <namjae.jeon@protocolfreedom.org>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ */
+
+#include "htable.h"
+
+/*
+ * Marks a slot of the old table whose entry was moved or deleted. The key
+ * is kept so probe sequences running through the slot stay intact.
+ */
+static char htable_moved;
+#define HTABLE_MOVED	((void *)&htable_moved)
+
+/* server handles are kernel pointers, mix the low bits in */
+static unsigned int cifsd_htable_hash(__u64 key)
+{
+	key ^= key >> 33;
+	key *= 0xff51afd7ed558ccdULL;
+	key ^= key >> 33;
+	key *= 0xc4ceb9fe1a85ec53ULL;
+	key ^= key >> 33;
+	return (unsigned int)key;
+}
+
+static struct cifsd_htable_slot *tbl_find(struct cifsd_htable_tbl *tbl,
+		__u64 key)
+{
+	struct cifsd_htable_slot *slot;
+	unsigned int mask = tbl->size - 1, i;
+
+	if (!tbl->slots)
+		return NULL;
+
+	for (i = cifsd_htable_hash(key) & mask; ; i = (i + 1) & mask) {
+		slot = &tbl->slots[i];
+		if (!slot->val)
+			return NULL;
+		if (slot->key == key)
+			return slot;
+	}
+}
+
+static void tbl_put(struct cifsd_htable_tbl *tbl, __u64 key, void *val)
+{
+	unsigned int mask = tbl->size - 1, i;
+
+	for (i = cifsd_htable_hash(key) & mask; tbl->slots[i].val;
+			i = (i + 1) & mask)
+		;
+
+	tbl->slots[i].key = key;
+	tbl->slots[i].val = val;
+}
+
+/* backward shift delete, keeps the table free of tombstones */
+static void tbl_del(struct cifsd_htable_tbl *tbl,
+		struct cifsd_htable_slot *slot)
+{
+	unsigned int mask = tbl->size - 1, i, j, k;
+
+	i = slot - tbl->slots;
+	for (j = (i + 1) & mask; tbl->slots[j].val; j = (j + 1) & mask) {
+		k = cifsd_htable_hash(tbl->slots[j].key) & mask;
+		/* move j back into the hole unless its home lies in (i, j] */
+		if (i <= j ? (k <= i || k > j) : (k <= i && k > j)) {
+			tbl->slots[i] = tbl->slots[j];
+			i = j;
+		}
+	}
+	tbl->slots[i].val = NULL;
+}
+
+/* move a few entries of the old table over to the current one */
+static void cifsd_htable_migrate(struct cifsd_htable *ht)
+{
+	struct cifsd_htable_slot *slot;
+	unsigned int n;
+
+	if (!ht->old.slots)
+		return;
+
+	for (n = 0; n < CIFSD_HTABLE_MIGRATE && ht->migrated < ht->old.size;
+			n++) {
+		slot = &ht->old.slots[ht->migrated++];
+		if (slot->val && slot->val != HTABLE_MOVED) {
+			tbl_put(&ht->cur, slot->key, slot->val);
+			slot->val = HTABLE_MOVED;
+		}
+	}
+
+	if (ht->migrated == ht->old.size) {
+		free(ht->old.slots);
+		ht->old.slots = NULL;
+		ht->old.size = 0;
+	}
+}
+
+static int cifsd_htable_grow(struct cifsd_htable *ht)
+{
+	unsigned int size = ht->cur.size ? ht->cur.size * 2 :
+		CIFSD_HTABLE_MIN_SIZE;
+	struct cifsd_htable_slot *slots;
+
+	slots = calloc(size, sizeof(*slots));
+	if (!slots)
+		return -ENOMEM;
+
+	ht->old = ht->cur;
+	ht->migrated = 0;
+	ht->cur.slots = slots;
+	ht->cur.size = size;
+	cifsd_debug("hash table grows to %u slots\n", size);
+	return 0;
+}
+
+void cifsd_htable_init(struct cifsd_htable *ht)
+{
+	memset(ht, 0, sizeof(*ht));
+}
+
+void cifsd_htable_free(struct cifsd_htable *ht)
+{
+	free(ht->cur.slots);
+	free(ht->old.slots);
+	cifsd_htable_init(ht);
+}
+
+/**
+ * cifsd_htable_lookup() - find the value stored for a key
+ * @ht:		hash table
+ * @key:	key
+ *
+ * Return:	value or NULL if @key is not in the table
+ */
+void *cifsd_htable_lookup(struct cifsd_htable *ht, __u64 key)
+{
+	struct cifsd_htable_slot *slot;
+
+	cifsd_htable_migrate(ht);
+
+	slot = tbl_find(&ht->old, key);
+	if (slot && slot->val != HTABLE_MOVED)
+		return slot->val;
+
+	slot = tbl_find(&ht->cur, key);
+	return slot ? slot->val : NULL;
+}
+
+/**
+ * cifsd_htable_insert() - add a key that is not in the table yet
+ * @ht:		hash table
+ * @key:	key
+ * @val:	value, not NULL
+ *
+ * Return:	0 on success, -EEXIST if @key is present, -ENOMEM
+ */
+int cifsd_htable_insert(struct cifsd_htable *ht, __u64 key, void *val)
+{
+	if (cifsd_htable_lookup(ht, key))
+		return -EEXIST;
+
+	/* the previous resize is always done before this one triggers */
+	if ((ht->count + 1) * 4 > ht->cur.size * 3 && !ht->old.slots &&
+	    cifsd_htable_grow(ht))
+		return -ENOMEM;
+
+	tbl_put(&ht->cur, key, val);
+	ht->count++;
+	return 0;
+}
+
+/**
+ * cifsd_htable_del() - remove a key from the table
+ * @ht:		hash table
+ * @key:	key
+ *
+ * Return:	value that was stored for @key or NULL if not found
+ */
+void *cifsd_htable_del(struct cifsd_htable *ht, __u64 key)
+{
+	struct cifsd_htable_slot *slot;
+	void *val;
+
+	cifsd_htable_migrate(ht);
+
+	slot = tbl_find(&ht->old, key);
+	if (slot && slot->val != HTABLE_MOVED) {
+		val = slot->val;
+		slot->val = HTABLE_MOVED;
+		ht->count--;
+		return val;
+	}
+
+	slot = tbl_find(&ht->cur, key);
+	if (!slot)
+		return NULL;
+
+	val = slot->val;
+	tbl_del(&ht->cur, slot);
+	ht->count--;
+	return val;
+}
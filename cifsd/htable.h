@@ -0,0 +1,58 @@
+/*
+ *   cifsd-tools/cifsd/htable.h
+ *
+ *   Copyright (C) 2016 Namjae Jeon <namjae.jeon@protocolfreedom.org>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ */
+
+#ifndef __CIFSD_TOOLS_HTABLE_H
+#define __CIFSD_TOOLS_HTABLE_H
+
+#include "cifsd.h"
+
+/*
+ * Open addressing hash table from a __u64 key to a pointer, linear
+ * probing. When it gets 3/4 full a table twice the size is allocated and
+ * the entries are moved over a few slots per operation, so no single
+ * insert pays for a whole rehash. Not thread safe, callers lock.
+ */
+#define CIFSD_HTABLE_MIN_SIZE	64
+#define CIFSD_HTABLE_MIGRATE	8	/* old slots moved per operation */
+
+struct cifsd_htable_slot {
+	__u64		key;
+	void		*val;	/* NULL for an empty slot */
+};
+
+struct cifsd_htable_tbl {
+	struct cifsd_htable_slot	*slots;
+	unsigned int			size;	/* power of two */
+};
+
+struct cifsd_htable {
+	struct cifsd_htable_tbl	cur;
+	struct cifsd_htable_tbl	old;	/* being migrated, slots NULL if not */
+	unsigned int		migrated;	/* next old slot to move */
+	unsigned int		count;
+};
+
+void cifsd_htable_init(struct cifsd_htable *ht);
+void cifsd_htable_free(struct cifsd_htable *ht);
+void *cifsd_htable_lookup(struct cifsd_htable *ht, __u64 key);
+int cifsd_htable_insert(struct cifsd_htable *ht, __u64 key, void *val);
+void *cifsd_htable_del(struct cifsd_htable *ht, __u64 key);
+
+#endif /* __CIFSD_TOOLS_HTABLE_H */
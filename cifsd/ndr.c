@@ -0,0 +1,394 @@
+/*
+ *   cifsd-tools/cifsd/ndr.c
+ *
+ *   Copyright (C) 2016 Namjae Jeon <namjae.jeon@protocolfreedom.org>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ */
+
+#include "ndr.h"
+
+/**
+ * cifsd_ndr_init() - start encoding into a buffer
+ * @ndr:	writer
+ * @buf:	output buffer
+ * @size:	size of @buf
+ * @codepage:	codepage strings are converted from, NULL if none are written
+ */
+void cifsd_ndr_init(struct cifsd_ndr *ndr, char *buf, int size,
+		const char *codepage)
+{
+	memset(ndr, 0, sizeof(*ndr));
+	ndr->buf = buf;
+	ndr->size = size;
+	ndr->codepage = codepage;
+}
+
+/**
+ * cifsd_ndr_reserve() - take room for @len more bytes
+ * @ndr:	writer
+ * @len:	number of bytes
+ *
+ * Return:	where to write them, NULL and -ENOSPC set once the buffer ran
+ *		out or an earlier write failed
+ */
+char *cifsd_ndr_reserve(struct cifsd_ndr *ndr, int len)
+{
+	char *p;
+
+	if (ndr->err || len > ndr->size - ndr->offset) {
+		ndr->err = ndr->err ? ndr->err : -ENOSPC;
+		return NULL;
+	}
+
+	p = ndr->buf + ndr->offset;
+	ndr->offset += len;
+	return p;
+}
+
+void cifsd_ndr_write(struct cifsd_ndr *ndr, const void *src, int len)
+{
+	char *p = cifsd_ndr_reserve(ndr, len);
+
+	if (p)
+		memcpy(p, src, len);
+}
+
+/* zeroes the padding, response buffers are reused */
+void cifsd_ndr_align(struct cifsd_ndr *ndr, int align)
+{
+	int len = ((ndr->offset + align - 1) & ~(align - 1)) - ndr->offset;
+	char *p = cifsd_ndr_reserve(ndr, len);
+
+	if (p)
+		memset(p, 0, len);
+}
+
+void cifsd_ndr_u16(struct cifsd_ndr *ndr, __u16 val)
+{
+	__le16 v = cpu_to_le16(val);
+
+	cifsd_ndr_write(ndr, &v, sizeof(v));
+}
+
+void cifsd_ndr_u32(struct cifsd_ndr *ndr, __u32 val)
+{
+	__le32 v = cpu_to_le32(val);
+
+	cifsd_ndr_write(ndr, &v, sizeof(v));
+}
+
+void cifsd_ndr_u64(struct cifsd_ndr *ndr, __u64 val)
+{
+	__le64 v = __cpu_to_le64(val);
+
+	cifsd_ndr_write(ndr, &v, sizeof(v));
+}
+
+/**
+ * cifsd_ndr_unistr() - write a conformant varying UTF-16 string
+ * @ndr:	writer
+ * @str:	string in the codepage of @ndr
+ *
+ * The counts are in UTF-16 code units and include the terminating NUL,
+ * the string is padded to 4.
+ */
+void cifsd_ndr_unistr(struct cifsd_ndr *ndr, const char *str)
+{
+	/* a byte of @str converts to one code unit at most */
+	int len = strlen(str), size = ((len + 1) * 2 + 3) & ~3;
+	int start = ndr->offset, end, count;
+	char *p;
+
+	cifsd_ndr_reserve(ndr, 3 * sizeof(__le32));
+	p = cifsd_ndr_reserve(ndr, size);
+	if (!p)
+		return;
+
+	memset(p, 0, size);
+	if (smbConvertToUTF16((__le16 *)p, (char *)str, len, size,
+				ndr->codepage) < 0) {
+		ndr->err = -EINVAL;
+		return;
+	}
+
+	/* give back the room a multibyte string did not use */
+	count = strlen_w((unsigned short *)p) + 1;
+	end = p - ndr->buf + ((count * 2 + 3) & ~3);
+
+	ndr->offset = start;
+	cifsd_ndr_u32(ndr, count);	/* max_count */
+	cifsd_ndr_u32(ndr, 0);		/* offset */
+	cifsd_ndr_u32(ndr, count);	/* actual_count */
+	ndr->offset = end;
+}
+
+static void cifsd_ndr_encode_unistr(struct cifsd_ndr *ndr, const void *arg)
+{
+	cifsd_ndr_unistr(ndr, arg);
+}
+
+/**
+ * cifsd_ndr_ptr() - write an embedded unique pointer
+ * @ndr:	writer
+ * @ptr:	referent, NULL for a NULL pointer
+ * @encode:	writes @ptr once cifsd_ndr_flush() is called
+ */
+void cifsd_ndr_ptr(struct cifsd_ndr *ndr, const void *ptr,
+		void (*encode)(struct cifsd_ndr *ndr, const void *arg))
+{
+	struct cifsd_ndr_deferred *deferred;
+	int max;
+
+	cifsd_ndr_u32(ndr, ptr ? CIFSD_NDR_REF_ID : 0);
+	if (!ptr || ndr->err)
+		return;
+
+	if (ndr->nr_deferred == ndr->max_deferred) {
+		max = ndr->max_deferred ? ndr->max_deferred * 2 : 16;
+		deferred = realloc(ndr->deferred, max * sizeof(*deferred));
+		if (!deferred) {
+			ndr->err = -ENOMEM;
+			return;
+		}
+		ndr->deferred = deferred;
+		ndr->max_deferred = max;
+	}
+
+	deferred = &ndr->deferred[ndr->nr_deferred++];
+	deferred->encode = encode;
+	deferred->arg = ptr;
+}
+
+void cifsd_ndr_ptr_unistr(struct cifsd_ndr *ndr, const char *str)
+{
+	cifsd_ndr_ptr(ndr, str, cifsd_ndr_encode_unistr);
+}
+
+/**
+ * cifsd_ndr_flush() - write the referents queued by cifsd_ndr_ptr()
+ * @ndr:	writer
+ *
+ * Referents are written in the order their pointers were. Has to be
+ * called once pointers were queued, also on error, to free the queue.
+ */
+void cifsd_ndr_flush(struct cifsd_ndr *ndr)
+{
+	int i;
+
+	for (i = 0; i < ndr->nr_deferred; i++)
+		ndr->deferred[i].encode(ndr, ndr->deferred[i].arg);
+
+	free(ndr->deferred);
+	ndr->deferred = NULL;
+	ndr->nr_deferred = 0;
+	ndr->max_deferred = 0;
+}
+
+/**
+ * cifsd_ndr_reader_init() - start decoding a request
+ * @r:		reader
+ * @buf:	request
+ * @size:	length of @buf as received
+ */
+void cifsd_ndr_reader_init(struct cifsd_ndr_reader *r, const char *buf,
+		int size)
+{
+	r->buf = buf;
+	r->size = size;
+	r->offset = 0;
+	r->err = 0;
+}
+
+/**
+ * cifsd_ndr_pull() - take the next @len bytes of the request
+ * @r:		reader
+ * @len:	number of bytes
+ *
+ * Return:	where they are, NULL and -EINVAL set once the request is too
+ *		short or an earlier pull failed
+ */
+const void *cifsd_ndr_pull(struct cifsd_ndr_reader *r, int len)
+{
+	const char *p;
+
+	if (r->err || len < 0 || len > r->size - r->offset) {
+		r->err = -EINVAL;
+		return NULL;
+	}
+
+	p = r->buf + r->offset;
+	r->offset += len;
+	return p;
+}
+
+void cifsd_ndr_pull_align(struct cifsd_ndr_reader *r, int align)
+{
+	cifsd_ndr_pull(r, ((r->offset + align - 1) & ~(align - 1)) -
+			r->offset);
+}
+
+__u16 cifsd_ndr_pull_u16(struct cifsd_ndr_reader *r)
+{
+	const __le16 *p = cifsd_ndr_pull(r, sizeof(*p));
+
+	return p ? le16_to_cpu(*p) : 0;
+}
+
+__u32 cifsd_ndr_pull_u32(struct cifsd_ndr_reader *r)
+{
+	const __le32 *p = cifsd_ndr_pull(r, sizeof(*p));
+
+	return p ? le32_to_cpu(*p) : 0;
+}
+
+/**
+ * cifsd_ndr_pull_unistr() - take a conformant varying UTF-16 string
+ * @r:		reader
+ * @str:	view of the string
+ *
+ * The string is left in the request, the padding to 4 behind it is
+ * skipped.
+ *
+ * Return:	0 on success, -EINVAL if the counts do not fit the request
+ */
+int cifsd_ndr_pull_unistr(struct cifsd_ndr_reader *r,
+		struct cifsd_ndr_str *str)
+{
+	__u32 max_count, actual_count;
+
+	max_count = cifsd_ndr_pull_u32(r);
+	cifsd_ndr_pull_u32(r);		/* offset */
+	actual_count = cifsd_ndr_pull_u32(r);
+	if (r->err || actual_count > max_count ||
+	    actual_count > (r->size - r->offset) / 2)
+		return r->err = -EINVAL;
+
+	str->data = cifsd_ndr_pull(r, actual_count * 2);
+	str->len = actual_count;
+	if (str->len && !str->data[str->len - 1])
+		str->len--;
+	cifsd_ndr_pull_align(r, 4);
+	return r->err;
+}
+
+/* a unique pointer to a string, @str->data is NULL for a NULL pointer */
+int cifsd_ndr_pull_ptr_unistr(struct cifsd_ndr_reader *r,
+		struct cifsd_ndr_str *str)
+{
+	str->data = NULL;
+	str->len = 0;
+	if (!cifsd_ndr_pull_u32(r))
+		return r->err;
+	return cifsd_ndr_pull_unistr(r, str);
+}
+
+/**
+ * cifsd_ndr_pull_cstr() - take a NUL terminated 8 bit string
+ * @r:		reader
+ *
+ * Return:	the string in the request, NULL if it is not terminated
+ *		before the end of it
+ */
+const char *cifsd_ndr_pull_cstr(struct cifsd_ndr_reader *r)
+{
+	const char *p = r->buf + r->offset, *end;
+
+	if (r->err)
+		return NULL;
+
+	end = memchr(p, '\0', r->size - r->offset);
+	if (!end) {
+		r->err = -EINVAL;
+		return NULL;
+	}
+	return cifsd_ndr_pull(r, end - p + 1);
+}
+
+/* whole string is 7 bit, so its codepage form is one byte per unit */
+static int cifsd_ndr_str_ascii(const struct cifsd_ndr_str *str)
+{
+	int i;
+
+	for (i = 0; i < str->len; i++)
+		if (le16_to_cpu(str->data[i]) >= 0x80 || !str->data[i])
+			return 0;
+	return 1;
+}
+
+/**
+ * cifsd_ndr_str_eq() - compare a request string with a local one
+ * @str:	string in the request
+ * @s:		string in @codepage
+ * @codepage:	codepage of @s
+ *
+ * 7 bit strings are compared in place, others are converted first.
+ *
+ * Return:	1 if they are equal, 0 otherwise or on conversion error
+ */
+int cifsd_ndr_str_eq(const struct cifsd_ndr_str *str, const char *s,
+		const char *codepage)
+{
+	char *conv;
+	int i, eq;
+
+	if (!str->data)
+		return 0;
+
+	if (cifsd_ndr_str_ascii(str)) {
+		for (i = 0; i < str->len; i++)
+			if (le16_to_cpu(str->data[i]) != (unsigned char)s[i])
+				return 0;
+		return !s[i];
+	}
+
+	conv = cifsd_ndr_str_dup(str, codepage);
+	if (IS_ERR(conv))
+		return 0;
+	eq = !strcmp(conv, s);
+	free(conv);
+	return eq;
+}
+
+/**
+ * cifsd_ndr_str_dup() - copy a request string out in a codepage
+ * @str:	string in the request
+ * @codepage:	codepage to convert to
+ *
+ * Return:	NUL terminated string to free, ERR_PTR on error
+ */
+char *cifsd_ndr_str_dup(const struct cifsd_ndr_str *str,
+		const char *codepage)
+{
+	char *s;
+	int i;
+
+	if (!str->data)
+		return ERR_PTR(-EINVAL);
+
+	if (!cifsd_ndr_str_ascii(str))
+		return smb_strndup_from_utf16((char *)str->data, str->len, 1,
+				codepage);
+
+	/* narrowing 7 bit units needs no iconv descriptor */
+	s = malloc(str->len + 1);
+	if (!s)
+		return ERR_PTR(-ENOMEM);
+
+	for (i = 0; i < str->len; i++)
+		s[i] = le16_to_cpu(str->data[i]);
+	s[i] = '\0';
+	return s;
+}
@@ -0,0 +1,105 @@
+/*
+ *   cifsd-tools/cifsd/ndr.h
+ *
+ *   Copyright (C) 2016 Namjae Jeon <namjae.jeon@protocolfreedom.org>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ */
+
+#ifndef __CIFSD_TOOLS_NDR_H
+#define __CIFSD_TOOLS_NDR_H
+
+#include "cifsd.h"
+
+/*
+ * NDR writer, encodes a response in one pass into a caller buffer. Every
+ * write is checked against the buffer size: the first one not fitting
+ * sets err to -ENOSPC and the writes after it are dropped, so encoders
+ * check once at the end. Embedded pointers are written as a referent id
+ * and their referent is queued, cifsd_ndr_flush() then writes the queued
+ * referents behind the structure or array holding the pointers.
+ */
+#define CIFSD_NDR_REF_ID	1	/* referent id of non NULL pointers */
+
+struct cifsd_ndr;
+
+struct cifsd_ndr_deferred {
+	void		(*encode)(struct cifsd_ndr *ndr, const void *arg);
+	const void	*arg;
+};
+
+struct cifsd_ndr {
+	char				*buf;
+	int				size;
+	int				offset;
+	int				err;
+	const char			*codepage;	/* of the strings */
+
+	struct cifsd_ndr_deferred	*deferred;
+	int				nr_deferred;
+	int				max_deferred;
+};
+
+void cifsd_ndr_init(struct cifsd_ndr *ndr, char *buf, int size,
+		const char *codepage);
+char *cifsd_ndr_reserve(struct cifsd_ndr *ndr, int len);
+void cifsd_ndr_write(struct cifsd_ndr *ndr, const void *src, int len);
+void cifsd_ndr_align(struct cifsd_ndr *ndr, int align);
+void cifsd_ndr_u16(struct cifsd_ndr *ndr, __u16 val);
+void cifsd_ndr_u32(struct cifsd_ndr *ndr, __u32 val);
+void cifsd_ndr_u64(struct cifsd_ndr *ndr, __u64 val);
+void cifsd_ndr_unistr(struct cifsd_ndr *ndr, const char *str);
+void cifsd_ndr_ptr(struct cifsd_ndr *ndr, const void *ptr,
+		void (*encode)(struct cifsd_ndr *ndr, const void *arg));
+void cifsd_ndr_ptr_unistr(struct cifsd_ndr *ndr, const char *str);
+void cifsd_ndr_flush(struct cifsd_ndr *ndr);
+
+/*
+ * NDR reader, decodes a request in place. Every pull is checked against
+ * the request length: the first one running past it sets err to -EINVAL
+ * and returns NULL or 0, as do the pulls after it, so decoders check once
+ * before using what they pulled. Strings are views into the request,
+ * converted only by the handlers needing them in their codepage.
+ */
+struct cifsd_ndr_reader {
+	const char	*buf;
+	int		size;
+	int		offset;
+	int		err;
+};
+
+/* UTF-16 string in a request, not NUL terminated */
+struct cifsd_ndr_str {
+	const __le16	*data;	/* NULL for a NULL pointer */
+	int		len;	/* in UTF-16 units, terminator excluded */
+};
+
+void cifsd_ndr_reader_init(struct cifsd_ndr_reader *r, const char *buf,
+		int size);
+const void *cifsd_ndr_pull(struct cifsd_ndr_reader *r, int len);
+void cifsd_ndr_pull_align(struct cifsd_ndr_reader *r, int align);
+__u16 cifsd_ndr_pull_u16(struct cifsd_ndr_reader *r);
+__u32 cifsd_ndr_pull_u32(struct cifsd_ndr_reader *r);
+int cifsd_ndr_pull_unistr(struct cifsd_ndr_reader *r,
+		struct cifsd_ndr_str *str);
+int cifsd_ndr_pull_ptr_unistr(struct cifsd_ndr_reader *r,
+		struct cifsd_ndr_str *str);
+const char *cifsd_ndr_pull_cstr(struct cifsd_ndr_reader *r);
+int cifsd_ndr_str_eq(const struct cifsd_ndr_str *str, const char *s,
+		const char *codepage);
+char *cifsd_ndr_str_dup(const struct cifsd_ndr_str *str,
+		const char *codepage);
+
+#endif /* __CIFSD_TOOLS_NDR_H */
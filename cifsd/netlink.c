@@ -18,65 +18,434 @@
  *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <time.h>
 
 #include "netlink.h"
+#include "worker.h"
+#include "trace.h"
+#include "stats.h"
+#include "pool.h"
+
+#define CIFSD_NL_MAX_FDS	8
+
+struct cifsd_nl_fd {
+	int	fd;
+	void	(*handler)(int fd);
+};
+
+/* receive ring slot, holds one netlink message */
+struct cifsd_nl_slot {
+	struct list_head	list;
+	struct cifsd_work	work;
+	char			*buf;
+	unsigned int		len;
+	__u64			rx_ns;	/* receipt time, for queueing delay */
+};
+
+/* header slot of an outgoing message, the payload has its own iovec */
+struct cifsd_nl_hdr {
+	struct nlmsghdr		nlh;
+	struct cifsd_uevent	ev;
+};
+
+/*
+ * response payload buffer, @size tells whether it goes back to
+ * nl_rsp_pool or to malloc
+ */
+struct cifsd_nl_rsp {
+	unsigned int	size;
+	char		data[0] __attribute__((aligned(8)));
+};
+
+/* queued response, sent by the next cifsd_nl_flush() */
+struct cifsd_nl_tx {
+	struct cifsd_nl_hdr	hdr;
+	struct iovec		iov[2];
+	char			*data;
+};
+
+/*
+ * Transport carrying cifsd_uevent messages. Every message is one
+ * nlmsghdr framed datagram, whatever the backend.
+ */
+struct cifsd_nl_transport {
+	const char	*name;
+	/* set up nlsk_fd and the peer address, 0 on success */
+	int		(*open)(void);
+	/* recvmmsg/sendmmsg semantics */
+	int		(*recv)(struct mmsghdr *vec, unsigned int vlen,
+				int flags);
+	int		(*send)(struct mmsghdr *vec, unsigned int vlen);
+};
 
 static char *nlsk_rcv_buf = NULL;
-static char *nlsk_send_buf = NULL;
 static int nlsk_fd = -1;
+static __u32 nlsk_pid;
 static struct sockaddr_nl src_addr, dest_addr;
+static const struct cifsd_nl_transport *nl_transport;
+/* address outgoing messages are sent to, NULL on connected sockets */
+static void *nl_peer;
+static socklen_t nl_peerlen;
+
+/* AF_UNIX SOCK_SEQPACKET path standing in for the kernel, if set */
+char *cifsd_nl_unix_path;
+/* trace replayed in place of the kernel, if set */
+char *cifsd_nl_replay_path;
+
+static int epoll_fd = -1;
+static struct cifsd_nl_fd nl_fds[CIFSD_NL_MAX_FDS];
+static int nl_nfds;
+
+/*
+ * receive ring: free slots and received slots waiting for dispatch.
+ * Workers hand slots back to the free list, nl_ring_lock protects it.
+ */
+static struct cifsd_nl_slot *nl_slots;
+static LIST_HEAD(nl_free_slots);
+static LIST_HEAD(nl_pending);
+static pthread_mutex_t nl_ring_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned int nl_nr_free;
+/* set while the netlink socket is out of epoll for lack of free slots */
+static int nl_throttled;
+
+/* recvmmsg vectors, one entry per message of a batch */
+static struct cifsd_nl_slot **nl_batch;
+static struct mmsghdr *nl_mmsg;
+static struct iovec *nl_iov;
+
+/* send queue, sized to the receive ring depth */
+static struct cifsd_nl_tx *nl_tx;
+static struct mmsghdr *nl_tx_mmsg;
+static unsigned int nl_tx_count;
+static pthread_mutex_t nl_tx_lock = PTHREAD_MUTEX_INITIALIZER;
+/* NETLINK_CIFSD_MAX_PAYLOAD response buffers, reused without clearing */
+static struct cifsd_pool nl_rsp_pool;
+/* CIFSD_UEVENT_F_* the kernel answered CIFSD_UEVENT_INIT_CONNECTION with */
+static unsigned int nl_features;
+
+/* eventfd waking the event loop to flush worker responses */
+static int nl_wake_fd = -1;
+static int nl_wake_pending;
+/* set by the shutdown handshake, workers then send their own responses */
+static volatile int nl_shutdown;
+
+/* max number of kernel events handled per wakeup of the event loop */
+unsigned int cifsd_nl_budget = CIFSD_NL_DEFAULT_BUDGET;
+/* max number of kernel events read by one recvmmsg call */
+unsigned int cifsd_nl_batch = CIFSD_NL_DEFAULT_BATCH;
+/* number of preallocated receive ring slots */
+unsigned int cifsd_nl_ring_depth = CIFSD_NL_DEFAULT_RING_DEPTH;
+/* SO_RCVBUF and SO_SNDBUF of the netlink socket, 0 keeps the default */
+unsigned int cifsd_nl_rcvbuf;
+unsigned int cifsd_nl_sndbuf;
+/* refuse low priority requests while the channel is overloaded */
+int cifsd_nl_shed;
+
+struct cifsd_nl_stats cifsd_nl_stats;
+/* monotonic time of the last receive overrun */
+static time_t nl_overrun_time;
 
 extern int request_handler(void *msg);
 extern void initialize(void);
 
+/**
+ * cifsd_nl_prep() - fill the header slot and iovecs of an outgoing message
+ * @hdr:	header slot receiving the nlmsghdr and the uevent
+ * @iov:	two entry iovec array, header slot and payload
+ * @eev:	uevent to send
+ * @dlen:	payload length
+ * @data:	payload, sent in place from the caller's buffer
+ *
+ * Return:	number of iovec entries used
+ */
+static int cifsd_nl_prep(struct cifsd_nl_hdr *hdr, struct iovec *iov,
+		struct cifsd_uevent *eev, unsigned int dlen, char *data)
+{
+	cifsd_debug("sending %u event\n", eev->type);
+	memset(&hdr->nlh, 0, sizeof(hdr->nlh));
+	hdr->nlh.nlmsg_len = NLMSG_SPACE(sizeof(hdr->ev)) + dlen;
+	hdr->nlh.nlmsg_type = eev->type;
+	hdr->nlh.nlmsg_pid = nlsk_pid;
+	memcpy(&hdr->ev, eev, sizeof(hdr->ev));
+
+	iov[0].iov_base = (void *)hdr;
+	iov[0].iov_len = NLMSG_SPACE(sizeof(hdr->ev));
+	iov[1].iov_base = (void *)data;
+	iov[1].iov_len = dlen;
+
+	return dlen ? 2 : 1;
+}
+
 static int cifsd_sendmsg(struct cifsd_uevent *eev, unsigned int dlen,
 		char *data)
 {
-	struct nlmsghdr *nlh;
-	struct cifsd_uevent *ev;
-	struct msghdr msg;
-	struct iovec iov;
+	struct cifsd_nl_hdr hdr;
+	struct mmsghdr mmsg;
+	struct msghdr *msg;
+	struct iovec iov[2];
 	int len;
 
-	cifsd_debug("sending %u event\n", eev->type);
-	nlh = (struct nlmsghdr *)nlsk_send_buf;
-	memset(nlh, 0, NETLINK_CIFSD_MAX_BUF);
-	nlh->nlmsg_len = NLMSG_SPACE(sizeof(*ev));
-	nlh->nlmsg_type = eev->type;
-	nlh->nlmsg_pid = getpid();
-	memcpy(NLMSG_DATA(nlh), eev, sizeof(*ev));
-	ev = (struct cifsd_uevent *)NLMSG_DATA(nlh);
-
-	if (dlen) {
-		memcpy(ev->buffer, data, dlen);
-		nlh->nlmsg_len += dlen;
-	}
-
-	iov.iov_base = (void *)nlh;
-	iov.iov_len = nlh->nlmsg_len;
-
-	memset(&msg, 0, sizeof(msg));
-	msg.msg_name= (void*)&dest_addr;
-	msg.msg_namelen = sizeof(dest_addr);
-	msg.msg_iov = &iov;
-	msg.msg_iovlen = 1;
-
-	len = sendmsg(nlsk_fd, &msg, 0);
-	if (len == -1)
+	memset(&mmsg, 0, sizeof(mmsg));
+	msg = &mmsg.msg_hdr;
+	msg->msg_name = nl_peer;
+	msg->msg_namelen = nl_peerlen;
+	msg->msg_iov = iov;
+	msg->msg_iovlen = cifsd_nl_prep(&hdr, iov, eev, dlen, data);
+
+	if (nl_transport->send(&mmsg, 1) != 1) {
 		perror("sendmsg");
-	else if (len != nlh->nlmsg_len)
+		return -1;
+	}
+
+	len = mmsg.msg_len;
+	if (cifsd_tracing)
+		cifsd_trace_tx(iov, msg->msg_iovlen, len);
+	if (len != hdr.nlh.nlmsg_len)
 		cifsd_err("partial data send, expected %u, actual %u\n",
-				nlh->nlmsg_len, len);
+				hdr.nlh.nlmsg_len, len);
 	return len;
 }
 
+static time_t cifsd_nl_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
+
+static void __cifsd_nl_flush(void)
+{
+	unsigned int sent = 0, retries = 0, i;
+	int ret;
+
+	while (sent < nl_tx_count) {
+		ret = nl_transport->send(nl_tx_mmsg + sent, nl_tx_count - sent);
+		if (ret == -1) {
+			if (errno == EINTR)
+				continue;
+			/* kernel side is short of memory, back off and retry */
+			if ((errno == ENOBUFS || errno == EAGAIN) &&
+			    retries < CIFSD_NL_SEND_RETRIES) {
+				__sync_fetch_and_add(&cifsd_nl_stats.tx_retries, 1);
+				usleep(1000 << retries++);
+				continue;
+			}
+			perror("sendmmsg");
+			cifsd_err("dropped %u queued events\n",
+					nl_tx_count - sent);
+			__sync_fetch_and_add(&cifsd_nl_stats.tx_dropped,
+					nl_tx_count - sent);
+			break;
+		}
+		if (cifsd_tracing) {
+			for (i = sent; i < sent + ret; i++)
+				cifsd_trace_tx(nl_tx_mmsg[i].msg_hdr.msg_iov,
+					nl_tx_mmsg[i].msg_hdr.msg_iovlen,
+					nl_tx_mmsg[i].msg_len);
+		}
+		sent += ret;
+		__sync_fetch_and_add(&cifsd_nl_stats.tx_events, ret);
+	}
+
+	for (i = 0; i < nl_tx_count; i++) {
+		cifsd_nl_rsp_put(nl_tx[i].data);
+		nl_tx[i].data = NULL;
+	}
+	nl_tx_count = 0;
+}
+
+/**
+ * cifsd_nl_flush() - send all queued responses with sendmmsg
+ *
+ * Payload buffers handed over by cifsd_queue_sendmsg() are released once
+ * their message is on the socket, or dropped.
+ */
+void cifsd_nl_flush(void)
+{
+	pthread_mutex_lock(&nl_tx_lock);
+	__cifsd_nl_flush();
+	pthread_mutex_unlock(&nl_tx_lock);
+}
+
+/* wake the event loop from a worker, coalesced until the loop runs */
+static void cifsd_nl_wake(void)
+{
+	__u64 one = 1;
+
+	if (nl_wake_fd < 0)
+		return;
+
+	if (nl_shutdown) {
+		cifsd_nl_flush();
+		return;
+	}
+
+	if (__sync_lock_test_and_set(&nl_wake_pending, 1))
+		return;
+
+	if (write(nl_wake_fd, &one, sizeof(one)) != sizeof(one))
+		perror("eventfd write");
+}
+
+/**
+ * cifsd_nl_set_features() - record the features the kernel supports
+ * @flags:	k.i_conn.flags of CIFSD_KEVENT_INIT_CONNECTION
+ */
+void cifsd_nl_set_features(unsigned int flags)
+{
+	nl_features = flags & CIFSD_UEVENT_F_FRAGMENT;
+	cifsd_debug("kernel features 0x%x\n", nl_features);
+}
+
+/**
+ * cifsd_nl_max_rsp() - max response length the kernel accepts
+ * @flags:	flags of the kernel request
+ *
+ * Return:	CIFS_MAX_MSGSIZE if the kernel negotiated fragmented responses
+ *		and the request allows one, NETLINK_CIFSD_MAX_PAYLOAD otherwise
+ */
+unsigned int cifsd_nl_max_rsp(unsigned int flags)
+{
+	if (nl_features & flags & CIFSD_UEVENT_F_FRAGMENT)
+		return CIFS_MAX_MSGSIZE;
+	return NETLINK_CIFSD_MAX_PAYLOAD;
+}
+
+/**
+ * cifsd_nl_rsp_get() - get a response payload buffer
+ * @size:	bytes the handler may write, at least NETLINK_CIFSD_MAX_PAYLOAD
+ *		is provided
+ *
+ * Payload sized buffers come from a pool and are not cleared, the handler
+ * writes every byte it reports. The buffer is handed to
+ * cifsd_queue_sendmsg() and goes straight into the send iovec.
+ *
+ * Return:	buffer or NULL
+ */
+char *cifsd_nl_rsp_get(unsigned int size)
+{
+	struct cifsd_nl_rsp *rsp;
+
+	if (size <= NETLINK_CIFSD_MAX_PAYLOAD) {
+		size = NETLINK_CIFSD_MAX_PAYLOAD;
+		rsp = __cifsd_pool_alloc(&nl_rsp_pool);
+	} else {
+		rsp = malloc(sizeof(*rsp) + size);
+	}
+
+	if (!rsp)
+		return NULL;
+	rsp->size = size;
+	return rsp->data;
+}
+
+/**
+ * cifsd_nl_rsp_put() - release a buffer from cifsd_nl_rsp_get()
+ * @buf:	buffer, may be NULL
+ */
+void cifsd_nl_rsp_put(char *buf)
+{
+	struct cifsd_nl_rsp *rsp;
+
+	if (!buf)
+		return;
+
+	rsp = (struct cifsd_nl_rsp *)(buf - offsetof(struct cifsd_nl_rsp, data));
+	if (rsp->size == NETLINK_CIFSD_MAX_PAYLOAD)
+		cifsd_pool_free(&nl_rsp_pool, rsp);
+	else
+		free(rsp);
+}
+
+/* queue one message, @data is released by the flush that sends it */
+static struct cifsd_nl_tx *cifsd_nl_queue(struct cifsd_uevent *ev,
+		char *payload, unsigned int len, char *data)
+{
+	struct cifsd_nl_tx *tx;
+	struct msghdr *msg;
+
+	if (nl_tx_count == cifsd_nl_ring_depth)
+		__cifsd_nl_flush();
+
+	tx = &nl_tx[nl_tx_count];
+	tx->data = data;
+
+	msg = &nl_tx_mmsg[nl_tx_count].msg_hdr;
+	memset(msg, 0, sizeof(*msg));
+	msg->msg_name = nl_peer;
+	msg->msg_namelen = nl_peerlen;
+	msg->msg_iov = tx->iov;
+	msg->msg_iovlen = cifsd_nl_prep(&tx->hdr, tx->iov, ev, len, payload);
+
+	nl_tx_count++;
+	return tx;
+}
+
+/**
+ * cifsd_queue_sendmsg() - queue a response for the next cifsd_nl_flush()
+ * @ev:		uevent to send
+ * @buf:	payload from cifsd_nl_rsp_get(), owned by the send queue from
+ *		now on
+ * @buflen:	payload length
+ *
+ * A payload bigger than NETLINK_CIFSD_MAX_PAYLOAD is queued as a burst of
+ * chunks, see CIFSD_UEVENT_F_FRAGMENT. Callers only produce one when the
+ * kernel request allowed it. The chunks are queued under one lock hold,
+ * so responses of other workers never interleave with them.
+ *
+ * Return:	0 on success, -1 if the payload is too big
+ */
+int cifsd_queue_sendmsg(struct cifsd_uevent *ev, char *buf,
+		unsigned int buflen)
+{
+	struct cifsd_nl_tx *tx;
+	unsigned int off, len, seq = 0;
+
+	if (buflen > CIFS_MAX_MSGSIZE) {
+		cifsd_err("too big(%u) buffer\n", buflen);
+		cifsd_nl_rsp_put(buf);
+		return -1;
+	}
+
+	pthread_mutex_lock(&nl_tx_lock);
+	if (buflen <= NETLINK_CIFSD_MAX_PAYLOAD) {
+		cifsd_nl_queue(ev, buf, buflen, buf);
+	} else {
+		for (off = 0; off < buflen; off += len) {
+			len = buflen - off;
+			if (len > NETLINK_CIFSD_MAX_PAYLOAD)
+				len = NETLINK_CIFSD_MAX_PAYLOAD;
+
+			ev->buflen = len;
+			tx = cifsd_nl_queue(ev, buf + off, len,
+					off + len == buflen ? buf : NULL);
+			tx->hdr.nlh.nlmsg_seq = seq++;
+			if (off + len < buflen)
+				tx->hdr.nlh.nlmsg_flags |= NLM_F_MULTI;
+		}
+		cifsd_debug("queued %u bytes in %u chunks\n", buflen, seq);
+	}
+	pthread_mutex_unlock(&nl_tx_lock);
+
+	cifsd_nl_wake();
+	return 0;
+}
+
 int cifsd_common_sendmsg(struct cifsd_uevent *ev, char *buf,
 		unsigned int buflen)
 {
@@ -100,6 +469,7 @@ static int handle_init_event(void)
 
 	memset(&ev, 0, sizeof(ev));
 	ev.type = CIFSD_UEVENT_INIT_CONNECTION;
+	ev.u.i_conn.flags = CIFSD_UEVENT_F_FRAGMENT;
 
 	return cifsd_common_sendmsg(&ev, NULL, 0);
 }
@@ -114,149 +484,796 @@ static int handle_exit_event(void)
 	return cifsd_common_sendmsg(&ev, NULL, 0);
 }
 
-static int cifsd_nl_read(char *buf, unsigned int buflen, int flags)
+/**
+ * cifsd_nl_set_bufsz() - set a socket buffer size of the netlink socket
+ * @force:	SO_RCVBUFFORCE or SO_SNDBUFFORCE, beyond rmem_max/wmem_max
+ * @opt:	SO_RCVBUF or SO_SNDBUF, used without CAP_NET_ADMIN
+ * @size:	buffer size in bytes
+ *
+ * Return:	0 on success, -1 on error
+ */
+static int cifsd_nl_set_bufsz(int force, int opt, unsigned int size)
 {
-	int len;
-	struct iovec iov;
-	struct msghdr msg;
+	if (!setsockopt(nlsk_fd, SOL_SOCKET, force, &size, sizeof(size)))
+		return 0;
+	if (!setsockopt(nlsk_fd, SOL_SOCKET, opt, &size, sizeof(size)))
+		return 0;
+	perror("setsockopt");
+	return -1;
+}
+
+/**
+ * cifsd_nl_overrun() - recover from a receive buffer overrun
+ *
+ * ENOBUFS means the kernel dropped events it could not queue on the socket.
+ * The error is reported once and the socket is readable again right away,
+ * so the events still queued are picked up by the next receive. The
+ * receive buffer is doubled, up to CIFSD_NL_MAX_RCVBUF, so the next burst
+ * fits, and the channel is marked overloaded for CIFSD_NL_OVERLOAD_SECS.
+ */
+static void cifsd_nl_overrun(void)
+{
+	unsigned int size;
+	socklen_t len = sizeof(size);
 
-	iov.iov_base = buf;
-	iov.iov_len = buflen;
+	cifsd_nl_stats.rx_overruns++;
+	nl_overrun_time = cifsd_nl_now();
 
-	memset(&msg, 0, sizeof(msg));
-	msg.msg_name= (void*)&src_addr;
-	msg.msg_namelen = sizeof(src_addr);
-	msg.msg_iov = &iov;
-	msg.msg_iovlen = 1;
+	if (getsockopt(nlsk_fd, SOL_SOCKET, SO_RCVBUF, &size, &len))
+		size = 0;
+	/* the kernel reports twice the size that was set */
+	size /= 2;
 
-	len = recvmsg(nlsk_fd, &msg, flags);
-	if (len == -1)
-		perror("recvmsg");
-	else if (len != buflen)
-		cifsd_err("partial data read, expected %u, actual %u\n",
-				buflen, len);
+	cifsd_err("netlink receive overrun, kernel dropped events, rcvbuf %u\n",
+			size);
+	if (size && size < CIFSD_NL_MAX_RCVBUF) {
+		size *= 2;
+		if (size > CIFSD_NL_MAX_RCVBUF)
+			size = CIFSD_NL_MAX_RCVBUF;
+		if (!cifsd_nl_set_bufsz(SO_RCVBUFFORCE, SO_RCVBUF, size))
+			cifsd_nl_rcvbuf = size;
+	}
+}
 
-	return len;
+/**
+ * cifsd_nl_overloaded() - check if low priority work should be shed
+ *
+ * Return:	1 while fewer than a quarter of the receive slots are free or
+ *		shortly after a receive overrun, 0 otherwise
+ */
+int cifsd_nl_overloaded(void)
+{
+	if (*(volatile unsigned int *)&nl_nr_free < cifsd_nl_ring_depth / 4)
+		return 1;
+	if (nl_overrun_time &&
+	    cifsd_nl_now() - nl_overrun_time < CIFSD_NL_OVERLOAD_SECS)
+		return 1;
+	return 0;
 }
 
-static int cifsd_handle_event(void)
+/**
+ * cifsd_nl_stats_dump() - print the netlink channel counters
+ * @fp:		output stream
+ */
+void cifsd_nl_stats_dump(FILE *fp)
 {
-	int len;
-	struct cifsd_uevent *ev;
+	struct cifsd_nl_stats *st = &cifsd_nl_stats;
+
+	fprintf(fp, "rx events:    %lu\n", st->rx_events);
+	fprintf(fp, "rx dropped:   %lu\n", st->rx_dropped);
+	fprintf(fp, "rx overruns:  %lu\n", st->rx_overruns);
+	fprintf(fp, "tx events:    %lu\n", st->tx_events);
+	fprintf(fp, "tx retries:   %lu\n", st->tx_retries);
+	fprintf(fp, "tx dropped:   %lu\n", st->tx_dropped);
+	fprintf(fp, "shed:         %lu\n", st->shed);
+}
+
+static void cifsd_nl_throttle(int on)
+{
+	struct epoll_event ev;
+	int i;
+
+	if (nl_throttled == on)
+		return;
+
+	for (i = 0; i < nl_nfds; i++) {
+		if (nl_fds[i].fd != nlsk_fd)
+			continue;
+
+		memset(&ev, 0, sizeof(ev));
+		ev.events = on ? 0 : EPOLLIN;
+		ev.data.ptr = &nl_fds[i];
+		if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, nlsk_fd, &ev)) {
+			perror("Failed to throttle netlink socket\n");
+			return;
+		}
+		cifsd_debug("%sthrottled netlink socket\n", on ? "" : "un");
+		nl_throttled = on;
+		return;
+	}
+}
+
+/**
+ * cifsd_nl_recv_batch() - receive a batch of kernel events into the ring
+ * @flags:	MSG_DONTWAIT to poll the socket, MSG_WAITFORONE to block
+ *		until at least one event arrives
+ * @max:	max number of events to receive
+ *
+ * Every event is read once, straight into a free ring slot, with a single
+ * recvmmsg call for the whole batch. Received slots are queued in arrival
+ * order on the pending list. Truncated or malformed events are dropped
+ * and their slots stay free. When every slot is held by the workers the
+ * socket is throttled until one comes back.
+ *
+ * Return:	number of events received, -EAGAIN if nothing is queued,
+ *		-ENOBUFS after an overrun or -1 on error
+ */
+static int cifsd_nl_recv_batch(int flags, unsigned int max)
+{
+	struct cifsd_nl_slot *slot;
 	struct nlmsghdr *nlh;
+	struct msghdr *msg;
+	unsigned int n = 0;
+	__u64 now;
+	int i, ret;
+
+	if (max > cifsd_nl_batch)
+		max = cifsd_nl_batch;
+
+	/* workers only append to the free list, picked slots stay valid */
+	pthread_mutex_lock(&nl_ring_lock);
+	list_for_each_entry(slot, &nl_free_slots, list) {
+		if (n == max)
+			break;
+
+		nl_batch[n] = slot;
+		nl_iov[n].iov_base = slot->buf;
+		nl_iov[n].iov_len = NETLINK_CIFSD_MAX_BUF;
+
+		msg = &nl_mmsg[n].msg_hdr;
+		memset(msg, 0, sizeof(*msg));
+		if (nl_peer) {
+			msg->msg_name = (void *)&src_addr;
+			msg->msg_namelen = sizeof(src_addr);
+		}
+		msg->msg_iov = &nl_iov[n];
+		msg->msg_iovlen = 1;
+		n++;
+	}
+	pthread_mutex_unlock(&nl_ring_lock);
+
+	if (!n) {
+		cifsd_nl_throttle(1);
+		return 0;
+	}
 
-	len = cifsd_nl_read(nlsk_rcv_buf,
-			NLMSG_SPACE(sizeof(struct cifsd_uevent)),
-			MSG_PEEK);
-	if (len != NLMSG_SPACE(sizeof(struct cifsd_uevent)))
+	ret = nl_transport->recv(nl_mmsg, n, MSG_TRUNC | flags);
+	if (ret == -1) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			return -EAGAIN;
+		if (errno == ECONNRESET) {
+			cifsd_err("%s peer went away\n", nl_transport->name);
+			exit(1);
+		}
+		if (errno == ENOBUFS) {
+			cifsd_nl_overrun();
+			return -ENOBUFS;
+		}
+		perror("recvmmsg");
 		return -1;
+	}
+
+	now = cifsd_stats_now();
+	pthread_mutex_lock(&nl_ring_lock);
+	for (i = 0; i < ret; i++) {
+		slot = nl_batch[i];
+		slot->rx_ns = now;
+		slot->len = nl_mmsg[i].msg_len;
+		nlh = (struct nlmsghdr *)slot->buf;
+
+		if (nl_mmsg[i].msg_hdr.msg_flags & MSG_TRUNC) {
+			cifsd_err("dropped truncated event, length %u\n",
+					slot->len);
+			cifsd_nl_stats.rx_dropped++;
+			continue;
+		}
+
+		/* handlers decode ev->buffer up to buflen */
+		if (!NLMSG_OK(nlh, slot->len) || nlh->nlmsg_len <
+				NLMSG_SPACE(sizeof(struct cifsd_uevent)) ||
+		    ((struct cifsd_uevent *)NLMSG_DATA(nlh))->buflen >
+				nlh->nlmsg_len -
+				NLMSG_SPACE(sizeof(struct cifsd_uevent))) {
+			cifsd_err("malformed event, read %u, nlmsg_len %u\n",
+					slot->len, nlh->nlmsg_len);
+			cifsd_nl_stats.rx_dropped++;
+			continue;
+		}
+
+		if (cifsd_tracing)
+			cifsd_trace_rx(slot->buf, slot->len);
+		if (cifsd_nl_replay_path)
+			cifsd_replay_rx(slot->buf);
+		list_move_tail(&slot->list, &nl_pending);
+		nl_nr_free--;
+		cifsd_nl_stats.rx_events++;
+	}
+	pthread_mutex_unlock(&nl_ring_lock);
+
+	return ret;
+}
+
+static void cifsd_nl_put_slot(struct cifsd_nl_slot *slot)
+{
+	int was_empty;
+
+	pthread_mutex_lock(&nl_ring_lock);
+	was_empty = list_empty(&nl_free_slots);
+	list_add_tail(&slot->list, &nl_free_slots);
+	nl_nr_free++;
+	pthread_mutex_unlock(&nl_ring_lock);
+
+	if (was_empty)
+		cifsd_nl_wake();
+}
+
+/* run request_handler on a received event and account its latency */
+static void cifsd_nl_handle(struct cifsd_nl_slot *slot)
+{
+	struct nlmsghdr *nlh = (struct nlmsghdr *)slot->buf;
+	__u64 start, end;
+
+	start = cifsd_stats_now();
+	request_handler(slot->buf);
+	end = cifsd_stats_now();
+
+	cifsd_stats_event(nlh->nlmsg_type, start - slot->rx_ns, end - start);
+	cifsd_nl_put_slot(slot);
+}
+
+static void cifsd_nl_work(struct cifsd_work *work)
+{
+	cifsd_nl_handle(list_entry(work, struct cifsd_nl_slot, work));
+}
+
+/**
+ * cifsd_nl_dispatch() - hand pending events to request_handler in order
+ *
+ * Client events are sharded by server_handle onto the workers, which keeps
+ * them in order per client. Pipe create and destroy are cheap and free
+ * or gate resources, so they are queued at high priority ahead of the
+ * other clients' reads, writes and enumerations. Port close events update
+ * the connection counters of the shutdown handshake and always run on
+ * this thread.
+ *
+ * Return:	number of events dispatched
+ */
+static unsigned int cifsd_nl_dispatch(void)
+{
+	struct cifsd_nl_slot *slot;
+	struct nlmsghdr *nlh;
+	struct cifsd_uevent *ev;
+	unsigned int n = 0;
+
+	cifsd_plug_work();
+	while (!list_empty(&nl_pending)) {
+		slot = list_entry(nl_pending.next, struct cifsd_nl_slot, list);
+		list_del(&slot->list);
+		nlh = (struct nlmsghdr *)slot->buf;
+		ev = NLMSG_DATA(nlh);
+
+		switch (nlh->nlmsg_type) {
+		case CIFSD_KEVENT_INIT_CONNECTION:
+		case CIFSD_KEVENT_SMBPORT_CLOSE_FAIL:
+		case CIFSD_KEVENT_SMBPORT_CLOSE_PASS:
+			/* without workers, after the events before it */
+			cifsd_unplug_work();
+			cifsd_nl_handle(slot);
+			cifsd_plug_work();
+			break;
+		case CIFSD_KEVENT_CREATE_PIPE:
+		case CIFSD_KEVENT_DESTROY_PIPE:
+			slot->work.fn = cifsd_nl_work;
+			slot->work.prio = CIFSD_PRIO_HIGH;
+			cifsd_queue_work(&slot->work, ev->server_handle);
+			break;
+		default:
+			slot->work.fn = cifsd_nl_work;
+			slot->work.prio = CIFSD_PRIO_NORMAL;
+			cifsd_queue_work(&slot->work, ev->server_handle);
+			break;
+		}
+		n++;
+	}
+	cifsd_unplug_work();
+
+	return n;
+}
+
+/**
+ * cifsd_handle_event() - receive and dispatch one batch of kernel events
+ * @flags:	MSG_DONTWAIT to poll the socket, MSG_WAITFORONE to block
+ *		for an event
+ * @max:	max number of events to handle
+ *
+ * Return:	number of events received, -EAGAIN if no event is queued,
+ *		or -1 on error
+ */
+static int cifsd_handle_event(int flags, unsigned int max)
+{
+	int ret;
+
+	ret = cifsd_nl_recv_batch(flags, max);
+	cifsd_nl_dispatch();
+	return ret;
+}
 
-	nlh = (struct nlmsghdr *)nlsk_rcv_buf;
-	ev = (struct cifsd_uevent *)NLMSG_DATA(nlsk_rcv_buf);
-	if (len != nlh->nlmsg_len && ev->buflen) {
-		len = cifsd_nl_read(nlsk_rcv_buf, nlh->nlmsg_len, MSG_PEEK);
-		if (len != nlh->nlmsg_len)
+/**
+ * cifsd_nl_add_fd() - register a file descriptor with the event loop
+ * @fd:		file descriptor to watch for input
+ * @handler:	callback invoked from the loop when @fd becomes readable
+ *
+ * Return:	0 on success, -1 on error
+ */
+int cifsd_nl_add_fd(int fd, void (*handler)(int fd))
+{
+	struct epoll_event ev;
+	struct cifsd_nl_fd *nfd;
+
+	if (epoll_fd < 0) {
+		epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+		if (epoll_fd < 0) {
+			perror("Failed to create epoll instance\n");
 			return -1;
+		}
+	}
+
+	if (nl_nfds == CIFSD_NL_MAX_FDS) {
+		cifsd_err("too many event loop fds\n");
+		return -1;
 	}
 
-	len = cifsd_nl_read(nlsk_rcv_buf, nlh->nlmsg_len, 0);
-	if (len != nlh->nlmsg_len)
-	{
-		cifsd_err("failed to remove data\n");
+	nfd = &nl_fds[nl_nfds];
+	nfd->fd = fd;
+	nfd->handler = handler;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = nfd;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev)) {
+		perror("Failed to add fd to epoll\n");
 		return -1;
 	}
 
-	return request_handler(nlh);
+	nl_nfds++;
+	return 0;
 }
 
-static void cifsd_nl_loop(void)
+/**
+ * cifsd_nl_add_timer() - register a periodic callback with the event loop
+ * @interval:	timer period in seconds
+ * @handler:	callback invoked from the loop on every expiry
+ *
+ * Return:	0 on success, -1 on error
+ */
+int cifsd_nl_add_timer(unsigned int interval, void (*handler)(int fd))
+{
+	struct itimerspec its;
+	int fd;
+
+	fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (fd < 0) {
+		perror("Failed to create timerfd\n");
+		return -1;
+	}
+
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = interval;
+	its.it_interval.tv_sec = interval;
+	if (timerfd_settime(fd, 0, &its, NULL)) {
+		perror("Failed to arm timerfd\n");
+		close(fd);
+		return -1;
+	}
+
+	if (cifsd_nl_add_fd(fd, handler)) {
+		close(fd);
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * cifsd_nl_drain() - handle all queued kernel events, up to the budget
+ * @fd:		netlink socket fd
+ *
+ * The socket is level triggered in epoll, so events left over once the
+ * budget is spent are picked up on the next wakeup.
+ */
+static void cifsd_nl_drain(int fd)
 {
-	fd_set readfds;
+	unsigned int n = 0;
 	int ret;
 
-	for (;;) {
-		/* add cifsd netlink socket fd to read fd list*/
-		FD_ZERO(&readfds);
-		FD_SET(nlsk_fd, &readfds);
+	do {
+		ret = cifsd_handle_event(MSG_DONTWAIT, cifsd_nl_budget - n);
+		if (ret > 0)
+			n += ret;
+	} while ((ret > 0 || ret == -ENOBUFS) && n < cifsd_nl_budget);
 
-		ret = select(nlsk_fd + 1, &readfds, NULL, NULL, NULL);
-		if (ret == -1) {
-			perror("select");
+	cifsd_nl_flush();
+}
+
+/**
+ * cifsd_nl_wake_handler() - flush worker responses, resume receiving
+ * @fd:		wakeup eventfd
+ */
+static void cifsd_nl_wake_handler(int fd)
+{
+	__u64 cnt;
+	int empty;
+
+	if (read(fd, &cnt, sizeof(cnt)) != sizeof(cnt))
+		return;
+
+	__sync_lock_release(&nl_wake_pending);
+	cifsd_nl_flush();
+
+	if (nl_throttled) {
+		pthread_mutex_lock(&nl_ring_lock);
+		empty = list_empty(&nl_free_slots);
+		pthread_mutex_unlock(&nl_ring_lock);
+		if (!empty)
+			cifsd_nl_throttle(0);
+	}
+}
+
+/**
+ * cifsd_nl_workers_init() - start the workers and their wakeup eventfd
+ *
+ * Return:	0 on success, -1 on error
+ */
+static int cifsd_nl_workers_init(void)
+{
+	if (!cifsd_nr_workers)
+		return 0;
+
+	nl_wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (nl_wake_fd < 0) {
+		perror("Failed to create eventfd\n");
+		return -1;
+	}
+
+	if (cifsd_nl_add_fd(nl_wake_fd, cifsd_nl_wake_handler) ||
+	    cifsd_workers_init()) {
+		close(nl_wake_fd);
+		nl_wake_fd = -1;
+		return -1;
+	}
+	return 0;
+}
+
+/* runs until a replay is over, the kernel transports stop on a signal */
+static void cifsd_nl_loop(void)
+{
+	struct epoll_event events[CIFSD_NL_MAX_FDS];
+	struct cifsd_nl_fd *nfd;
+	int i, n;
+
+	for (;;) {
+		n = epoll_wait(epoll_fd, events, CIFSD_NL_MAX_FDS, -1);
+		if (n == -1) {
+			if (errno != EINTR)
+				perror("epoll_wait");
+			continue;
 		}
-		else {
-			if (FD_ISSET(nlsk_fd, &readfds)) {
-				cifsd_handle_event();
-			}
+
+		for (i = 0; i < n; i++) {
+			nfd = (struct cifsd_nl_fd *)events[i].data.ptr;
+			nfd->handler(nfd->fd);
 		}
+
+		if (cifsd_nl_replay_path && cifsd_replay_finished())
+			return;
 	}
 }
 
-int cifsd_nl_init(void)
+/**
+ * cifsd_nl_ring_init() - preallocate the receive ring and batch vectors
+ *
+ * Return:	0 on success, -1 on error
+ */
+static int cifsd_nl_ring_init(void)
 {
-	nlsk_rcv_buf = malloc(NETLINK_CIFSD_MAX_BUF);
-	if (!nlsk_rcv_buf) {
+	unsigned int i;
+
+	if (cifsd_nl_batch > cifsd_nl_ring_depth)
+		cifsd_nl_batch = cifsd_nl_ring_depth;
+
+	/* one response per ring slot can be in flight */
+	cifsd_pool_init(&nl_rsp_pool, "rsp",
+			sizeof(struct cifsd_nl_rsp) + NETLINK_CIFSD_MAX_PAYLOAD,
+			cifsd_nl_ring_depth);
+
+	nlsk_rcv_buf = malloc(cifsd_nl_ring_depth * NETLINK_CIFSD_MAX_BUF);
+	nl_slots = calloc(cifsd_nl_ring_depth, sizeof(*nl_slots));
+	nl_batch = calloc(cifsd_nl_batch, sizeof(*nl_batch));
+	nl_mmsg = calloc(cifsd_nl_batch, sizeof(*nl_mmsg));
+	nl_iov = calloc(cifsd_nl_batch, sizeof(*nl_iov));
+	nl_tx = calloc(cifsd_nl_ring_depth, sizeof(*nl_tx));
+	nl_tx_mmsg = calloc(cifsd_nl_ring_depth, sizeof(*nl_tx_mmsg));
+	if (!nlsk_rcv_buf || !nl_slots || !nl_batch || !nl_mmsg || !nl_iov ||
+	    !nl_tx || !nl_tx_mmsg) {
 		perror("can't alloc netlink buffer\n");
 		return -1;
 	}
 
-	nlsk_send_buf = malloc(NETLINK_CIFSD_MAX_BUF);
-	if (!nlsk_send_buf) {
-		perror("can't alloc netlink buffer\n");
-		goto free_rcv_buf;
+	for (i = 0; i < cifsd_nl_ring_depth; i++) {
+		nl_slots[i].buf = nlsk_rcv_buf + i * NETLINK_CIFSD_MAX_BUF;
+		list_add_tail(&nl_slots[i].list, &nl_free_slots);
 	}
+	nl_nr_free = cifsd_nl_ring_depth;
+	return 0;
+}
 
+static void cifsd_nl_ring_exit(void)
+{
+	free(nl_tx_mmsg);
+	free(nl_tx);
+	free(nl_iov);
+	free(nl_mmsg);
+	free(nl_batch);
+	free(nl_slots);
+	free(nlsk_rcv_buf);
+}
+
+static int cifsd_nl_sock_recv(struct mmsghdr *vec, unsigned int vlen,
+		int flags)
+{
+	return recvmmsg(nlsk_fd, vec, vlen, flags, NULL);
+}
+
+static int cifsd_nl_sock_send(struct mmsghdr *vec, unsigned int vlen)
+{
+	return sendmmsg(nlsk_fd, vec, vlen, 0);
+}
+
+static int cifsd_nl_netlink_open(void)
+{
 	nlsk_fd = socket(AF_NETLINK, SOCK_RAW, NETLINK_CIFSD);
 	if (nlsk_fd < 0) {
 		perror("Failed to create netlink socket\n");
-		goto free_send_buf;
+		return -1;
 	}
 
 	memset(&src_addr, 0, sizeof(src_addr));
 	src_addr.nl_family = AF_NETLINK;
-	src_addr.nl_pid = getpid();
+	src_addr.nl_pid = nlsk_pid;
 
 	if (bind(nlsk_fd, (struct sockaddr *)&src_addr, sizeof(src_addr))) {
 		perror("Failed to bind netlink socket\n");
-		goto close_sock;
+		return -1;
 	}
 
 	memset(&dest_addr, 0, sizeof(dest_addr));
 	dest_addr.nl_family = AF_NETLINK;
 	dest_addr.nl_pid = 0; /* kernel */
+
+	nl_peer = &dest_addr;
+	nl_peerlen = sizeof(dest_addr);
+	return 0;
+}
+
+static int cifsd_nl_unix_recv(struct mmsghdr *vec, unsigned int vlen,
+		int flags)
+{
+	int ret;
+
+	ret = recvmmsg(nlsk_fd, vec, vlen, flags, NULL);
+	/* a zero length datagram is the end of the stream */
+	if (ret > 0 && !vec[0].msg_len) {
+		errno = ECONNRESET;
+		return -1;
+	}
+	return ret;
+}
+
+/**
+ * cifsd_nl_unix_open() - connect to a local process standing in for the
+ *			kernel
+ *
+ * The peer listens on an AF_UNIX SOCK_SEQPACKET socket at
+ * cifsd_nl_unix_path and speaks the same nlmsghdr + cifsd_uevent framing
+ * as NETLINK_CIFSD, which lets the daemon be driven without the module.
+ *
+ * Return:	0 on success, -1 on error
+ */
+static int cifsd_nl_unix_open(void)
+{
+	struct sockaddr_un addr;
+
+	if (strlen(cifsd_nl_unix_path) >= sizeof(addr.sun_path)) {
+		cifsd_err("too long socket path %s\n", cifsd_nl_unix_path);
+		return -1;
+	}
+
+	nlsk_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (nlsk_fd < 0) {
+		perror("Failed to create unix socket\n");
+		return -1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, cifsd_nl_unix_path);
+	if (connect(nlsk_fd, (struct sockaddr *)&addr, sizeof(addr))) {
+		perror("Failed to connect unix socket\n");
+		return -1;
+	}
+
+	nl_peer = NULL;
+	nl_peerlen = 0;
+	return 0;
+}
+
+static int cifsd_nl_replay_recv(struct mmsghdr *vec, unsigned int vlen,
+		int flags)
+{
+	struct iovec *iov;
+	unsigned int i, len;
+
+	for (i = 0; i < vlen; i++) {
+		iov = vec[i].msg_hdr.msg_iov;
+		if (!cifsd_replay_next(iov->iov_base, iov->iov_len, &len))
+			break;
+
+		vec[i].msg_len = len;
+		vec[i].msg_hdr.msg_flags = len > iov->iov_len ? MSG_TRUNC : 0;
+	}
+
+	if (!i) {
+		cifsd_replay_eof();
+		errno = EAGAIN;
+		return -1;
+	}
+	return i;
+}
+
+static int cifsd_nl_replay_send(struct mmsghdr *vec, unsigned int vlen)
+{
+	struct msghdr *msg;
+	unsigned int i;
+	size_t j;
+
+	for (i = 0; i < vlen; i++) {
+		msg = &vec[i].msg_hdr;
+		vec[i].msg_len = 0;
+		for (j = 0; j < msg->msg_iovlen; j++)
+			vec[i].msg_len += msg->msg_iov[j].iov_len;
+		cifsd_replay_rsp(msg->msg_iov[0].iov_base);
+	}
+	return vlen;
+}
+
+/**
+ * cifsd_nl_replay_open() - replay a captured trace in place of the kernel
+ *
+ * The kernel events of the trace are fed to the daemon as fast as it takes
+ * them, its responses are timed and dropped. Throughput and latency are
+ * reported once every replayed request got its response, the event loop
+ * then returns.
+ *
+ * Return:	0 on success, -1 on error
+ */
+static int cifsd_nl_replay_open(void)
+{
+	nlsk_fd = cifsd_replay_open(cifsd_nl_replay_path);
+	if (nlsk_fd < 0)
+		return -1;
+
+	nl_peer = NULL;
+	nl_peerlen = 0;
+	return 0;
+}
+
+static const struct cifsd_nl_transport cifsd_nl_netlink_transport = {
+	.name	= "netlink",
+	.open	= cifsd_nl_netlink_open,
+	.recv	= cifsd_nl_sock_recv,
+	.send	= cifsd_nl_sock_send,
+};
+
+static const struct cifsd_nl_transport cifsd_nl_unix_transport = {
+	.name	= "unix",
+	.open	= cifsd_nl_unix_open,
+	.recv	= cifsd_nl_unix_recv,
+	.send	= cifsd_nl_sock_send,
+};
+
+static const struct cifsd_nl_transport cifsd_nl_replay_transport = {
+	.name	= "replay",
+	.open	= cifsd_nl_replay_open,
+	.recv	= cifsd_nl_replay_recv,
+	.send	= cifsd_nl_replay_send,
+};
+
+/**
+ * cifsd_nl_has_kernel() - check if the daemon talks to the cifsd module
+ *
+ * Return:	0 with a kernel stand-in or a replayed trace, 1 otherwise
+ */
+int cifsd_nl_has_kernel(void)
+{
+	return !cifsd_nl_unix_path && !cifsd_nl_replay_path;
+}
+
+int cifsd_nl_init(void)
+{
+	if (cifsd_nl_ring_init())
+		goto free_rcv_buf;
+
+	if (cifsd_nl_replay_path)
+		nl_transport = &cifsd_nl_replay_transport;
+	else if (cifsd_nl_unix_path)
+		nl_transport = &cifsd_nl_unix_transport;
+	else
+		nl_transport = &cifsd_nl_netlink_transport;
+
+	nlsk_pid = getpid();
+	if (nl_transport->open())
+		goto close_sock;
+	cifsd_debug("%s transport ready\n", nl_transport->name);
+
+	if (cifsd_nl_rcvbuf && nl_transport != &cifsd_nl_replay_transport)
+		cifsd_nl_set_bufsz(SO_RCVBUFFORCE, SO_RCVBUF, cifsd_nl_rcvbuf);
+	if (cifsd_nl_sndbuf && nl_transport != &cifsd_nl_replay_transport)
+		cifsd_nl_set_bufsz(SO_SNDBUFFORCE, SO_SNDBUF, cifsd_nl_sndbuf);
+
+	if (cifsd_nl_add_fd(nlsk_fd, cifsd_nl_drain))
+		goto close_sock;
+
+	if (cifsd_nl_workers_init())
+		goto close_sock;
 	return 0;
 
 close_sock:
-	close(nlsk_fd);
-free_send_buf:
-	free(nlsk_send_buf);
+	if (nlsk_fd >= 0)
+		close(nlsk_fd);
 free_rcv_buf:
-	free(nlsk_rcv_buf);
+	cifsd_nl_ring_exit();
 	return -1;
 }
 
 int cifsd_nl_exit(void)
 {
+	cifsd_workers_exit();
+	cifsd_nl_flush();
+	if (nl_wake_fd >= 0)
+		close(nl_wake_fd);
+
+	if (epoll_fd >= 0)
+		close(epoll_fd);
+
 	if (nlsk_fd >= 0)
 		close(nlsk_fd);
 
-	if (nlsk_send_buf)
-		free(nlsk_send_buf);
-
-	if (nlsk_rcv_buf)
-		free(nlsk_rcv_buf);
+	cifsd_nl_ring_exit();
 	return 0;
 }
 
 static void termination_handler(int signum)
 {
 	int err = 0;
-	struct cifsd_client_info *client;
 
 	failed_connection = 0;
+	nl_shutdown = 1;
 
-	list_for_each_entry(client, &cifsd_clients, list) {
-		++connection;
-	}
+	/*
+	 * Also runs in signal context on SIGABRT and SIGBUS, where the
+	 * faulting thread may hold cifsd_clients_lock. The lock is only
+	 * tried there, no close event is waited for if it is taken.
+	 */
+	connection = cifsd_nr_clients(signum == SIGABRT || signum == SIGBUS);
 	do {
 		connection += failed_connection;
 		failed_connection = 0;
@@ -265,22 +1282,62 @@ static void termination_handler(int signum)
 			cifsd_err("cifsd stop smbport failed\n");
 			return;
 		}
-		while (connection)
-			cifsd_handle_event();
+		/* the reaper and batched closes may overshoot */
+		while (connection > 0) {
+			cifsd_handle_event(MSG_WAITFORONE, cifsd_nl_batch);
+			cifsd_nl_flush();
+		}
 
 	} while (failed_connection);
+
+	if (vflags)
+		cifsd_nl_stats_dump(stdout);
 	exit(1);
 }
 
+static void cifsd_nl_signal(int fd)
+{
+	struct signalfd_siginfo si;
+
+	if (read(fd, &si, sizeof(si)) != sizeof(si))
+		return;
+
+	cifsd_debug("got signal %u\n", si.ssi_signo);
+	if (si.ssi_signo == SIGUSR1) {
+		cifsd_stats_dump(stdout);
+		return;
+	}
+	termination_handler(si.ssi_signo);
+}
+
 static void cifsd_sighandler(void)
 {
 	struct sigaction sa;
+	sigset_t mask;
+	int fd;
+
+	/*
+	 * SIGINT and SIGTERM are delivered through a signalfd, so the
+	 * shutdown handshake with the kernel runs from the event loop
+	 * instead of from signal context. SIGUSR1 dumps the stats.
+	 */
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+	sigaddset(&mask, SIGUSR1);
+	if (sigprocmask(SIG_BLOCK, &mask, NULL) == -1)
+		perror("Failed to block SIGINT/SIGTERM/SIGUSR1\n");
+
+	fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (fd < 0)
+		perror("Failed to create signalfd\n");
+	else if (cifsd_nl_add_fd(fd, cifsd_nl_signal))
+		close(fd);
 
 	sa.sa_handler = &termination_handler;
 	sigfillset(&sa.sa_mask);
+	sa.sa_flags = 0;
 
-	if (sigaction(SIGINT, &sa, NULL) == -1)
-		perror("Failed to catch SIGINT\n");
 	if (sigaction(SIGABRT, &sa, NULL) == -1)
 		perror("Failed to catch SIGABORT\n");
 	if (sigaction(SIGBUS, &sa, NULL) == -1)
@@ -289,16 +1346,21 @@ static void cifsd_sighandler(void)
 
 int cifsd_netlink_setup(void)
 {
+	/* before the workers start, they must inherit the blocked mask */
+	cifsd_sighandler();
+
 	if (cifsd_nl_init())
 		return -1;
 
 	initialize();
 	handle_init_event();
 
-	cifsd_sighandler();
 	cifsd_nl_loop();
 
 	handle_exit_event();
 	cifsd_nl_exit();
+
+	if (cifsd_nl_replay_path)
+		return cifsd_replay_close();
 	return 0;
 }
@@ -22,6 +22,7 @@
 #define __CIFSD_TOOLS_NETLINK_H
 
 #include <linux/netlink.h>
+#include <pthread.h>
 #include "cifsd.h"
 
 #define NETLINK_CIFSD		31
@@ -30,6 +31,34 @@
 					sizeof(struct cifsd_uevent) + \
 					NETLINK_CIFSD_MAX_PAYLOAD)
 
+/* default number of kernel events handled per event loop wakeup */
+#define CIFSD_NL_DEFAULT_BUDGET	64
+/* default number of kernel events read per recvmmsg call */
+#define CIFSD_NL_DEFAULT_BATCH	16
+/* default number of preallocated NETLINK_CIFSD_MAX_BUF receive slots */
+#define CIFSD_NL_DEFAULT_RING_DEPTH	64
+/* ceiling for the receive buffer growth after ENOBUFS */
+#define CIFSD_NL_MAX_RCVBUF	(8 * 1024 * 1024)
+/* send attempts for a queued batch the kernel pushes back on */
+#define CIFSD_NL_SEND_RETRIES	8
+/* seconds the channel counts as overloaded after a receive overrun */
+#define CIFSD_NL_OVERLOAD_SECS	2
+
+/*
+ * Fragmented responses: the daemon advertises CIFSD_UEVENT_F_FRAGMENT in
+ * u.i_conn.flags of CIFSD_UEVENT_INIT_CONNECTION, a kernel that supports
+ * it answers with CIFSD_KEVENT_INIT_CONNECTION carrying the bit in
+ * k.i_conn.flags. A kernel that never answers keeps the single message
+ * path, its r_pipe/i_pipe flags are ignored. Once negotiated, the kernel
+ * sets the bit in r_pipe/i_pipe flags when it accepts a response bigger
+ * than NETLINK_CIFSD_MAX_PAYLOAD, up to CIFS_MAX_MSGSIZE. Such a response is sent as back to back chunks of at
+ * most NETLINK_CIFSD_MAX_PAYLOAD, each carrying the full uevent with
+ * buflen set to the chunk length and the count field set to the total
+ * length. nlmsg_seq numbers the chunks from 0 and every chunk but the
+ * last has NLM_F_MULTI set.
+ */
+#define CIFSD_UEVENT_F_FRAGMENT	0x1
+
 #define NETLINK_REQ_INIT        0x00
 #define NETLINK_REQ_SENT        0x01
 #define NETLINK_REQ_RECV        0x02
@@ -55,6 +84,7 @@ enum cifsd_uevent_e {
 	CIFSD_KEVENT_DESTROY_PIPE,
 	CIFSD_KEVENT_SMBPORT_CLOSE_FAIL,
 	CIFSD_KEVENT_SMBPORT_CLOSE_PASS,
+	CIFSD_KEVENT_INIT_CONNECTION,
 };
 
 struct cifsd_uevent {
@@ -67,7 +97,7 @@ struct cifsd_uevent {
 		/* messages u -> k */
 		unsigned int	nt_status;
 		struct msg_init_conn {
-			unsigned int	unused;
+			unsigned int	flags;
 		} i_conn;
 		struct msg_exit_conn {
 			unsigned int	unused;
@@ -89,6 +119,9 @@ struct cifsd_uevent {
 
 	union {
 		/* messages k -> u */
+		struct msg_init_conn_rsp {
+			unsigned int	flags;
+		} i_conn;
 		struct msg_create_pipe {
 			__u64		id;
 			char   codepage[CIFSD_CODEPAGE_LEN];
@@ -99,6 +132,7 @@ struct cifsd_uevent {
 		struct msg_read_pipe {
 			__u64		id;
 			unsigned int	out_buflen;
+			unsigned int	flags;
 		} r_pipe;
 		struct msg_write_pipe {
 			__u64		id;
@@ -106,6 +140,7 @@ struct cifsd_uevent {
 		struct msg_ioctl_pipe {
 			__u64		id;
 			unsigned int	out_buflen;
+			unsigned int	flags;
 		} i_pipe;
 		struct msg_lanman_pipe {
 			unsigned int    out_buflen;
@@ -118,10 +153,82 @@ struct cifsd_uevent {
 
 /* List of connected clients */
 struct list_head cifsd_clients;
+extern pthread_mutex_t cifsd_clients_lock;
+
+/* client and pipe limits, 0 for no cap */
+#define CIFSD_REAP_TTL			300	/* seconds */
+#define CIFSD_DEFAULT_MAX_CLIENTS	16384
+#define CIFSD_DEFAULT_MAX_PIPES		65536
+#define CIFSD_DEFAULT_MAX_BYTES		(64UL << 20)
+
+extern unsigned int cifsd_reap_ttl;
+extern unsigned long cifsd_max_clients;
+extern unsigned long cifsd_max_pipes;
+extern unsigned long cifsd_max_bytes;
+
+/* per client quotas, 0 for none */
+extern unsigned int cifsd_client_max_pipes;
+extern unsigned long cifsd_client_max_bytes;
+extern unsigned int cifsd_client_max_rate;	/* requests per second */
+extern unsigned int cifsd_client_max_cpu;	/* CPU ms per second */
+
+/* client and pipe bookkeeping, updated atomically */
+struct cifsd_reap_stats {
+	unsigned long	clients;
+	unsigned long	pipes;
+	unsigned long	bytes;		/* objects and pending responses */
+	unsigned long	reaped_clients;
+	unsigned long	reaped_pipes;
+	unsigned long	reaped_bytes;
+	unsigned long	refused;	/* creates over a cap */
+	unsigned long	passes;
+	unsigned long	quota;		/* requests over a client quota */
+};
+
+extern struct cifsd_reap_stats cifsd_reap_stats;
+int cifsd_reaper_parse(char *opts);
+int cifsd_reaper_init(void);
+void cifsd_reaper_dump(FILE *fp);
+void cifsd_clients_dump(FILE *fp);
+unsigned int cifsd_nr_clients(int trylock);
 int connection;
 int failed_connection;
 int cifsd_common_sendmsg(struct cifsd_uevent *ev, char *buf,
 		unsigned int buflen);
+int cifsd_queue_sendmsg(struct cifsd_uevent *ev, char *buf,
+		unsigned int buflen);
+void cifsd_nl_flush(void);
+void cifsd_nl_set_features(unsigned int flags);
+unsigned int cifsd_nl_max_rsp(unsigned int flags);
+char *cifsd_nl_rsp_get(unsigned int size);
+void cifsd_nl_rsp_put(char *buf);
 int cifsd_netlink_setup(void);
 
+extern unsigned int cifsd_nl_budget;
+extern unsigned int cifsd_nl_batch;
+extern unsigned int cifsd_nl_ring_depth;
+extern char *cifsd_nl_unix_path;
+extern char *cifsd_nl_replay_path;
+int cifsd_nl_has_kernel(void);
+extern unsigned int cifsd_nl_rcvbuf;
+extern unsigned int cifsd_nl_sndbuf;
+extern int cifsd_nl_shed;
+
+/* netlink channel counters, updated atomically */
+struct cifsd_nl_stats {
+	unsigned long	rx_events;
+	unsigned long	rx_dropped;	/* truncated or malformed events */
+	unsigned long	rx_overruns;	/* ENOBUFS, kernel dropped events */
+	unsigned long	tx_events;
+	unsigned long	tx_retries;
+	unsigned long	tx_dropped;
+	unsigned long	shed;		/* requests refused under overload */
+};
+
+extern struct cifsd_nl_stats cifsd_nl_stats;
+void cifsd_nl_stats_dump(FILE *fp);
+int cifsd_nl_overloaded(void);
+int cifsd_nl_add_fd(int fd, void (*handler)(int fd));
+int cifsd_nl_add_timer(unsigned int interval, void (*handler)(int fd));
+
 #endif /* __CIFSD_TOOLS_NETLINK_H */
@@ -18,10 +18,14 @@
  *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
  */
 
-#include <assert.h>
+#include <time.h>
 #include "cifsd.h"
 #include "list.h"
 #include "netlink.h"
+#include "htable.h"
+#include "pool.h"
+#include "worker.h"
+#include "stats.h"
 
 #define CREATE	0x1
 #define REMOVE	0x2
@@ -29,44 +33,172 @@
 #define WRITE	0x8
 #define TRANS	0x10
 
+/* objects preallocated at start, the pools grow beyond on demand */
+#define CIFSD_CLIENT_PREALLOC	64
+#define CIFSD_PIPE_PREALLOC	128
+
+pthread_mutex_t cifsd_clients_lock = PTHREAD_MUTEX_INITIALIZER;
+/* server_handle to client, cifsd_clients is kept for walking them all */
+static struct cifsd_htable cifsd_client_table;
+
+static struct cifsd_pool cifsd_client_pool;
+static struct cifsd_pool cifsd_pipe_pool;
+
+unsigned int cifsd_reap_ttl = CIFSD_REAP_TTL;
+unsigned long cifsd_max_clients = CIFSD_DEFAULT_MAX_CLIENTS;
+unsigned long cifsd_max_pipes = CIFSD_DEFAULT_MAX_PIPES;
+unsigned long cifsd_max_bytes = CIFSD_DEFAULT_MAX_BYTES;
+struct cifsd_reap_stats cifsd_reap_stats;
+
+unsigned int cifsd_client_max_pipes;
+unsigned long cifsd_client_max_bytes;
+unsigned int cifsd_client_max_rate;
+unsigned int cifsd_client_max_cpu;
+
+/* clients listed by cifsd_clients_dump() at most */
+#define CIFSD_DUMP_CLIENTS	256
+
+/*
+ * Client of the event being handled on this thread, saves the handlers
+ * taking cifsd_clients_lock again. Only this worker touches it meanwhile.
+ */
+static __thread struct cifsd_client_info *cur_client;
+
 void initialize(void)
 {
 	INIT_LIST_HEAD(&cifsd_clients);
+	cifsd_htable_init(&cifsd_client_table);
+
+	if (cifsd_pool_init(&cifsd_client_pool, "client",
+			sizeof(struct cifsd_client_info),
+			CIFSD_CLIENT_PREALLOC) ||
+	    cifsd_pool_init(&cifsd_pipe_pool, "pipe",
+			sizeof(struct cifsd_pipe), CIFSD_PIPE_PREALLOC))
+		cifsd_err("failed to preallocate client and pipe objects\n");
+}
+
+static time_t cifsd_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
+
+/* count one more object of @bytes, 0 if @count is at its cap @max */
+static int cifsd_charge(unsigned long *count, unsigned long max,
+		long bytes)
+{
+	if (max && *count >= max) {
+		__sync_fetch_and_add(&cifsd_reap_stats.refused, 1);
+		return 0;
+	}
+
+	__sync_fetch_and_add(count, 1);
+	__sync_fetch_and_add(&cifsd_reap_stats.bytes, bytes);
+	return 1;
+}
+
+static void cifsd_uncharge(unsigned long *count, long bytes)
+{
+	__sync_fetch_and_sub(count, 1);
+	__sync_fetch_and_sub(&cifsd_reap_stats.bytes, bytes);
 }
 
 struct cifsd_client_info *head;
 
 struct cifsd_client_info *lookup_client(__u64 clienthash)
 {
-	struct cifsd_client_info *client;
-	struct list_head *tmp;
-
-	if (!list_empty(&cifsd_clients)) {
-		list_for_each(tmp, &cifsd_clients) {
-			client = list_entry(tmp, struct cifsd_client_info, list);
-			if (client->hash == clienthash) {
-				cifsd_debug("found matching clienthash %llu, client %p\n", clienthash, client);
-				return client;
-			}
-		}
+	struct cifsd_client_info *client = cur_client;
+
+	if (client && client->hash == clienthash)
+		return client;
+
+	pthread_mutex_lock(&cifsd_clients_lock);
+	client = cifsd_htable_lookup(&cifsd_client_table, clienthash);
+	if (client) {
+		cifsd_debug("found matching clienthash %llu, client %p\n", clienthash, client);
+		client->last_used = cifsd_now();
+		pthread_mutex_unlock(&cifsd_clients_lock);
+		return client;
 	}
 
-	client = calloc(1, sizeof(struct cifsd_client_info));
+	if (!cifsd_charge(&cifsd_reap_stats.clients, cifsd_max_clients,
+			sizeof(struct cifsd_client_info))) {
+		cifsd_err("client limit %lu reached\n", cifsd_max_clients);
+		pthread_mutex_unlock(&cifsd_clients_lock);
+		return NULL;
+	}
+
+	client = cifsd_pool_alloc(&cifsd_client_pool);
 	if (client) {
 		client->hash = clienthash;
+		client->last_used = cifsd_now();
 		INIT_LIST_HEAD(&client->list);
-		INIT_LIST_HEAD(&client->pipelist);
-		list_add(&client->list, &cifsd_clients);
-		cifsd_debug("added clienthash %llu\n", clienthash);
+		if (cifsd_htable_insert(&cifsd_client_table, clienthash,
+					client)) {
+			cifsd_pool_free(&cifsd_client_pool, client);
+			client = NULL;
+		} else {
+			list_add(&client->list, &cifsd_clients);
+			cur_client = client;
+			cifsd_debug("added clienthash %llu\n", clienthash);
+		}
 	}
+	if (!client)
+		cifsd_uncharge(&cifsd_reap_stats.clients,
+				sizeof(struct cifsd_client_info));
+	pthread_mutex_unlock(&cifsd_clients_lock);
 	return client;
 }
 
-struct cifsd_pipe *lookup_pipe(__u64 clienthash, int pipetype)
+/* client of @clienthash if it is known, unlike lookup_client() */
+static struct cifsd_client_info *cifsd_find_client(__u64 clienthash)
 {
 	struct cifsd_client_info *client;
-	struct cifsd_pipe *pipe;
-	struct list_head *tmp;
+
+	pthread_mutex_lock(&cifsd_clients_lock);
+	client = cifsd_htable_lookup(&cifsd_client_table, clienthash);
+	pthread_mutex_unlock(&cifsd_clients_lock);
+	return client;
+}
+
+/* drop a client without pipes, called with cifsd_clients_lock held */
+static void cifsd_free_client(struct cifsd_client_info *client)
+{
+	cifsd_htable_del(&cifsd_client_table, client->hash);
+	list_del(&client->list);
+	cifsd_pool_free(&cifsd_client_pool, client);
+	cifsd_uncharge(&cifsd_reap_stats.clients,
+			sizeof(struct cifsd_client_info));
+}
+
+/* slot holding instance @id of @pipetype, NULL if it is not open */
+static struct cifsd_pipe **cifsd_pipe_slot(struct cifsd_client_info *client,
+		unsigned int pipetype, __u64 id)
+{
+	struct cifsd_pipe **slot;
+	unsigned int i;
+
+	for (i = 0; i < CIFSD_PIPE_SLOTS; i++) {
+		slot = &client->pipes[pipetype][(id + i) % CIFSD_PIPE_SLOTS];
+		if (*slot && (*slot)->id == id)
+			return slot;
+	}
+
+	return NULL;
+}
+
+struct cifsd_pipe *lookup_pipe(__u64 clienthash, unsigned int pipetype,
+		__u64 id)
+{
+	struct cifsd_client_info *client;
+	struct cifsd_pipe **slot;
+
+	if (pipetype >= MAX_PIPE) {
+		cifsd_err("invalid pipe type %u\n", pipetype);
+		return NULL;
+	}
 
 	client = lookup_client(clienthash);
 	if (!client) {
@@ -74,42 +206,69 @@ struct cifsd_pipe *lookup_pipe(__u64 clienthash, int pipetype)
 		return NULL;
 	}
 
-	if (list_empty(&client->pipelist)) {
-		cifsd_err("No pipe yet opened from the client(0x%llx)\n",
-				clienthash);
+	slot = cifsd_pipe_slot(client, pipetype, id);
+	if (!slot) {
+		cifsd_err("No pipe %u/%llu opened from the client(0x%llx)\n",
+				pipetype, id, clienthash);
 		return NULL;
 	}
 
-	list_for_each(tmp, &client->pipelist) {
-		pipe = list_entry(tmp, struct cifsd_pipe, list);
-		if (pipe->pipe_type == pipetype)
-			return pipe;
-	}
+	(*slot)->last_used = client->last_used;
+	return *slot;
+}
 
-	return NULL;
+/* follow the size of the responses and request fragments a pipe holds */
+static void cifsd_pipe_charge(struct cifsd_pipe *pipe)
+{
+	unsigned int size = (pipe->datasize > 0 ? pipe->datasize : 0) +
+		pipe->queued_bytes + pipe->frag_len;
+	long delta = (long)size - (long)pipe->charged;
+
+	__sync_fetch_and_add(&cifsd_reap_stats.bytes, delta);
+	/* only the worker owning the client gets here */
+	pipe->client->bytes += delta;
+	pipe->charged = size;
 }
 
-static struct cifsd_pipe *initpipe(int pipetype, char *codepage)
+static struct cifsd_pipe *initpipe(int pipetype, __u64 id, char *codepage)
 {
 	struct cifsd_pipe *pipe = NULL;
-	pipe = (struct cifsd_pipe*) calloc(1, sizeof(struct cifsd_pipe));
+	pipe = cifsd_pool_alloc(&cifsd_pipe_pool);
 	if (pipe) {
+		pipe->id = id;
 		pipe->pipe_type = pipetype;
+		pipe->last_used = cifsd_now();
+		INIT_LIST_HEAD(&pipe->calls);
 		strncpy(pipe->codepage, codepage, CIFSD_CODEPAGE_LEN - 1);
-		INIT_LIST_HEAD(&pipe->list);
 	}
 	return pipe;
 }
 
-static int cifsd_create_pipe(__u64 clienthash, int pipetype, char *codepage)
+/* close the pipe in @slot of @client and release what it holds */
+static void cifsd_free_pipe(struct cifsd_client_info *client,
+		struct cifsd_pipe **slot)
 {
-        struct cifsd_pipe *pipe;
+	struct cifsd_pipe *pipe = *slot;
+
+	rpc_free_pipe_data(pipe);
+	cifsd_pipe_charge(pipe);
+	*slot = NULL;
+	client->nr_pipes--;
+	cifsd_pool_free(&cifsd_pipe_pool, pipe);
+	cifsd_uncharge(&cifsd_reap_stats.pipes, sizeof(struct cifsd_pipe));
+}
+
+static int cifsd_create_pipe(__u64 clienthash, unsigned int pipetype,
+		__u64 id, char *codepage)
+{
+        struct cifsd_pipe *pipe, **slot;
 	struct cifsd_client_info *client;
+	unsigned int i;
+	int charged;
 
-	pipe = initpipe(pipetype, codepage);
-	if (!pipe) {
-		cifsd_err("Failed to allocate memory for cifsd pipe\n");
-		return -ENOMEM;
+	if (pipetype >= MAX_PIPE) {
+		cifsd_err("invalid pipe type %u\n", pipetype);
+		return -EINVAL;
 	}
 
 	client = lookup_client(clienthash);
@@ -118,31 +277,350 @@ static int cifsd_create_pipe(__u64 clienthash, int pipetype, char *codepage)
 		return -ENOMEM;
 	}
 
+	if (cifsd_pipe_slot(client, pipetype, id)) {
+		cifsd_err("pipe %u/%llu already open on client 0x%llx\n",
+				pipetype, id, clienthash);
+		return -EEXIST;
+	}
+
+	for (i = 0; i < CIFSD_PIPE_SLOTS; i++) {
+		slot = &client->pipes[pipetype][(id + i) % CIFSD_PIPE_SLOTS];
+		if (!*slot)
+			break;
+	}
+	if (i == CIFSD_PIPE_SLOTS) {
+		cifsd_err("too many pipes of type %u on client 0x%llx\n",
+				pipetype, clienthash);
+		return -EMFILE;
+	}
+
+	/* the byte cap goes first, a refused pipe is never charged */
+	if (cifsd_max_bytes && cifsd_reap_stats.bytes > cifsd_max_bytes) {
+		__sync_fetch_and_add(&cifsd_reap_stats.refused, 1);
+		charged = 0;
+	} else {
+		charged = cifsd_charge(&cifsd_reap_stats.pipes,
+				cifsd_max_pipes, sizeof(struct cifsd_pipe));
+	}
+	if (!charged) {
+		cifsd_err("pipe limit reached, %lu pipes %lu bytes\n",
+				cifsd_reap_stats.pipes, cifsd_reap_stats.bytes);
+		client->refused++;
+		return -ENOSPC;
+	}
+
+	if ((cifsd_client_max_pipes &&
+	     client->nr_pipes >= cifsd_client_max_pipes) ||
+	    (cifsd_client_max_bytes &&
+	     client->bytes > cifsd_client_max_bytes)) {
+		cifsd_err("client 0x%llx over quota, %u pipes %lu bytes\n",
+				clienthash, client->nr_pipes, client->bytes);
+		cifsd_uncharge(&cifsd_reap_stats.pipes,
+				sizeof(struct cifsd_pipe));
+		__sync_fetch_and_add(&cifsd_reap_stats.quota, 1);
+		client->refused++;
+		return -EDQUOT;
+	}
+
+	pipe = initpipe(pipetype, id, codepage);
+	if (!pipe) {
+		cifsd_err("Failed to allocate memory for cifsd pipe\n");
+		cifsd_uncharge(&cifsd_reap_stats.pipes,
+				sizeof(struct cifsd_pipe));
+		return -ENOMEM;
+	}
+
 	cifsd_debug("added pipe %p, in client 0x%llx, client %p\n",
 			pipe, clienthash, client);
-	list_add(&pipe->list, &client->pipelist);
+	pipe->client = client;
+	*slot = pipe;
+	client->nr_pipes++;
 
 	return 0;
 }
 
-static int cifsd_remove_pipe(__u64 clienthash, int pipetype)
+static int cifsd_remove_pipe(__u64 clienthash, unsigned int pipetype,
+		__u64 id)
 {
-	struct cifsd_pipe *pipe;
+	struct cifsd_client_info *client;
+	struct cifsd_pipe **slot = NULL;
 
-	pipe = lookup_pipe(clienthash, pipetype);
-	if (!pipe) {
-		cifsd_err("dcerpc pipe of type (%d) not found \n", pipetype);
+	client = lookup_client(clienthash);
+	if (client && pipetype < MAX_PIPE)
+		slot = cifsd_pipe_slot(client, pipetype, id);
+	if (!slot) {
+		cifsd_err("dcerpc pipe of type (%u) not found \n", pipetype);
 		return -EINVAL;
 	}
 
-	cifsd_debug("remove pipe %p from clienthash 0x%llx\n", pipe,
+	cifsd_debug("remove pipe %p from clienthash 0x%llx\n", *slot,
 			clienthash);
-	/* If need to add logic about cleaning up pipe buffers, ADD HERE */
-	list_del(&pipe->list);
-	free(pipe);
+	cifsd_free_pipe(client, slot);
+	return 0;
+}
+
+/* reaper pass of one worker shard */
+struct cifsd_reap_work {
+	struct cifsd_work	work;
+	unsigned int		shard;
+	int			queued;
+};
+
+static struct cifsd_reap_work reap_works[CIFSD_MAX_WORKERS];
+
+static unsigned int cifsd_reap_interval(void)
+{
+	unsigned int interval = cifsd_reap_ttl / 4;
+
+	if (interval < 1)
+		interval = 1;
+	if (interval > 60)
+		interval = 60;
+	return interval;
+}
+
+/*
+ * Reap the clients of one shard. It runs on the worker owning the shard,
+ * so no event of these clients is being handled meanwhile.
+ */
+static void cifsd_reap_shard(unsigned int shard)
+{
+	struct cifsd_client_info *client, *tmp;
+	struct cifsd_pipe **slot;
+	time_t now = cifsd_now(), ttl = cifsd_reap_ttl;
+	unsigned long pipes = 0, clients = 0, bytes = 0;
+	unsigned int t, i;
+
+	/* over the byte cap, pipes idle for a pass are fair game too */
+	if (cifsd_max_bytes && cifsd_reap_stats.bytes > cifsd_max_bytes)
+		ttl = cifsd_reap_interval();
+
+	pthread_mutex_lock(&cifsd_clients_lock);
+	list_for_each_entry_safe(client, tmp, &cifsd_clients, list) {
+		if (cifsd_shard_of(client->hash) != shard)
+			continue;
+
+		for (t = 0; t < MAX_PIPE && client->nr_pipes; t++) {
+			for (i = 0; i < CIFSD_PIPE_SLOTS; i++) {
+				slot = &client->pipes[t][i];
+				if (!*slot || now - (*slot)->last_used < ttl)
+					continue;
+
+				bytes += sizeof(struct cifsd_pipe) +
+					(*slot)->charged;
+				cifsd_free_pipe(client, slot);
+				pipes++;
+			}
+		}
+
+		if (client->nr_pipes ||
+		    now - client->last_used < cifsd_reap_interval())
+			continue;
+
+		bytes += sizeof(struct cifsd_client_info);
+		cifsd_free_client(client);
+		clients++;
+	}
+	pthread_mutex_unlock(&cifsd_clients_lock);
+
+	__sync_fetch_and_add(&cifsd_reap_stats.reaped_pipes, pipes);
+	__sync_fetch_and_add(&cifsd_reap_stats.reaped_clients, clients);
+	__sync_fetch_and_add(&cifsd_reap_stats.reaped_bytes, bytes);
+	if (pipes || clients)
+		cifsd_debug("reaped %lu clients %lu pipes %lu bytes\n",
+				clients, pipes, bytes);
+}
+
+static void cifsd_reap_fn(struct cifsd_work *work)
+{
+	struct cifsd_reap_work *rw = list_entry(work, struct cifsd_reap_work,
+			work);
+
+	cifsd_reap_shard(rw->shard);
+	__sync_lock_release(&rw->queued);
+}
+
+/* timer callback, queues one pass per shard on the worker owning it */
+static void cifsd_reap_timer(int fd)
+{
+	struct cifsd_reap_work *rw;
+	unsigned int nr_shards = cifsd_nr_shards(), i;
+	__u64 expired;
+
+	if (read(fd, &expired, sizeof(expired)) != sizeof(expired))
+		return;
+
+	__sync_fetch_and_add(&cifsd_reap_stats.passes, 1);
+	for (i = 0; i < nr_shards; i++) {
+		rw = &reap_works[i];
+		/* the previous pass of this shard has not run yet */
+		if (__sync_lock_test_and_set(&rw->queued, 1))
+			continue;
+
+		rw->shard = i;
+		rw->work.fn = cifsd_reap_fn;
+		cifsd_queue_work_on(&rw->work, i, i);
+	}
+}
+
+/**
+ * cifsd_reaper_parse() - parse the -L limits
+ * @opts:	comma separated ttl=, clients=, pipes=, bytes= settings and
+ *		the client_pipes=, client_bytes=, client_rate= (requests per
+ *		second) and client_cpu= (CPU ms per second) quotas
+ *
+ * Return:	0 on success, -EINVAL on an unknown or malformed setting
+ */
+int cifsd_reaper_parse(char *opts)
+{
+	char *opt, *val, *end, *saveptr = NULL;
+	unsigned long n;
+
+	for (opt = strtok_r(opts, ",", &saveptr); opt;
+			opt = strtok_r(NULL, ",", &saveptr)) {
+		val = strchr(opt, '=');
+		if (!val)
+			return -EINVAL;
+		*val++ = '\0';
+
+		n = strtoul(val, &end, 0);
+		if (end == val || *end)
+			return -EINVAL;
+
+		if (!strcmp(opt, "ttl") && n)
+			cifsd_reap_ttl = n;
+		else if (!strcmp(opt, "clients"))
+			cifsd_max_clients = n;
+		else if (!strcmp(opt, "pipes"))
+			cifsd_max_pipes = n;
+		else if (!strcmp(opt, "bytes"))
+			cifsd_max_bytes = n;
+		else if (!strcmp(opt, "client_pipes"))
+			cifsd_client_max_pipes = n;
+		else if (!strcmp(opt, "client_bytes"))
+			cifsd_client_max_bytes = n;
+		else if (!strcmp(opt, "client_rate"))
+			cifsd_client_max_rate = n;
+		else if (!strcmp(opt, "client_cpu"))
+			cifsd_client_max_cpu = n;
+		else
+			return -EINVAL;
+	}
+
 	return 0;
 }
 
+/**
+ * cifsd_reaper_init() - start reaping idle clients and pipes
+ *
+ * Return:	0 on success, -1 on error
+ */
+int cifsd_reaper_init(void)
+{
+	return cifsd_nl_add_timer(cifsd_reap_interval(), cifsd_reap_timer);
+}
+
+/**
+ * cifsd_reaper_dump() - print the client and pipe bookkeeping counters
+ * @fp:		output stream
+ */
+void cifsd_reaper_dump(FILE *fp)
+{
+	struct cifsd_reap_stats *st = &cifsd_reap_stats;
+
+	fprintf(fp, "clients %lu/%lu pipes %lu/%lu bytes %lu/%lu ttl %us\n",
+		st->clients, cifsd_max_clients, st->pipes, cifsd_max_pipes,
+		st->bytes, cifsd_max_bytes, cifsd_reap_ttl);
+	fprintf(fp, "reaped clients %lu pipes %lu bytes %lu, refused %lu, "
+		"passes %lu\n", st->reaped_clients, st->reaped_pipes,
+		st->reaped_bytes, st->refused, st->passes);
+	fprintf(fp, "client quota pipes %u bytes %lu rate %u/s cpu %ums/s, "
+		"refused %lu\n", cifsd_client_max_pipes,
+		cifsd_client_max_bytes, cifsd_client_max_rate,
+		cifsd_client_max_cpu, st->quota);
+}
+
+/**
+ * cifsd_nr_clients() - number of clients in the client table
+ * @trylock:	give up if cifsd_clients_lock is taken, in signal context
+ *
+ * Return:	number of clients, 0 if @trylock is set and the lock taken
+ */
+unsigned int cifsd_nr_clients(int trylock)
+{
+	unsigned int n;
+
+	if (!trylock)
+		pthread_mutex_lock(&cifsd_clients_lock);
+	else if (pthread_mutex_trylock(&cifsd_clients_lock))
+		return 0;
+
+	n = cifsd_client_table.count;
+	pthread_mutex_unlock(&cifsd_clients_lock);
+	return n;
+}
+
+/* one row of cifsd_clients_dump() */
+struct cifsd_client_row {
+	__u64			hash;
+	unsigned int		nr_pipes;
+	unsigned int		rate;
+	unsigned long		bytes;
+	unsigned long		requests;
+	unsigned long long	cpu_ms;
+	unsigned long		refused;
+};
+
+/**
+ * cifsd_clients_dump() - print the usage of each client
+ * @fp:		output stream
+ *
+ * The rows are copied under cifsd_clients_lock and written after it is
+ * dropped, a slow reader does not hold up the workers. Counters of
+ * clients busy on a worker may be a request behind.
+ */
+void cifsd_clients_dump(FILE *fp)
+{
+	struct cifsd_client_row *rows, *row;
+	struct cifsd_client_info *client;
+	unsigned int i, n = 0, count;
+	time_t now = cifsd_now();
+
+	rows = malloc(CIFSD_DUMP_CLIENTS * sizeof(*rows));
+	if (!rows)
+		return;
+
+	pthread_mutex_lock(&cifsd_clients_lock);
+	count = cifsd_client_table.count;
+	list_for_each_entry(client, &cifsd_clients, list) {
+		if (n == CIFSD_DUMP_CLIENTS)
+			break;
+
+		row = &rows[n++];
+		row->hash = client->hash;
+		row->nr_pipes = client->nr_pipes;
+		row->bytes = client->bytes;
+		row->requests = client->requests;
+		row->rate = client->window == now ? client->window_requests : 0;
+		row->cpu_ms = client->cpu_ns / 1000000;
+		row->refused = client->refused;
+	}
+	pthread_mutex_unlock(&cifsd_clients_lock);
+
+	fprintf(fp, "%-18s %6s %10s %10s %8s %10s %8s\n", "client", "pipes",
+		"bytes", "requests", "req/s", "cpu(ms)", "refused");
+	for (i = 0; i < n; i++) {
+		row = &rows[i];
+		fprintf(fp, "0x%-16llx %6u %10lu %10lu %8u %10llu %8lu\n",
+			row->hash, row->nr_pipes, row->bytes, row->requests,
+			row->rate, row->cpu_ms, row->refused);
+	}
+	if (count > n)
+		fprintf(fp, "... %u more clients\n", count - n);
+
+	free(rows);
+}
+
 static int handle_create_pipe_event(void *msg)
 {
 	struct nlmsghdr *nlh = (struct nlmsghdr *)msg;
@@ -152,7 +630,7 @@ static int handle_create_pipe_event(void *msg)
 	cifsd_debug("CREATE: on server handle 0x%llx, pipe type %u\n",
 			ev->server_handle, ev->pipe_type);
 	ret = cifsd_create_pipe(ev->server_handle, ev->pipe_type,
-			ev->k.c_pipe.codepage);
+			ev->k.c_pipe.id, ev->k.c_pipe.codepage);
 	if (ret) {
 		//TODO:	... prepare pipe create failure netlink msg ...
 		cifsd_debug("CREATE: pipe failed %d\n", ret);
@@ -169,7 +647,8 @@ static int handle_remove_pipe_event(void *msg)
 
 	cifsd_debug("DESTROY: on server handle 0x%llx, pipe %u\n",
 			ev->server_handle, ev->pipe_type);
-	ret = cifsd_remove_pipe(ev->server_handle, ev->pipe_type);
+	ret = cifsd_remove_pipe(ev->server_handle, ev->pipe_type,
+			ev->k.d_pipe.id);
 	if (ret) {
 		//TODO:	... prepare pipe removal failure netlink msg...
 		cifsd_debug("DESTROY: pipe failed %d\n", ret);
@@ -178,26 +657,52 @@ static int handle_remove_pipe_event(void *msg)
 	return ret;
 }
 
+/**
+ * cifsd_rsp_alloc() - allocate the response buffer of a READ or IOCTL
+ * @out_buflen:	length requested by the kernel, clamped to what the kernel
+ *		can take back
+ * @flags:	request flags, CIFSD_UEVENT_F_FRAGMENT allows a response up
+ *		to CIFS_MAX_MSGSIZE
+ *
+ * The buffer is never smaller than NETLINK_CIFSD_MAX_PAYLOAD, the bind and
+ * winreg responses are built without a length check.
+ *
+ * Return:	response buffer or NULL
+ */
+static char *cifsd_rsp_alloc(unsigned int *out_buflen, unsigned int flags)
+{
+	unsigned int max = cifsd_nl_max_rsp(flags);
+
+	if (*out_buflen > max) {
+		cifsd_debug("clamped out_buflen %u to %u\n", *out_buflen, max);
+		*out_buflen = max;
+	}
+
+	return cifsd_nl_rsp_get(*out_buflen);
+}
+
 static int handle_read_pipe_event(void *msg)
 {
 	struct nlmsghdr *nlh = (struct nlmsghdr *)msg;
 	struct cifsd_uevent *ev = NLMSG_DATA(nlh);
 	struct cifsd_uevent rsp_ev;
 	struct cifsd_pipe *pipe;
+	unsigned int out_buflen;
 	char *buf;
 	int ret = 0;
 	int nbytes = 0;
 
 	cifsd_debug("READ: on server handle 0x%llx\n", ev->server_handle);
-	assert(ev->k.r_pipe.out_buflen < NETLINK_CIFSD_MAX_PAYLOAD);
-	buf = calloc(1, NETLINK_CIFSD_MAX_PAYLOAD);
+	out_buflen = ev->k.r_pipe.out_buflen;
+	buf = cifsd_rsp_alloc(&out_buflen, ev->k.r_pipe.flags);
 	if (!buf) {
 		cifsd_debug("failed to allocate memory\n");
 		ret = -ENOMEM;
 		goto out;
 	}
 
-	pipe = lookup_pipe(ev->server_handle, ev->pipe_type);
+	pipe = lookup_pipe(ev->server_handle, ev->pipe_type,
+			ev->k.r_pipe.id);
 	if (!pipe) {
 		cifsd_debug("READ: pipetype %u lookup failed for clienthash 0x%llx\n",
 				ev->pipe_type, ev->server_handle);
@@ -205,7 +710,9 @@ static int handle_read_pipe_event(void *msg)
 		goto out;
 	}
 
-	nbytes = process_rpc_rsp(pipe, buf, ev->k.r_pipe.out_buflen);
+	nbytes = process_rpc_rsp(pipe, buf, out_buflen);
+	cifsd_pipe_charge(pipe);
+	/* responses are handed out in fragments fitting out_buflen */
 	if (nbytes < 0) {
 		ret = nbytes;
 		nbytes = 0;
@@ -221,11 +728,9 @@ out:
 	rsp_ev.error = ret;
 	rsp_ev.buflen = nbytes;
 	rsp_ev.u.r_pipe_rsp.read_count = nbytes;
-	ret = cifsd_common_sendmsg(&rsp_ev, buf, nbytes);
-	cifsd_debug("READ: response u->k send, on server handle 0x%llx, ret %d\n",
+	ret = cifsd_queue_sendmsg(&rsp_ev, buf, nbytes);
+	cifsd_debug("READ: response u->k queued, on server handle 0x%llx, ret %d\n",
 			ev->server_handle, ret);
-	if (buf)
-		free(buf);
 	return ret;
 }
 
@@ -238,7 +743,8 @@ static int handle_write_pipe_event(void *msg)
 	int ret;
 
 	cifsd_debug("WRITE: on server handle 0x%llx\n", ev->server_handle);
-	pipe = lookup_pipe(ev->server_handle, ev->pipe_type);
+	pipe = lookup_pipe(ev->server_handle, ev->pipe_type,
+			ev->k.w_pipe.id);
 	if (!pipe) {
 		cifsd_debug("WRITE: pipetype %u lookup failed for clienthash 0x%llx\n",
 				ev->pipe_type, ev->server_handle);
@@ -246,7 +752,8 @@ static int handle_write_pipe_event(void *msg)
 		goto out;
 	}
 
-	ret = process_rpc(pipe, ev->buffer);
+	ret = process_rpc(pipe, ev->buffer, ev->buflen);
+	cifsd_pipe_charge(pipe);
 	if (ret)
 		cifsd_debug("process_rpc: failed ret %d\n", ret);
 
@@ -259,8 +766,8 @@ out:
 	rsp_ev.error = ret;
 	rsp_ev.buflen = 0;
 	rsp_ev.u.w_pipe_rsp.write_count = ret < 0 ? 0 : ev->buflen;
-	ret = cifsd_common_sendmsg(&rsp_ev, NULL, 0);
-	cifsd_debug("WRITE: response u->k send, on server handle 0x%llx, ret %d\n",
+	ret = cifsd_queue_sendmsg(&rsp_ev, NULL, 0);
+	cifsd_debug("WRITE: response u->k queued, on server handle 0x%llx, ret %d\n",
 			ev->server_handle, ret);
 	return ret;
 }
@@ -271,20 +778,22 @@ static int handle_ioctl_pipe_event(void *msg)
 	struct cifsd_uevent *ev = NLMSG_DATA(nlh);
 	struct cifsd_uevent rsp_ev;
 	struct cifsd_pipe *pipe;
+	unsigned int out_buflen;
 	char *buf;
 	int ret;
 	int nbytes = 0;
 
 	cifsd_debug("IOCTL: on server handle %llu\n", ev->server_handle);
-	assert(ev->k.i_pipe.out_buflen < NETLINK_CIFSD_MAX_PAYLOAD);
-	buf = calloc(1, NETLINK_CIFSD_MAX_PAYLOAD);
+	out_buflen = ev->k.i_pipe.out_buflen;
+	buf = cifsd_rsp_alloc(&out_buflen, ev->k.i_pipe.flags);
 	if (!buf) {
 		cifsd_debug("failed to allocate memory\n");
 		ret = -ENOMEM;
 		goto out;
 	}
 
-	pipe = lookup_pipe(ev->server_handle, ev->pipe_type);
+	pipe = lookup_pipe(ev->server_handle, ev->pipe_type,
+			ev->k.i_pipe.id);
 	if (!pipe) {
 		cifsd_debug("IOCTL: pipetype %u lookup failed for clienthash 0x%llx\n",
 				ev->pipe_type, ev->server_handle);
@@ -292,13 +801,11 @@ static int handle_ioctl_pipe_event(void *msg)
 		goto out;
 	}
 
-	ret = process_rpc(pipe, ev->buffer);
-	if (ret) {
-		cifsd_debug("process_rpc: failed %d\n", ret);
-		goto out;
-	}
-
-	nbytes = process_rpc_rsp(pipe, buf, ev->k.i_pipe.out_buflen);
+	ret = 0;
+	nbytes = rpc_transact(pipe, ev->buffer, ev->buflen, buf,
+			out_buflen);
+	cifsd_pipe_charge(pipe);
+	/* responses are handed out in fragments fitting out_buflen */
 	if (nbytes < 0) {
 		ret = nbytes;
 		nbytes = 0;
@@ -313,11 +820,9 @@ out:
 	rsp_ev.error = ret;
 	rsp_ev.buflen = nbytes;
 	rsp_ev.u.i_pipe_rsp.data_count = nbytes;
-	ret = cifsd_common_sendmsg(&rsp_ev, buf, nbytes);
-	cifsd_debug("IOCTL: response u->k send, on server handle 0x%llx, ret %d\n",
+	ret = cifsd_queue_sendmsg(&rsp_ev, buf, nbytes);
+	cifsd_debug("IOCTL: response u->k queued, on server handle 0x%llx, ret %d\n",
 			ev->server_handle, ret);
-	if (buf)
-		free(buf);
 
 	return ret;
 }
@@ -327,42 +832,59 @@ static int handle_lanman_pipe_event(void *msg)
 	struct nlmsghdr *nlh = (struct nlmsghdr *)msg;
 	struct cifsd_uevent *ev = NLMSG_DATA(nlh);
 	struct cifsd_uevent rsp_ev;
-	struct cifsd_pipe *pipe;
+	struct cifsd_pipe pipe;
+	unsigned int out_buflen;
 	char *buf;
-	int ret;
+	int ret = 0;
 	int nbytes = 0;
 	int param_len = 0;
 
 	cifsd_debug("LANMAN: on server handle 0x%llx\n", ev->server_handle);
-	assert(ev->k.l_pipe.out_buflen < NETLINK_CIFSD_MAX_PAYLOAD);
-	buf = calloc(1, NETLINK_CIFSD_MAX_PAYLOAD);
-	if (!buf) {
-		cifsd_debug("failed to allocate memory\n");
-		ret = -ENOMEM;
-		goto out;
+	/* enumerations are cheap to retry, pipe responses are not */
+	if (cifsd_nl_shed && cifsd_nl_overloaded()) {
+		cifsd_debug("LANMAN: shed under overload\n");
+		__sync_fetch_and_add(&cifsd_nl_stats.shed, 1);
+		memset(&rsp_ev, 0, sizeof(rsp_ev));
+		rsp_ev.type = CIFSD_UEVENT_LANMAN_PIPE_RSP;
+		rsp_ev.server_handle = ev->server_handle;
+		rsp_ev.pipe_type = ev->pipe_type;
+		rsp_ev.error = -EBUSY;
+		return cifsd_queue_sendmsg(&rsp_ev, NULL, 0);
 	}
 
-	ret = cifsd_create_pipe(ev->server_handle, ev->pipe_type,
-			ev->k.l_pipe.codepage);
-	if (ret) {
-		cifsd_debug("CREATE: pipe failed %d\n", ret);
-		goto out;
-	}
+	/* a response never outgrows one netlink payload */
+	out_buflen = ev->k.l_pipe.out_buflen;
+	if (out_buflen > NETLINK_CIFSD_MAX_PAYLOAD)
+		out_buflen = NETLINK_CIFSD_MAX_PAYLOAD;
 
-	pipe = lookup_pipe(ev->server_handle, ev->pipe_type);
-	if (!pipe) {
-		cifsd_debug("LANMAN: pipetype %u lookup failed for clienthash 0x%llx\n",
-				ev->pipe_type, ev->server_handle);
-		ret = -ENOENT;
+	buf = cifsd_nl_rsp_get(NETLINK_CIFSD_MAX_PAYLOAD);
+	if (!buf) {
+		cifsd_debug("failed to allocate memory\n");
+		ret = -ENOMEM;
 		goto out;
 	}
 
-	strncpy(pipe->username, ev->k.l_pipe.username,
-			CIFSD_USERNAME_LEN - 1);
-	nbytes = handle_lanman_pipe(pipe, ev->buffer, buf, &param_len);
+	/*
+	 * RAP calls are one shot, serve them from a pipe on the stack
+	 * without touching the client and pipe tables
+	 */
+	memset(&pipe, 0, sizeof(pipe));
+	pipe.pipe_type = LANMAN;
+	INIT_LIST_HEAD(&pipe.calls);
+	/* same sized arrays, the last byte stays the terminator */
+	memcpy(pipe.codepage, ev->k.l_pipe.codepage, CIFSD_CODEPAGE_LEN - 1);
+	memcpy(pipe.username, ev->k.l_pipe.username, CIFSD_USERNAME_LEN - 1);
+
+	nbytes = handle_lanman_pipe(&pipe, ev->buffer, ev->buflen, buf,
+			out_buflen, &param_len);
 	if (nbytes < 0) {
 		ret = nbytes;
 		nbytes = 0;
+	} else if ((unsigned int)nbytes > out_buflen) {
+		cifsd_err("LANMAN: response %d over out_buflen %u\n", nbytes,
+				out_buflen);
+		ret = -EOVERFLOW;
+		nbytes = 0;
 	}
 
 out:
@@ -375,19 +897,84 @@ out:
 	rsp_ev.buflen = nbytes;
 	rsp_ev.u.l_pipe_rsp.data_count = nbytes;
 	rsp_ev.u.l_pipe_rsp.param_count = param_len;
-	ret = cifsd_common_sendmsg(&rsp_ev, buf, nbytes);
-	cifsd_debug("IOCTL: response u->k send, on server handle 0x%llx, ret %d\n",
+	ret = cifsd_queue_sendmsg(&rsp_ev, buf, nbytes);
+	cifsd_debug("LANMAN: response u->k queued, on server handle 0x%llx, ret %d\n",
 			ev->server_handle, ret);
-	if (buf)
-		free(buf);
-
-	ret = cifsd_remove_pipe(ev->server_handle, ev->pipe_type);
-	if (ret)
-		cifsd_debug("DESTROY: pipe failed %d\n", ret);
 
 	return ret;
 }
 
+/*
+ * Check a pipe event of @client against its quotas and count it in the
+ * current one second window. Closing a pipe and reading out a response
+ * free resources and are always let through.
+ */
+static int cifsd_client_admit(struct cifsd_client_info *client,
+		unsigned int type)
+{
+	time_t now;
+
+	if (!client)
+		return 0;
+
+	now = cifsd_now();
+	client->last_used = now;
+	if (client->window != now) {
+		client->window = now;
+		client->window_requests = 0;
+		client->window_cpu_ns = 0;
+	}
+	client->window_requests++;
+
+	if (type == CIFSD_KEVENT_DESTROY_PIPE || type == CIFSD_KEVENT_READ_PIPE)
+		return 0;
+
+	if ((cifsd_client_max_rate &&
+	     client->window_requests > cifsd_client_max_rate) ||
+	    (cifsd_client_max_cpu &&
+	     client->window_cpu_ns >= cifsd_client_max_cpu * 1000000ULL) ||
+	    (cifsd_client_max_bytes &&
+	     client->bytes > cifsd_client_max_bytes)) {
+		cifsd_debug("client 0x%llx over quota\n", client->hash);
+		__sync_fetch_and_add(&cifsd_reap_stats.quota, 1);
+		client->refused++;
+		return -EBUSY;
+	}
+
+	return 0;
+}
+
+/* fail an event without handling it, with the response it expects */
+static int cifsd_refuse_event(unsigned int type, struct cifsd_uevent *ev,
+		int err)
+{
+	struct cifsd_uevent rsp_ev;
+
+	memset(&rsp_ev, 0, sizeof(rsp_ev));
+	switch (type) {
+	case CIFSD_KEVENT_READ_PIPE:
+		rsp_ev.type = CIFSD_UEVENT_READ_PIPE_RSP;
+		break;
+	case CIFSD_KEVENT_WRITE_PIPE:
+		rsp_ev.type = CIFSD_UEVENT_WRITE_PIPE_RSP;
+		break;
+	case CIFSD_KEVENT_IOCTL_PIPE:
+		rsp_ev.type = CIFSD_UEVENT_IOCTL_PIPE_RSP;
+		break;
+	case CIFSD_KEVENT_LANMAN_PIPE:
+		rsp_ev.type = CIFSD_UEVENT_LANMAN_PIPE_RSP;
+		break;
+	default:
+		/* CREATE has no response */
+		return err;
+	}
+
+	rsp_ev.server_handle = ev->server_handle;
+	rsp_ev.pipe_type = ev->pipe_type;
+	rsp_ev.error = err;
+	return cifsd_queue_sendmsg(&rsp_ev, NULL, 0);
+}
+
 /*
  * once the pipe is available, utilize the code from process_rpc/process_rpc_rsp
  * modify the rpc request/response to use the pipe from above methods
@@ -396,11 +983,24 @@ int request_handler(void *msg)
 {
 	struct nlmsghdr *nlh = (struct nlmsghdr *)msg;
 	struct cifsd_uevent *ev = NLMSG_DATA(nlh);
+	struct cifsd_client_info *client;
+	__u64 start = 0;
 	int ret = 0;
 
 	cifsd_debug("got %u event, pipe type %u\n", nlh->nlmsg_type,
 			ev->pipe_type);
 
+	if (nlh->nlmsg_type >= CIFSD_KEVENT_CREATE_PIPE &&
+	    nlh->nlmsg_type <= CIFSD_KEVENT_DESTROY_PIPE) {
+		cur_client = cifsd_find_client(ev->server_handle);
+		ret = cifsd_client_admit(cur_client, nlh->nlmsg_type);
+		if (ret) {
+			cur_client = NULL;
+			return cifsd_refuse_event(nlh->nlmsg_type, ev, ret);
+		}
+		start = cifsd_stats_now();
+	}
+
 	switch (nlh->nlmsg_type) {
 	case CIFSD_KEVENT_CREATE_PIPE:
 		ret = handle_create_pipe_event(msg);
@@ -435,11 +1035,25 @@ int request_handler(void *msg)
 		--connection;
 		break;
 
+	case CIFSD_KEVENT_INIT_CONNECTION:
+		cifsd_nl_set_features(ev->k.i_conn.flags);
+		break;
+
 	default:
 		cifsd_err("unknown event %u\n", ev->type);
 		ret = -EINVAL;
 		break;
 	}
 
+	/* set by the lookup, a CREATE may just have made the client */
+	client = cur_client;
+	cur_client = NULL;
+	if (client) {
+		start = cifsd_stats_now() - start;
+		client->requests++;
+		client->cpu_ns += start;
+		client->window_cpu_ns += start;
+	}
+
 	return ret;
 }
@@ -0,0 +1,155 @@
+/*
+ *   cifsd-tools/cifsd/pool.c
+ *
+ *   Copyright (C) 2016 Namjae Jeon <namjae.jeon@protocolfreedom.org>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ */
+
+#include "pool.h"
+
+static LIST_HEAD(cifsd_pools);
+static pthread_mutex_t cifsd_pools_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* carve @nr more objects out of a new block, called with pool->lock held */
+static int cifsd_pool_grow(struct cifsd_pool *pool, unsigned int nr)
+{
+	char *block;
+	unsigned int i;
+
+	block = calloc(nr, pool->size);
+	if (!block)
+		return -ENOMEM;
+
+	for (i = 0; i < nr; i++) {
+		*(void **)(block + i * pool->size) = pool->free_list;
+		pool->free_list = block + i * pool->size;
+	}
+	pool->total += nr;
+	pool->grows++;
+	return 0;
+}
+
+/**
+ * cifsd_pool_init() - set up a pool and register it for the stats dump
+ * @pool:	pool
+ * @name:	name shown in the stats dump
+ * @size:	object size
+ * @prealloc:	objects to allocate right away
+ *
+ * Return:	0 on success, -ENOMEM if the preallocation failed, the pool
+ *		is usable either way
+ */
+int cifsd_pool_init(struct cifsd_pool *pool, const char *name, size_t size,
+		unsigned int prealloc)
+{
+	int ret = 0;
+
+	memset(pool, 0, sizeof(*pool));
+	pool->name = name;
+	/* the free list link lives in the object, keep objects aligned */
+	pool->size = (size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+	pthread_mutex_init(&pool->lock, NULL);
+
+	if (prealloc)
+		ret = cifsd_pool_grow(pool, prealloc);
+
+	pthread_mutex_lock(&cifsd_pools_lock);
+	list_add_tail(&pool->list, &cifsd_pools);
+	pthread_mutex_unlock(&cifsd_pools_lock);
+	return ret;
+}
+
+/**
+ * __cifsd_pool_alloc() - get an object from a pool, not cleared
+ * @pool:	pool
+ *
+ * Return:	object or NULL if the pool could not grow
+ */
+void *__cifsd_pool_alloc(struct cifsd_pool *pool)
+{
+	void *obj;
+
+	pthread_mutex_lock(&pool->lock);
+	if (!pool->free_list && cifsd_pool_grow(pool, CIFSD_POOL_GROW)) {
+		pthread_mutex_unlock(&pool->lock);
+		return NULL;
+	}
+
+	obj = pool->free_list;
+	pool->free_list = *(void **)obj;
+	pool->allocs++;
+	if (++pool->in_use > pool->peak)
+		pool->peak = pool->in_use;
+	pthread_mutex_unlock(&pool->lock);
+
+	return obj;
+}
+
+/**
+ * cifsd_pool_alloc() - get a zeroed object from a pool
+ * @pool:	pool
+ *
+ * Return:	object or NULL if the pool could not grow
+ */
+void *cifsd_pool_alloc(struct cifsd_pool *pool)
+{
+	void *obj = __cifsd_pool_alloc(pool);
+
+	if (obj)
+		memset(obj, 0, pool->size);
+	return obj;
+}
+
+/**
+ * cifsd_pool_free() - give an object back to its pool
+ * @pool:	pool the object was allocated from
+ * @obj:	object, may be NULL
+ */
+void cifsd_pool_free(struct cifsd_pool *pool, void *obj)
+{
+	if (!obj)
+		return;
+
+	pthread_mutex_lock(&pool->lock);
+	*(void **)obj = pool->free_list;
+	pool->free_list = obj;
+	pool->frees++;
+	pool->in_use--;
+	pthread_mutex_unlock(&pool->lock);
+}
+
+/**
+ * cifsd_pool_dump() - print the usage counters of every pool
+ * @fp:		output stream
+ */
+void cifsd_pool_dump(FILE *fp)
+{
+	struct cifsd_pool *pool;
+
+	fprintf(fp, "%-16s %8s %10s %10s %10s %10s %10s %8s\n", "pool",
+		"objsize", "total", "in_use", "peak", "allocs", "frees",
+		"blocks");
+
+	pthread_mutex_lock(&cifsd_pools_lock);
+	list_for_each_entry(pool, &cifsd_pools, list) {
+		pthread_mutex_lock(&pool->lock);
+		fprintf(fp, "%-16s %8zu %10lu %10lu %10lu %10lu %10lu %8lu\n",
+			pool->name, pool->size, pool->total, pool->in_use,
+			pool->peak, pool->allocs, pool->frees, pool->grows);
+		pthread_mutex_unlock(&pool->lock);
+	}
+	pthread_mutex_unlock(&cifsd_pools_lock);
+}
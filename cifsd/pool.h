@@ -0,0 +1,55 @@
+/*
+ *   cifsd-tools/cifsd/pool.h
+ *
+ *   Copyright (C) 2016 Namjae Jeon <namjae.jeon@protocolfreedom.org>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ */
+
+#ifndef __CIFSD_TOOLS_POOL_H
+#define __CIFSD_TOOLS_POOL_H
+
+#include "cifsd.h"
+
+/*
+ * Fixed size object pool. Objects are carved out of blocks of
+ * CIFSD_POOL_GROW objects and go back to a free list when released, the
+ * blocks are kept for the life of the daemon.
+ */
+#define CIFSD_POOL_GROW		32
+
+struct cifsd_pool {
+	const char		*name;
+	size_t			size;
+	pthread_mutex_t		lock;
+	void			*free_list;
+	struct list_head	list;	/* all pools, for the stats dump */
+
+	unsigned long		total;	/* objects carved from blocks */
+	unsigned long		in_use;
+	unsigned long		peak;
+	unsigned long		allocs;
+	unsigned long		frees;
+	unsigned long		grows;	/* blocks allocated */
+};
+
+int cifsd_pool_init(struct cifsd_pool *pool, const char *name, size_t size,
+		unsigned int prealloc);
+void *__cifsd_pool_alloc(struct cifsd_pool *pool);
+void *cifsd_pool_alloc(struct cifsd_pool *pool);
+void cifsd_pool_free(struct cifsd_pool *pool, void *obj);
+void cifsd_pool_dump(FILE *fp);
+
+#endif /* __CIFSD_TOOLS_POOL_H */
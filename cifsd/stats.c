@@ -0,0 +1,345 @@
+/*
+ *   cifsd-tools/cifsd/stats.c
+ *
+ *   Copyright (C) 2016 Namjae Jeon <namjae.jeon@protocolfreedom.org>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ */
+
+#define _GNU_SOURCE
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "netlink.h"
+#include "dcerpc.h"
+#include "stats.h"
+#include "pool.h"
+#include "worker.h"
+
+#define CIFSD_STATS_NR_EVENTS	\
+	(CIFSD_KEVENT_SMBPORT_CLOSE_PASS - CIFSD_KEVENT_CREATE_PIPE + 1)
+
+/* queueing delay and service time of one kind of request */
+struct cifsd_lat {
+	struct cifsd_hist	queued;
+	struct cifsd_hist	service;
+};
+
+static const char *cifsd_stats_event_names[CIFSD_STATS_NR_EVENTS] = {
+	"create_pipe", "read_pipe", "write_pipe", "ioctl_pipe",
+	"lanman_pipe", "destroy_pipe", "smbport_close_fail",
+	"smbport_close_pass",
+};
+
+static const char *cifsd_stats_pipe_names[MAX_PIPE] = {
+	"srvsvc", "winreg", "lanman",
+};
+
+static struct cifsd_lat event_lat[CIFSD_STATS_NR_EVENTS];
+/* allocated on first use, most opnums are never seen */
+static struct cifsd_lat *op_lat[MAX_PIPE][CIFSD_STATS_MAX_OPS];
+
+/* operation decoded by the request being handled on this thread */
+static __thread int cur_pipe = -1;
+static __thread unsigned int cur_opnum;
+
+static int stats_sock = -1;
+
+__u64 cifsd_stats_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (__u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static unsigned int cifsd_hist_index(__u64 v)
+{
+	unsigned int shift;
+
+	if (v < CIFSD_HIST_SUB)
+		return v;
+
+	shift = 63 - __builtin_clzll(v) - CIFSD_HIST_SUB_BITS;
+	return (shift + 1) * CIFSD_HIST_SUB +
+		((v >> shift) & (CIFSD_HIST_SUB - 1));
+}
+
+/* highest value that falls in bucket @idx */
+static __u64 cifsd_hist_value(unsigned int idx)
+{
+	unsigned int shift;
+
+	if (idx < CIFSD_HIST_SUB)
+		return idx;
+
+	shift = idx / CIFSD_HIST_SUB - 1;
+	return (((__u64)(CIFSD_HIST_SUB + idx % CIFSD_HIST_SUB) + 1) << shift)
+		- 1;
+}
+
+/**
+ * cifsd_hist_record() - add a sample to a histogram, lock free
+ * @hist:	histogram
+ * @ns:		sample in ns
+ */
+void cifsd_hist_record(struct cifsd_hist *hist, __u64 ns)
+{
+	__u64 max;
+
+	__sync_fetch_and_add(&hist->buckets[cifsd_hist_index(ns)], 1);
+	__sync_fetch_and_add(&hist->count, 1);
+	__sync_fetch_and_add(&hist->sum, ns);
+
+	max = hist->max;
+	while (ns > max) {
+		if (__sync_bool_compare_and_swap(&hist->max, max, ns))
+			break;
+		max = hist->max;
+	}
+}
+
+/**
+ * cifsd_hist_pct() - percentile of a histogram
+ * @hist:	histogram
+ * @pct:	percentile, 0 to 100
+ *
+ * Return:	upper bound of the bucket holding the percentile, in ns
+ */
+__u64 cifsd_hist_pct(struct cifsd_hist *hist, double pct)
+{
+	unsigned long count = hist->count, seen = 0, rank;
+	unsigned int i;
+
+	if (!count)
+		return 0;
+
+	rank = (unsigned long)(pct / 100 * count);
+	if (rank >= count)
+		rank = count - 1;
+
+	for (i = 0; i < CIFSD_HIST_BUCKETS; i++) {
+		seen += hist->buckets[i];
+		if (seen > rank)
+			break;
+	}
+
+	if (i == CIFSD_HIST_BUCKETS || cifsd_hist_value(i) > hist->max)
+		return hist->max;
+	return cifsd_hist_value(i);
+}
+
+/**
+ * cifsd_stats_set_op() - note the operation of the current request
+ * @pipe_type:	pipe the operation came in on
+ * @opnum:	DCERPC opnum or RAP opcode
+ *
+ * The latency of the request is then accounted to this operation as well
+ * as to its event type.
+ */
+void cifsd_stats_set_op(unsigned int pipe_type, unsigned int opnum)
+{
+	if (pipe_type >= MAX_PIPE)
+		return;
+
+	cur_pipe = pipe_type;
+	cur_opnum = opnum < CIFSD_STATS_MAX_OPS ? opnum :
+		CIFSD_STATS_MAX_OPS - 1;
+}
+
+static struct cifsd_lat *cifsd_stats_op_lat(int pipe, unsigned int opnum)
+{
+	struct cifsd_lat *lat = op_lat[pipe][opnum];
+
+	if (lat)
+		return lat;
+
+	lat = calloc(1, sizeof(*lat));
+	if (!lat)
+		return NULL;
+
+	if (!__sync_bool_compare_and_swap(&op_lat[pipe][opnum], NULL, lat)) {
+		free(lat);
+		lat = op_lat[pipe][opnum];
+	}
+	return lat;
+}
+
+/**
+ * cifsd_stats_event() - account a handled kernel event
+ * @type:	CIFSD_KEVENT_* type
+ * @queued:	ns from receipt to the start of handling
+ * @service:	ns spent in request_handler
+ */
+void cifsd_stats_event(unsigned int type, __u64 queued, __u64 service)
+{
+	struct cifsd_lat *lat;
+
+	if (type >= CIFSD_KEVENT_CREATE_PIPE &&
+	    type <= CIFSD_KEVENT_SMBPORT_CLOSE_PASS) {
+		lat = &event_lat[type - CIFSD_KEVENT_CREATE_PIPE];
+		cifsd_hist_record(&lat->queued, queued);
+		cifsd_hist_record(&lat->service, service);
+	}
+
+	if (cur_pipe < 0)
+		return;
+
+	lat = cifsd_stats_op_lat(cur_pipe, cur_opnum);
+	if (lat) {
+		cifsd_hist_record(&lat->queued, queued);
+		cifsd_hist_record(&lat->service, service);
+	}
+	cur_pipe = -1;
+}
+
+static void cifsd_hist_dump(FILE *fp, const char *name, const char *kind,
+		struct cifsd_hist *hist)
+{
+	if (!hist->count)
+		return;
+
+	fprintf(fp, "%-24s %-8s %10lu %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+		name, kind, hist->count,
+		(double)hist->sum / hist->count / 1e3,
+		cifsd_hist_pct(hist, 50) / 1e3,
+		cifsd_hist_pct(hist, 90) / 1e3,
+		cifsd_hist_pct(hist, 99) / 1e3,
+		cifsd_hist_pct(hist, 99.9) / 1e3,
+		hist->max / 1e3);
+}
+
+/**
+ * cifsd_stats_dump() - print the latency histograms, channel counters,
+ *			scheduling, object pool usage, client bookkeeping
+ *			and usage
+ * @fp:		output stream
+ */
+void cifsd_stats_dump(FILE *fp)
+{
+	const struct cifsd_rpc_op *op;
+	struct cifsd_lat *lat;
+	char name[32];
+	int i, j;
+
+	fprintf(fp, "%-24s %-8s %10s %10s %10s %10s %10s %10s %10s\n",
+		"request", "latency", "count", "mean(us)", "p50", "p90",
+		"p99", "p99.9", "max");
+
+	for (i = 0; i < CIFSD_STATS_NR_EVENTS; i++) {
+		lat = &event_lat[i];
+		cifsd_hist_dump(fp, cifsd_stats_event_names[i], "queued",
+				&lat->queued);
+		cifsd_hist_dump(fp, cifsd_stats_event_names[i], "service",
+				&lat->service);
+	}
+
+	for (i = 0; i < MAX_PIPE; i++) {
+		for (j = 0; j < CIFSD_STATS_MAX_OPS; j++) {
+			lat = op_lat[i][j];
+			if (!lat)
+				continue;
+
+			op = rpc_find_op(i, j);
+			if (op)
+				snprintf(name, sizeof(name), "%s/%s",
+					cifsd_stats_pipe_names[i], op->name);
+			else
+				snprintf(name, sizeof(name), "%s/%d",
+					cifsd_stats_pipe_names[i], j);
+			cifsd_hist_dump(fp, name, "queued", &lat->queued);
+			cifsd_hist_dump(fp, name, "service", &lat->service);
+		}
+	}
+
+	fprintf(fp, "\n");
+	cifsd_nl_stats_dump(fp);
+	cifsd_workers_dump(fp);
+	fprintf(fp, "\n");
+	cifsd_pool_dump(fp);
+	fprintf(fp, "\n");
+	cifsd_reaper_dump(fp);
+	fprintf(fp, "\n");
+	cifsd_clients_dump(fp);
+	fflush(fp);
+}
+
+/* event loop callback, writes one dump per connection */
+static void cifsd_stats_accept(int fd)
+{
+	struct timeval tv = { .tv_sec = 1 };
+	FILE *fp;
+	int cfd;
+
+	cfd = accept4(fd, NULL, NULL, SOCK_CLOEXEC);
+	if (cfd < 0)
+		return;
+
+	/* a stuck reader must not stall the event loop */
+	setsockopt(cfd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	fp = fdopen(cfd, "w");
+	if (!fp) {
+		close(cfd);
+		return;
+	}
+	cifsd_stats_dump(fp);
+	fclose(fp);
+}
+
+/**
+ * cifsd_stats_init() - listen for stats readers on a local socket
+ * @sock_path:	AF_UNIX stream socket path, NULL for none
+ *
+ * Return:	0 on success, -1 on error
+ */
+int cifsd_stats_init(const char *sock_path)
+{
+	struct sockaddr_un addr;
+
+	if (!sock_path)
+		return 0;
+
+	if (strlen(sock_path) >= sizeof(addr.sun_path)) {
+		cifsd_err("too long socket path %s\n", sock_path);
+		return -1;
+	}
+
+	stats_sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (stats_sock < 0) {
+		perror("Failed to create stats socket\n");
+		return -1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, sock_path);
+	unlink(sock_path);
+
+	if (bind(stats_sock, (struct sockaddr *)&addr, sizeof(addr)) ||
+	    listen(stats_sock, 4)) {
+		perror("Failed to bind stats socket\n");
+		goto out;
+	}
+
+	if (cifsd_nl_add_fd(stats_sock, cifsd_stats_accept))
+		goto out;
+	return 0;
+
+out:
+	close(stats_sock);
+	stats_sock = -1;
+	return -1;
+}
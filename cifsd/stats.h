@@ -0,0 +1,54 @@
+/*
+ *   cifsd-tools/cifsd/stats.h
+ *
+ *   Copyright (C) 2016 Namjae Jeon <namjae.jeon@protocolfreedom.org>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ */
+
+#ifndef __CIFSD_TOOLS_STATS_H
+#define __CIFSD_TOOLS_STATS_H
+
+#include "cifsd.h"
+
+/*
+ * Log-linear latency histogram in ns: values below CIFSD_HIST_SUB are
+ * exact, above that every power of two is split in CIFSD_HIST_SUB buckets,
+ * so a recorded value is off by at most 1/CIFSD_HIST_SUB.
+ */
+#define CIFSD_HIST_SUB_BITS	3
+#define CIFSD_HIST_SUB		(1 << CIFSD_HIST_SUB_BITS)
+#define CIFSD_HIST_BUCKETS	((64 - CIFSD_HIST_SUB_BITS + 1) * CIFSD_HIST_SUB)
+
+/* opnums and RAP opcodes tracked per pipe, higher ones share the last */
+#define CIFSD_STATS_MAX_OPS	128
+
+struct cifsd_hist {
+	unsigned long	count;
+	__u64		sum;
+	__u64		max;
+	unsigned long	buckets[CIFSD_HIST_BUCKETS];
+};
+
+__u64 cifsd_stats_now(void);
+void cifsd_hist_record(struct cifsd_hist *hist, __u64 ns);
+__u64 cifsd_hist_pct(struct cifsd_hist *hist, double pct);
+
+void cifsd_stats_set_op(unsigned int pipe_type, unsigned int opnum);
+void cifsd_stats_event(unsigned int type, __u64 queued, __u64 service);
+void cifsd_stats_dump(FILE *fp);
+int cifsd_stats_init(const char *sock_path);
+
+#endif /* __CIFSD_TOOLS_STATS_H */
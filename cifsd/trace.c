@@ -0,0 +1,460 @@
+/*
+ *   cifsd-tools/cifsd/trace.c
+ *
+ *   Copyright (C) 2016 Namjae Jeon <namjae.jeon@protocolfreedom.org>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ */
+
+#include <time.h>
+#include <sys/eventfd.h>
+
+#include "netlink.h"
+#include "trace.h"
+
+/* set while received and sent events are captured */
+int cifsd_tracing;
+
+static FILE *trace_fp;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* replay: trace loaded in memory, walked one rx record at a time */
+struct cifsd_replay_req {
+	__u64		handle;
+	__u64		start;
+};
+
+static char *replay_buf;
+static size_t replay_size, replay_off;
+static int replay_fd = -1;
+static int replay_done;
+/* set once every request got its response or on error, stops the loop */
+static int replay_finished, replay_failed;
+static pthread_mutex_t replay_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* requests waiting for their response, in arrival order */
+static struct cifsd_replay_req *replay_reqs;
+static unsigned int replay_nr_reqs, replay_max_reqs;
+
+/* response latencies in ns */
+static __u64 *replay_lat;
+static unsigned long replay_nr_lat, replay_max_lat;
+
+static unsigned long replay_events, replay_rsps;
+static __u64 replay_start, replay_end;
+
+static __u64 cifsd_trace_clock(clockid_t clk)
+{
+	struct timespec ts;
+
+	clock_gettime(clk, &ts);
+	return (__u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * cifsd_trace_open() - start capturing events to a trace file
+ * @path:	trace file, truncated if it exists
+ *
+ * Return:	0 on success, -1 on error
+ */
+int cifsd_trace_open(const char *path)
+{
+	struct cifsd_trace_hdr hdr;
+
+	trace_fp = fopen(path, "w");
+	if (!trace_fp) {
+		cifsd_err("[%s] open failed, err %d\n", path, errno);
+		return -1;
+	}
+	setvbuf(trace_fp, NULL, _IOFBF, 1 << 16);
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, CIFSD_TRACE_MAGIC, sizeof(hdr.magic));
+	hdr.version = CIFSD_TRACE_VERSION;
+	if (fwrite(&hdr, sizeof(hdr), 1, trace_fp) != 1) {
+		cifsd_err("[%s] write failed\n", path);
+		fclose(trace_fp);
+		trace_fp = NULL;
+		return -1;
+	}
+
+	cifsd_tracing = 1;
+	return 0;
+}
+
+void cifsd_trace_close(void)
+{
+	pthread_mutex_lock(&trace_lock);
+	cifsd_tracing = 0;
+	if (trace_fp)
+		fclose(trace_fp);
+	trace_fp = NULL;
+	pthread_mutex_unlock(&trace_lock);
+}
+
+static void cifsd_trace_write(unsigned int dir, const struct iovec *iov,
+		int iovcnt, unsigned int len)
+{
+	struct cifsd_trace_rec rec;
+	unsigned int left = len, n;
+	int i;
+
+	rec.ts = cifsd_trace_clock(CLOCK_REALTIME);
+	rec.dir = dir;
+	rec.len = len;
+
+	pthread_mutex_lock(&trace_lock);
+	if (!trace_fp)
+		goto out;
+
+	fwrite(&rec, sizeof(rec), 1, trace_fp);
+	for (i = 0; i < iovcnt && left; i++) {
+		n = iov[i].iov_len < left ? iov[i].iov_len : left;
+		fwrite(iov[i].iov_base, n, 1, trace_fp);
+		left -= n;
+	}
+out:
+	pthread_mutex_unlock(&trace_lock);
+}
+
+/**
+ * cifsd_trace_rx() - capture an event received from the kernel
+ * @msg:	nlmsghdr framed event
+ * @len:	event length
+ */
+void cifsd_trace_rx(const void *msg, unsigned int len)
+{
+	struct iovec iov;
+
+	iov.iov_base = (void *)msg;
+	iov.iov_len = len;
+	cifsd_trace_write(CIFSD_TRACE_RX, &iov, 1, len);
+}
+
+/**
+ * cifsd_trace_tx() - capture an event sent to the kernel
+ * @iov:	header slot and payload
+ * @iovcnt:	number of iovec entries
+ * @len:	bytes sent
+ */
+void cifsd_trace_tx(const struct iovec *iov, int iovcnt, unsigned int len)
+{
+	cifsd_trace_write(CIFSD_TRACE_TX, iov, iovcnt, len);
+}
+
+/**
+ * cifsd_replay_open() - load a trace for replay
+ * @path:	trace file written by cifsd_trace_open()
+ *
+ * Return:	eventfd readable while events are left, or -1 on error
+ */
+int cifsd_replay_open(const char *path)
+{
+	struct cifsd_trace_hdr *hdr;
+	struct stat st;
+	FILE *fp;
+
+	fp = fopen(path, "r");
+	if (!fp) {
+		cifsd_err("[%s] open failed, err %d\n", path, errno);
+		return -1;
+	}
+
+	if (fstat(fileno(fp), &st) || st.st_size < (off_t)sizeof(*hdr))
+		goto bad;
+
+	replay_size = st.st_size;
+	replay_buf = malloc(replay_size);
+	if (!replay_buf)
+		goto bad;
+
+	if (fread(replay_buf, replay_size, 1, fp) != 1)
+		goto bad;
+
+	hdr = (struct cifsd_trace_hdr *)replay_buf;
+	if (memcmp(hdr->magic, CIFSD_TRACE_MAGIC, sizeof(hdr->magic)) ||
+	    hdr->version != CIFSD_TRACE_VERSION)
+		goto bad;
+	fclose(fp);
+
+	replay_off = sizeof(*hdr);
+	replay_fd = eventfd(1, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (replay_fd < 0) {
+		perror("Failed to create eventfd\n");
+		return -1;
+	}
+
+	replay_start = cifsd_trace_clock(CLOCK_MONOTONIC);
+	return replay_fd;
+
+bad:
+	cifsd_err("[%s] is not a cifsd trace\n", path);
+	free(replay_buf);
+	replay_buf = NULL;
+	fclose(fp);
+	return -1;
+}
+
+static int cifsd_replay_cmp(const void *a, const void *b)
+{
+	__u64 x = *(const __u64 *)a, y = *(const __u64 *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static __u64 cifsd_replay_pct(double pct)
+{
+	unsigned long i;
+
+	if (!replay_nr_lat)
+		return 0;
+	i = (unsigned long)(pct / 100 * (replay_nr_lat - 1));
+	return replay_lat[i];
+}
+
+static void cifsd_replay_report(void)
+{
+	double secs;
+
+	secs = (replay_end - replay_start) / 1e9;
+	qsort(replay_lat, replay_nr_lat, sizeof(*replay_lat),
+			cifsd_replay_cmp);
+
+	printf("replayed %lu events, %lu responses in %.3f s\n",
+			replay_events, replay_rsps, secs);
+	printf("throughput: %.0f events/s\n",
+			secs > 0 ? replay_events / secs : 0);
+	printf("latency us: p50 %.1f p90 %.1f p99 %.1f p99.9 %.1f max %.1f\n",
+			cifsd_replay_pct(50) / 1e3, cifsd_replay_pct(90) / 1e3,
+			cifsd_replay_pct(99) / 1e3,
+			cifsd_replay_pct(99.9) / 1e3,
+			cifsd_replay_pct(100) / 1e3);
+	fflush(stdout);
+}
+
+/* called with replay_lock held, wakes the event loop to stop it */
+static void cifsd_replay_stop(int failed)
+{
+	__u64 cnt = 1;
+
+	if (replay_finished)
+		return;
+
+	replay_finished = 1;
+	replay_failed = failed;
+	replay_end = cifsd_trace_clock(CLOCK_MONOTONIC);
+	if (write(replay_fd, &cnt, sizeof(cnt)) != sizeof(cnt))
+		perror("eventfd write");
+}
+
+/* called with replay_lock held */
+static void cifsd_replay_check_done(void)
+{
+	if (replay_done && !replay_nr_reqs)
+		cifsd_replay_stop(0);
+}
+
+static int cifsd_replay_expects_rsp(unsigned int type)
+{
+	switch (type) {
+	case CIFSD_KEVENT_READ_PIPE:
+	case CIFSD_KEVENT_WRITE_PIPE:
+	case CIFSD_KEVENT_IOCTL_PIPE:
+	case CIFSD_KEVENT_LANMAN_PIPE:
+		return 1;
+	}
+	return 0;
+}
+
+/**
+ * cifsd_replay_next() - next kernel event of the trace
+ * @buf:	receive buffer
+ * @size:	receive buffer size
+ * @len:	event length, may be more than @size if it does not fit
+ *
+ * Return:	1 if an event was copied, 0 once the trace is exhausted
+ */
+int cifsd_replay_next(void *buf, unsigned int size, unsigned int *len)
+{
+	struct cifsd_trace_rec *rec;
+
+	pthread_mutex_lock(&replay_lock);
+	while (!replay_finished && replay_off + sizeof(*rec) <= replay_size) {
+		rec = (struct cifsd_trace_rec *)(replay_buf + replay_off);
+		if (replay_off + sizeof(*rec) + rec->len > replay_size)
+			break;
+
+		replay_off += sizeof(*rec) + rec->len;
+		if (rec->dir != CIFSD_TRACE_RX)
+			continue;
+
+		*len = rec->len;
+		memcpy(buf, rec + 1, rec->len < size ? rec->len : size);
+		replay_events++;
+		pthread_mutex_unlock(&replay_lock);
+		return 1;
+	}
+	pthread_mutex_unlock(&replay_lock);
+	return 0;
+}
+
+/**
+ * cifsd_replay_eof() - the trace is exhausted, stop waking the event loop
+ *
+ * Called once a receive got no event at all, after the events of the
+ * previous receives were accepted or dropped.
+ */
+void cifsd_replay_eof(void)
+{
+	__u64 cnt;
+
+	pthread_mutex_lock(&replay_lock);
+	if (!replay_done) {
+		replay_done = 1;
+		if (read(replay_fd, &cnt, sizeof(cnt)) != sizeof(cnt))
+			perror("eventfd read");
+	}
+	cifsd_replay_check_done();
+	pthread_mutex_unlock(&replay_lock);
+}
+
+/**
+ * cifsd_replay_rx() - time a replayed event accepted by the daemon
+ * @msg:	nlmsghdr framed event, already checked for sanity
+ *
+ * Dropped events are never accounted, nothing waits for their response.
+ */
+void cifsd_replay_rx(const void *msg)
+{
+	const struct nlmsghdr *nlh = msg;
+	struct cifsd_replay_req *req;
+	unsigned int max;
+
+	if (!cifsd_replay_expects_rsp(nlh->nlmsg_type))
+		return;
+
+	pthread_mutex_lock(&replay_lock);
+	if (replay_nr_reqs == replay_max_reqs) {
+		max = replay_max_reqs ? replay_max_reqs * 2 : 64;
+		req = realloc(replay_reqs, max * sizeof(*replay_reqs));
+		if (!req) {
+			cifsd_err("out of memory\n");
+			cifsd_replay_stop(1);
+			pthread_mutex_unlock(&replay_lock);
+			return;
+		}
+		replay_reqs = req;
+		replay_max_reqs = max;
+	}
+	req = &replay_reqs[replay_nr_reqs++];
+	req->handle = ((const struct cifsd_uevent *)
+			NLMSG_DATA(nlh))->server_handle;
+	req->start = cifsd_trace_clock(CLOCK_MONOTONIC);
+	pthread_mutex_unlock(&replay_lock);
+}
+
+/**
+ * cifsd_replay_rsp() - account a response of the daemon
+ * @msg:	nlmsghdr framed response
+ *
+ * A response completes the oldest outstanding request of its client,
+ * responses of one client are sent in request order.
+ */
+void cifsd_replay_rsp(const void *msg)
+{
+	const struct nlmsghdr *nlh = msg;
+	const struct cifsd_uevent *ev = NLMSG_DATA(nlh);
+	unsigned long max;
+	unsigned int i;
+	__u64 lat, *buf;
+
+	/* only the last chunk of a fragmented response completes it */
+	if (nlh->nlmsg_flags & NLM_F_MULTI)
+		return;
+	if (nlh->nlmsg_type == CIFSD_UEVENT_INIT_CONNECTION ||
+	    nlh->nlmsg_type == CIFSD_UEVENT_EXIT_CONNECTION)
+		return;
+
+	pthread_mutex_lock(&replay_lock);
+	replay_rsps++;
+	for (i = 0; i < replay_nr_reqs; i++) {
+		if (replay_reqs[i].handle != ev->server_handle)
+			continue;
+
+		lat = cifsd_trace_clock(CLOCK_MONOTONIC) -
+			replay_reqs[i].start;
+		memmove(&replay_reqs[i], &replay_reqs[i + 1],
+			(replay_nr_reqs - i - 1) * sizeof(*replay_reqs));
+		replay_nr_reqs--;
+
+		if (replay_nr_lat == replay_max_lat) {
+			max = replay_max_lat ? replay_max_lat * 2 : 1024;
+			buf = realloc(replay_lat, max * sizeof(*replay_lat));
+			if (!buf) {
+				cifsd_err("out of memory\n");
+				cifsd_replay_stop(1);
+				break;
+			}
+			replay_lat = buf;
+			replay_max_lat = max;
+		}
+		replay_lat[replay_nr_lat++] = lat;
+		break;
+	}
+	cifsd_replay_check_done();
+	pthread_mutex_unlock(&replay_lock);
+}
+
+/**
+ * cifsd_replay_finished() - check if the event loop should stop
+ *
+ * Return:	1 once the replay is over, 0 otherwise
+ */
+int cifsd_replay_finished(void)
+{
+	int finished;
+
+	pthread_mutex_lock(&replay_lock);
+	finished = replay_finished;
+	pthread_mutex_unlock(&replay_lock);
+	return finished;
+}
+
+/**
+ * cifsd_replay_close() - report the replay timings and free the trace
+ *
+ * Called from the event loop thread once the workers are stopped, the
+ * replay eventfd is closed with the transport.
+ *
+ * Return:	0 on success, -1 if the replay stopped on an error
+ */
+int cifsd_replay_close(void)
+{
+	pthread_mutex_lock(&replay_lock);
+	if (!replay_finished)
+		replay_end = cifsd_trace_clock(CLOCK_MONOTONIC);
+	cifsd_replay_report();
+
+	free(replay_buf);
+	free(replay_reqs);
+	free(replay_lat);
+	replay_buf = NULL;
+	replay_reqs = NULL;
+	replay_lat = NULL;
+	replay_fd = -1;
+	pthread_mutex_unlock(&replay_lock);
+
+	return replay_failed ? -1 : 0;
+}
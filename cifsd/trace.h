@@ -0,0 +1,67 @@
+/*
+ *   cifsd-tools/cifsd/trace.h
+ *
+ *   Copyright (C) 2016 Namjae Jeon <namjae.jeon@protocolfreedom.org>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ */
+
+#ifndef __CIFSD_TOOLS_TRACE_H
+#define __CIFSD_TOOLS_TRACE_H
+
+#include <sys/uio.h>
+#include "cifsd.h"
+
+/*
+ * Trace file: a cifsd_trace_hdr followed by one cifsd_trace_rec per
+ * message, each followed by the message as it was on the wire, nlmsghdr,
+ * cifsd_uevent and payload. Fields are in host byte order.
+ */
+#define CIFSD_TRACE_MAGIC	"CIFSDTRC"
+#define CIFSD_TRACE_VERSION	1
+
+enum {
+	CIFSD_TRACE_RX = 0,	/* kernel to daemon */
+	CIFSD_TRACE_TX,		/* daemon to kernel */
+};
+
+struct cifsd_trace_hdr {
+	char		magic[8];
+	__u32		version;
+	__u32		reserved;
+};
+
+struct cifsd_trace_rec {
+	__u64		ts;	/* CLOCK_REALTIME, ns */
+	__u32		dir;
+	__u32		len;
+};
+
+extern int cifsd_tracing;
+
+int cifsd_trace_open(const char *path);
+void cifsd_trace_close(void);
+void cifsd_trace_rx(const void *msg, unsigned int len);
+void cifsd_trace_tx(const struct iovec *iov, int iovcnt, unsigned int len);
+
+int cifsd_replay_open(const char *path);
+int cifsd_replay_next(void *buf, unsigned int size, unsigned int *len);
+void cifsd_replay_eof(void);
+void cifsd_replay_rx(const void *msg);
+void cifsd_replay_rsp(const void *msg);
+int cifsd_replay_finished(void);
+int cifsd_replay_close(void);
+
+#endif /* __CIFSD_TOOLS_TRACE_H */
@@ -111,8 +111,26 @@ int init_predefined_registry(void)
 	return 0;
 }
 
-int winreg_open_root_key(struct cifsd_pipe *pipe, int opnum,
-				RPC_REQUEST_REQ *rpc_request_req, char *in_data)
+/*
+ * name a call passes behind its key handle, converted as the registry
+ * keeps names in the codepage
+ */
+static char *winreg_pull_name(struct cifsd_ndr_reader *r,
+		const char *codepage)
+{
+	struct cifsd_ndr_str name;
+
+	cifsd_ndr_pull_u16(r);		/* length */
+	cifsd_ndr_pull_u16(r);		/* size */
+	cifsd_ndr_pull_ptr_unistr(r, &name);
+	if (r->err)
+		return ERR_PTR(r->err);
+	return cifsd_ndr_str_dup(&name, codepage);
+}
+
+int winreg_open_root_key(struct cifsd_pipe *pipe,
+				RPC_REQUEST_REQ *rpc_request_req,
+				struct cifsd_ndr_reader *r)
 {
 	RPC_REQUEST_RSP *rpc_request_rsp;
 	OPENHKEY_RSP *winreg_rsp = malloc(sizeof(OPENHKEY_RSP));
@@ -126,7 +144,7 @@ int winreg_open_root_key(struct cifsd_pipe *pipe, int opnum,
 				RPC_FLAG_FIRST | RPC_FLAG_LAST,
 				rpc_request_req->hdr.call_id);
 	rpc_request_rsp->context_id = rpc_request_req->context_id;
-	switch (opnum) {
+	switch (le16_to_cpu(rpc_request_req->opnum)) {
 	case WINREG_OPENHKCR:
 		winreg_rsp->key_handle.addr = (__u32)reg_openhkcr;
 		reg_openhkcr->open_status = 1;
@@ -153,7 +171,8 @@ int winreg_open_root_key(struct cifsd_pipe *pipe, int opnum,
 }
 
 int winreg_get_version(struct cifsd_pipe *pipe,
-				RPC_REQUEST_REQ *rpc_request_req, char *in_data)
+				RPC_REQUEST_REQ *rpc_request_req,
+				struct cifsd_ndr_reader *r)
 {
 	RPC_REQUEST_RSP *rpc_request_rsp;
 	GET_VERSION_RSP *winreg_rsp =
@@ -176,7 +195,8 @@ int winreg_get_version(struct cifsd_pipe *pipe,
 }
 
 int winreg_delete_key(struct cifsd_pipe *pipe,
-				RPC_REQUEST_REQ *rpc_request_req, char *in_data)
+				RPC_REQUEST_REQ *rpc_request_req,
+				struct cifsd_ndr_reader *r)
 {
 	RPC_REQUEST_RSP *rpc_request_rsp;
 	WINREG_COMMON_RSP *winreg_rsp;
@@ -188,16 +208,14 @@ int winreg_delete_key(struct cifsd_pipe *pipe,
 	struct registry_node *prev_key;
 	char *token;
 	char *name;
-	KEY_HANDLE *key_handle = (KEY_HANDLE *)in_data;
-	NAME_INFO *name_info = (NAME_INFO *)(((char *)in_data) +
-							sizeof(KEY_HANDLE));
+	const KEY_HANDLE *key_handle;
 
-	key_addr = key_handle->addr;
-	base_key = (struct registry_node *)key_addr;
-	relative_name = smb_strndup_from_utf16((char *)name_info->Buffer,
-			name_info->key_packet_len, 1, pipe->codepage);
+	key_handle = cifsd_ndr_pull(r, sizeof(*key_handle));
+	relative_name = winreg_pull_name(r, pipe->codepage);
 	if (IS_ERR(relative_name))
 		return PTR_ERR(relative_name);
+	key_addr = key_handle->addr;
+	base_key = (struct registry_node *)key_addr;
 	name = malloc(sizeof(strlen(relative_name)));
 	strcpy(name, relative_name);
 	ret = search_registry(relative_name, (struct registry_node *)key_addr);
@@ -251,7 +269,8 @@ int winreg_delete_key(struct cifsd_pipe *pipe,
 }
 
 int winreg_flush_key(struct cifsd_pipe *pipe,
-				RPC_REQUEST_REQ *rpc_request_req, char *in_data)
+				RPC_REQUEST_REQ *rpc_request_req,
+				struct cifsd_ndr_reader *r)
 {
 	RPC_REQUEST_RSP *rpc_request_rsp;
 	WINREG_COMMON_RSP *winreg_rsp =
@@ -272,23 +291,21 @@ int winreg_flush_key(struct cifsd_pipe *pipe,
 }
 
 int winreg_create_key(struct cifsd_pipe *pipe,
-				RPC_REQUEST_REQ *rpc_request_req, char *in_data)
+				RPC_REQUEST_REQ *rpc_request_req,
+				struct cifsd_ndr_reader *r)
 {
 	RPC_REQUEST_RSP *rpc_request_rsp;
 	CREATE_KEY_RSP *winreg_rsp;
 	struct registry_node *ret;
 	int key_addr;
 	char *relative_name;
+	const KEY_HANDLE *key_handle;
 
-	KEY_HANDLE *key_handle = (KEY_HANDLE *)in_data;
-	NAME_INFO *name_info = (NAME_INFO *)(((char *)in_data) +
-						sizeof(KEY_HANDLE));
-
-	key_addr = key_handle->addr;
-	relative_name = smb_strndup_from_utf16((char *)name_info->Buffer,
-			name_info->key_packet_len, 1, pipe->codepage);
+	key_handle = cifsd_ndr_pull(r, sizeof(*key_handle));
+	relative_name = winreg_pull_name(r, pipe->codepage);
 	if (IS_ERR(relative_name))
 		return PTR_ERR(relative_name);
+	key_addr = key_handle->addr;
 	ret = create_key(relative_name, (struct registry_node *)key_addr);
 
 	winreg_rsp = malloc(sizeof(CREATE_KEY_RSP));
@@ -315,7 +332,8 @@ int winreg_create_key(struct cifsd_pipe *pipe,
 
 
 int winreg_open_key(struct cifsd_pipe *pipe,
-				RPC_REQUEST_REQ *rpc_request_req, char *in_data)
+				RPC_REQUEST_REQ *rpc_request_req,
+				struct cifsd_ndr_reader *r)
 {
 	RPC_REQUEST_RSP *rpc_request_rsp;
 	OPENHKEY_RSP *winreg_rsp;
@@ -323,17 +341,14 @@ int winreg_open_key(struct cifsd_pipe *pipe,
 	int key_addr;
 	char *relative_name;
 	struct registry_node *base_key;
+	const KEY_HANDLE *key_handle;
 
-	KEY_HANDLE *key_handle = (KEY_HANDLE *)in_data;
-	NAME_INFO *name_info = (NAME_INFO *)(((char *)in_data) +
-						sizeof(KEY_HANDLE));
-
-	key_addr = key_handle->addr;
-	base_key = (struct registry_node *)key_addr;
-	relative_name = smb_strndup_from_utf16((char *)name_info->Buffer,
-			name_info->key_packet_len, 1, pipe->codepage);
+	key_handle = cifsd_ndr_pull(r, sizeof(*key_handle));
+	relative_name = winreg_pull_name(r, pipe->codepage);
 	if (IS_ERR(relative_name))
 		return PTR_ERR(relative_name);
+	key_addr = key_handle->addr;
+	base_key = (struct registry_node *)key_addr;
 	ret = search_registry(relative_name, (struct registry_node *)key_addr);
 
 	winreg_rsp = malloc(sizeof(OPENHKEY_RSP));
@@ -369,14 +384,18 @@ int winreg_open_key(struct cifsd_pipe *pipe,
 }
 
 int winreg_close_key(struct cifsd_pipe *pipe,
-				RPC_REQUEST_REQ *rpc_request_req, char *in_data)
+				RPC_REQUEST_REQ *rpc_request_req,
+				struct cifsd_ndr_reader *r)
 {
 	RPC_REQUEST_RSP *rpc_request_rsp;
 	OPENHKEY_RSP *winreg_rsp;
 	int key_addr;
-	KEY_HANDLE *key_handle = (KEY_HANDLE *)in_data;
+	const KEY_HANDLE *key_handle;
 	struct registry_node *base_key;
 
+	key_handle = cifsd_ndr_pull(r, sizeof(*key_handle));
+	if (!key_handle)
+		return r->err;
 	key_addr = key_handle->addr;
 	base_key = (struct registry_node *)key_addr;
 
@@ -404,7 +423,8 @@ int winreg_close_key(struct cifsd_pipe *pipe,
 }
 
 int winreg_enum_key(struct cifsd_pipe *pipe,
-				RPC_REQUEST_REQ *rpc_request_req, char *in_data)
+				RPC_REQUEST_REQ *rpc_request_req,
+				struct cifsd_ndr_reader *r)
 {
 	RPC_REQUEST_RSP *rpc_request_rsp;
 	ENUM_KEY_RSP *winreg_rsp = malloc(sizeof(ENUM_KEY_RSP));
@@ -429,7 +449,8 @@ int winreg_enum_key(struct cifsd_pipe *pipe,
 }
 
 int winreg_query_info_key(struct cifsd_pipe *pipe,
-				RPC_REQUEST_REQ *rpc_request_req, char *in_data)
+				RPC_REQUEST_REQ *rpc_request_req,
+				struct cifsd_ndr_reader *r)
 {
 	RPC_REQUEST_RSP *rpc_request_rsp;
 	QUERY_INFO_KEY_RSP *winreg_rsp =
@@ -449,7 +470,8 @@ int winreg_query_info_key(struct cifsd_pipe *pipe,
 }
 
 int winreg_notify_change_key_value(struct cifsd_pipe *pipe,
-				RPC_REQUEST_REQ *rpc_request_req, char *in_data)
+				RPC_REQUEST_REQ *rpc_request_req,
+				struct cifsd_ndr_reader *r)
 {
 	RPC_REQUEST_RSP *rpc_request_rsp;
 	WINREG_COMMON_RSP *winreg_rsp =
@@ -468,37 +490,34 @@ int winreg_notify_change_key_value(struct cifsd_pipe *pipe,
 	return 0;
 }
 int winreg_set_value(struct cifsd_pipe *pipe,
-				RPC_REQUEST_REQ *rpc_request_req, char *in_data)
+				RPC_REQUEST_REQ *rpc_request_req,
+				struct cifsd_ndr_reader *r)
 {
 	RPC_REQUEST_RSP *rpc_request_rsp;
 	struct registry_value *ret;
-	int offset = 0;
-	int value_len = 0;
 	int key_addr;
 	struct registry_node *base_key;
 	char *value_name;
-	KEY_HANDLE *key_handle;
-	NAME_INFO *name_info;
+	const KEY_HANDLE *key_handle;
 	VALUE_BUFFER *value_buffer;
 	WINREG_COMMON_RSP *winreg_rsp;
 
-	key_handle = (KEY_HANDLE *)in_data;
-	offset += sizeof(KEY_HANDLE);
-	name_info = (NAME_INFO *)(((char *)in_data) + offset);
-
-	key_addr = key_handle->addr;
-	base_key = (struct registry_node *)key_addr;
-
-	value_name = smb_strndup_from_utf16((char *)name_info->Buffer,
-			name_info->key_packet_len, 1, pipe->codepage);
+	key_handle = cifsd_ndr_pull(r, sizeof(*key_handle));
+	value_name = winreg_pull_name(r, pipe->codepage);
 	if (IS_ERR(value_name))
 		return PTR_ERR(value_name);
-	value_len = name_info->key_packet_len;
-	value_len = ((value_len + 3) & ~3);
-	offset += (sizeof(NAME_INFO) + value_len);
 
-	value_buffer =  (VALUE_BUFFER *)(((char *)in_data) + offset);
-	offset += (sizeof(__u32)*2);
+	/* the value is copied straight out of the request */
+	value_buffer = (VALUE_BUFFER *)cifsd_ndr_pull(r, sizeof(*value_buffer));
+	if (value_buffer)
+		cifsd_ndr_pull(r, le32_to_cpu(value_buffer->buffer_count));
+	if (r->err) {
+		free(value_name);
+		return r->err;
+	}
+
+	key_addr = key_handle->addr;
+	base_key = (struct registry_node *)key_addr;
 	winreg_rsp = malloc(sizeof(WINREG_COMMON_RSP));
 	if (!winreg_rsp) {
 		free(value_name);
@@ -525,31 +544,25 @@ int winreg_set_value(struct cifsd_pipe *pipe,
 }
 
 int winreg_delete_value(struct cifsd_pipe *pipe,
-				RPC_REQUEST_REQ *rpc_request_req, char *in_data)
+				RPC_REQUEST_REQ *rpc_request_req,
+				struct cifsd_ndr_reader *r)
 {
 	RPC_REQUEST_RSP *rpc_request_rsp;
 	struct registry_value *ret;
-	int offset = 0;
 	int key_addr;
 	struct registry_node *base_key;
 	struct registry_value *value;
 	struct registry_value *prev_value;
 	char *value_name;
-	KEY_HANDLE *key_handle;
-	NAME_INFO *name_info;
+	const KEY_HANDLE *key_handle;
 	WINREG_COMMON_RSP *winreg_rsp;
 
-	key_handle = (KEY_HANDLE *)in_data;
-	offset += sizeof(KEY_HANDLE);
-	name_info = (NAME_INFO *)(((char *)in_data) + offset);
-
-	key_addr = key_handle->addr;
-	base_key = (struct registry_node *)key_addr;
-
-	value_name = smb_strndup_from_utf16((char *)name_info->Buffer,
-			name_info->key_packet_len, 1, pipe->codepage);
+	key_handle = cifsd_ndr_pull(r, sizeof(*key_handle));
+	value_name = winreg_pull_name(r, pipe->codepage);
 	if (IS_ERR(value_name))
 		return PTR_ERR(value_name);
+	key_addr = key_handle->addr;
+	base_key = (struct registry_node *)key_addr;
 	winreg_rsp = malloc(sizeof(WINREG_COMMON_RSP));
 	if (!winreg_rsp) {
 		free(value_name);
@@ -572,7 +585,7 @@ int winreg_delete_value(struct cifsd_pipe *pipe,
 		else {
 			value = base_key->value_list;
 			prev_value = NULL;
-			while ((strcmp(value->value_name, value_name) != 0)) {
+			while (value != ret) {
 				prev_value = value;
 				value = value->neighbour;
 			}
@@ -595,25 +608,44 @@ int winreg_delete_value(struct cifsd_pipe *pipe,
 }
 
 int winreg_query_value(struct cifsd_pipe *pipe,
-				RPC_REQUEST_REQ *rpc_request_req, char *in_data)
+				RPC_REQUEST_REQ *rpc_request_req,
+				struct cifsd_ndr_reader *r)
 {
 	RPC_REQUEST_RSP *rpc_request_rsp;
 	struct registry_value *ret;
-	int offset = 0;
-	int value_len = 0;
 	int key_addr;
 	struct registry_value *value;
 	char *value_name;
 	QUERY_VALUE_RSP *winreg_rsp;
-	KEY_HANDLE *key_handle;
-	NAME_INFO *name_info;
-	BUFFER_INFO *buffer_info;
-	__u32 *ptr_check;
+	const KEY_HANDLE *key_handle;
+	const BUFFER_INFO *buffer_info;
+	__u32 type_ref, size_ref, length_ref;
 	QUERY_INFO *query_info;
 
+	key_handle = cifsd_ndr_pull(r, sizeof(*key_handle));
+	value_name = winreg_pull_name(r, pipe->codepage);
+	if (IS_ERR(value_name))
+		return PTR_ERR(value_name);
+
+	type_ref = cifsd_ndr_pull_u32(r);
+	cifsd_ndr_pull_u32(r);		/* type */
+	buffer_info = cifsd_ndr_pull(r, sizeof(buffer_info->ref_id));
+	if (buffer_info && buffer_info->ref_id)
+		cifsd_ndr_pull(r, sizeof(buffer_info->data_info));
+	size_ref = cifsd_ndr_pull_u32(r);
+	cifsd_ndr_pull_u32(r);		/* size */
+	length_ref = cifsd_ndr_pull_u32(r);
+	cifsd_ndr_pull_u32(r);		/* length */
+	if (r->err) {
+		free(value_name);
+		return r->err;
+	}
+
 	winreg_rsp = malloc(sizeof(QUERY_VALUE_RSP));
-	if (!winreg_rsp)
+	if (!winreg_rsp) {
+		free(value_name);
 		return -ENOMEM;
+	}
 
 	pipe->data = (char *)winreg_rsp;
 	rpc_request_rsp = &winreg_rsp->rpc_request_rsp;
@@ -622,16 +654,7 @@ int winreg_query_value(struct cifsd_pipe *pipe,
 				rpc_request_req->hdr.call_id);
 	rpc_request_rsp->context_id = rpc_request_req->context_id;
 
-	key_handle = (KEY_HANDLE *)in_data;
-	offset += sizeof(KEY_HANDLE);
-	name_info = (NAME_INFO *)(((char *)in_data) + offset);
-
 	key_addr = key_handle->addr;
-
-	value_name = smb_strndup_from_utf16((char *)name_info->Buffer,
-			name_info->key_packet_len, 1, pipe->codepage);
-	if (IS_ERR(value_name))
-		return PTR_ERR(value_name);
 	cifsd_debug("base key addr %x, value name %s\n", key_addr,
 								value_name);
 
@@ -645,34 +668,9 @@ int winreg_query_value(struct cifsd_pipe *pipe,
 	}
 	value = (struct registry_value *)ret;
 
-	value_len = name_info->key_packet_len;
-	value_len = ((value_len + 3) & ~3);
-	offset += (sizeof(NAME_INFO) + value_len);
-
-	ptr_check = (__u32 *)((in_data) + offset);
-	if (*ptr_check == 0)
-		goto err_invalid_param;
-
-	offset += (sizeof(DATA_INFO));
-
-	buffer_info = (BUFFER_INFO *)(in_data + offset);
-
-	if (buffer_info->ref_id != 0)
-		offset += (sizeof(__u32)*4);
-	else
-		offset += (sizeof(__u32));
-
-	ptr_check = (__u32 *)((in_data) + offset);
-	if (*ptr_check == 0)
-		goto err_invalid_param;
-
-	offset += (sizeof(DATA_INFO));
-
-	ptr_check = (__u32 *)((in_data) + offset);
-	if (*ptr_check == 0)
+	if (!type_ref || !size_ref || !length_ref)
 		goto err_invalid_param;
 
-	offset += (sizeof(DATA_INFO));
 	query_info = malloc(sizeof(QUERY_INFO));
 	if (!winreg_rsp) {
 		free(value_name);
@@ -725,7 +723,8 @@ err_bad_file:
 }
 
 int winreg_enum_value(struct cifsd_pipe *pipe,
-				RPC_REQUEST_REQ *rpc_request_req, char *in_data)
+				RPC_REQUEST_REQ *rpc_request_req,
+				struct cifsd_ndr_reader *r)
 {
 	RPC_REQUEST_RSP *rpc_request_rsp;
 	ENUM_VALUE_RSP *winreg_rsp = malloc(sizeof(ENUM_VALUE_RSP));
@@ -754,7 +753,7 @@ struct registry_value *search_value(char *name, struct registry_node *key_addr)
 
 	cifsd_debug("value name %s\n", name);
 	if (strcmp(name, "") == 0)
-		strcpy(name, "Default");
+		name = "Default";
 	if (base_key_addr->value_list == NULL)
 		return ERR_PTR(-EINVAL);
 
@@ -776,7 +775,7 @@ struct registry_value *set_value(char *name, VALUE_BUFFER *buffer_info,
 	struct registry_value *ret = NULL;
 
 	if (strcmp(name, "") == 0)
-		strcpy(name, "Default");
+		name = "Default";
 	if (base_key_addr->value_list == NULL) {
 		value = malloc(sizeof(struct registry_value));
 		if (!value)
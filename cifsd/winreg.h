@@ -197,36 +197,51 @@ typedef struct create_key_rsp {
 #define WINREG_KEY_SET_VALUE		0x00000002
 #define WINREG_KEY_QUERY_VALUE		0x00000001
 
-int winreg_open_root_key(struct cifsd_pipe *pipe, int opnum,
-			RPC_REQUEST_REQ *rpc_request_req, char *in_data);
+int winreg_open_root_key(struct cifsd_pipe *pipe,
+			RPC_REQUEST_REQ *rpc_request_req,
+			struct cifsd_ndr_reader *r);
 int winreg_open_key(struct cifsd_pipe *pipe,
-			RPC_REQUEST_REQ *rpc_request_req, char *in_data);
+			RPC_REQUEST_REQ *rpc_request_req,
+			struct cifsd_ndr_reader *r);
 int winreg_get_version(struct cifsd_pipe *pipe,
-			RPC_REQUEST_REQ *rpc_request_req, char *in_data);
+			RPC_REQUEST_REQ *rpc_request_req,
+			struct cifsd_ndr_reader *r);
 int winreg_delete_key(struct cifsd_pipe *pipe,
-			RPC_REQUEST_REQ *rpc_request_req, char *in_data);
+			RPC_REQUEST_REQ *rpc_request_req,
+			struct cifsd_ndr_reader *r);
 int winreg_create_key(struct cifsd_pipe *pipe,
-			RPC_REQUEST_REQ *rpc_request_req, char *in_data);
+			RPC_REQUEST_REQ *rpc_request_req,
+			struct cifsd_ndr_reader *r);
 int winreg_close_key(struct cifsd_pipe *pipe,
-			RPC_REQUEST_REQ *rpc_request_req, char *in_data);
+			RPC_REQUEST_REQ *rpc_request_req,
+			struct cifsd_ndr_reader *r);
 int winreg_open_key(struct cifsd_pipe *pipe,
-			RPC_REQUEST_REQ *rpc_request_req, char *in_data);
+			RPC_REQUEST_REQ *rpc_request_req,
+			struct cifsd_ndr_reader *r);
 int winreg_flush_key(struct cifsd_pipe *pipe,
-			RPC_REQUEST_REQ *rpc_request_req, char *in_data);
+			RPC_REQUEST_REQ *rpc_request_req,
+			struct cifsd_ndr_reader *r);
 int winreg_set_value(struct cifsd_pipe *pipe,
-			RPC_REQUEST_REQ *rpc_request_req, char *in_data);
+			RPC_REQUEST_REQ *rpc_request_req,
+			struct cifsd_ndr_reader *r);
 int winreg_delete_value(struct cifsd_pipe *pipe,
-			RPC_REQUEST_REQ *rpc_request_req, char *in_data);
+			RPC_REQUEST_REQ *rpc_request_req,
+			struct cifsd_ndr_reader *r);
 int winreg_query_value(struct cifsd_pipe *pipe,
-			RPC_REQUEST_REQ *rpc_request_req, char *in_data);
+			RPC_REQUEST_REQ *rpc_request_req,
+			struct cifsd_ndr_reader *r);
 int winreg_query_info_key(struct cifsd_pipe *pipe,
-			RPC_REQUEST_REQ *rpc_request_req, char *in_data);
+			RPC_REQUEST_REQ *rpc_request_req,
+			struct cifsd_ndr_reader *r);
 int winreg_notify_change_key_value(struct cifsd_pipe *pipe,
-			RPC_REQUEST_REQ *rpc_request_req, char *in_data);
+			RPC_REQUEST_REQ *rpc_request_req,
+			struct cifsd_ndr_reader *r);
 int winreg_enum_key(struct cifsd_pipe *pipe,
-			RPC_REQUEST_REQ *rpc_request_req, char *in_data);
+			RPC_REQUEST_REQ *rpc_request_req,
+			struct cifsd_ndr_reader *r);
 int winreg_enum_value(struct cifsd_pipe *pipe,
-			RPC_REQUEST_REQ *rpc_request_req, char *in_data);
+			RPC_REQUEST_REQ *rpc_request_req,
+			struct cifsd_ndr_reader *r);
 
 struct registry_node *init_root_key(char *name);
 int init_predefined_registry(void);
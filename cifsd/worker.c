@@ -0,0 +1,315 @@
+/*
+ *   cifsd-tools/cifsd/worker.c
+ *
+ *   Copyright (C) 2016 Namjae Jeon <namjae.jeon@protocolfreedom.org>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ */
+
+#include "worker.h"
+
+struct cifsd_worker {
+	pthread_t		thread;
+	pthread_mutex_t		lock;
+	pthread_cond_t		cond;
+	struct cifsd_sched	sched;
+	int			stop;
+};
+
+unsigned int cifsd_nr_workers;
+
+static struct cifsd_worker *workers;
+static unsigned int nr_running;
+
+/* work queued without workers, run by the netlink thread */
+static struct cifsd_sched inline_sched = {
+	.queue = {
+		LIST_HEAD_INIT(inline_sched.queue[CIFSD_PRIO_NORMAL]),
+		LIST_HEAD_INIT(inline_sched.queue[CIFSD_PRIO_HIGH]),
+	},
+};
+static int inline_plugged;
+
+static void cifsd_sched_init(struct cifsd_sched *sched)
+{
+	int i;
+
+	memset(sched, 0, sizeof(*sched));
+	for (i = 0; i < CIFSD_NR_PRIO; i++)
+		INIT_LIST_HEAD(&sched->queue[i]);
+}
+
+/* server handles are pointers, fold the high bits in */
+static __u32 cifsd_key_hash(__u64 key)
+{
+	key ^= key >> 29;
+	key *= 0x9e3779b97f4a7c15ULL;
+	return key >> 32;
+}
+
+static unsigned int cifsd_sched_bucket(__u64 key)
+{
+	return cifsd_key_hash(key) % CIFSD_SCHED_BUCKETS;
+}
+
+static void cifsd_sched_add(struct cifsd_sched *sched,
+		struct cifsd_work *work, __u64 key)
+{
+	work->bucket = cifsd_sched_bucket(key);
+
+	/* behind normal work of its key, high work waits its turn */
+	if (work->prio == CIFSD_PRIO_HIGH && !sched->waiting[work->bucket]) {
+		sched->high[work->bucket]++;
+		list_add_tail(&work->list, &sched->queue[CIFSD_PRIO_HIGH]);
+		return;
+	}
+
+	sched->waiting[work->bucket]++;
+	list_add_tail(&work->list, &sched->queue[CIFSD_PRIO_NORMAL]);
+}
+
+/* next work to run, NULL if none is queued */
+static struct cifsd_work *cifsd_sched_next(struct cifsd_sched *sched)
+{
+	struct list_head *high = &sched->queue[CIFSD_PRIO_HIGH];
+	struct list_head *normal = &sched->queue[CIFSD_PRIO_NORMAL];
+	struct cifsd_work *work;
+
+	if (list_empty(high)) {
+		if (list_empty(normal))
+			return NULL;
+		work = list_entry(normal->next, struct cifsd_work, list);
+		goto run_normal;
+	}
+
+	/*
+	 * Out of burst, run the oldest normal work not queued behind high
+	 * work of its bucket, that high work came first
+	 */
+	if (!list_empty(normal) && sched->burst >= CIFSD_PRIO_BURST) {
+		list_for_each_entry(work, normal, list) {
+			if (!sched->high[work->bucket]) {
+				sched->forced++;
+				goto run_normal;
+			}
+		}
+	}
+
+	work = list_entry(high->next, struct cifsd_work, list);
+	list_del(&work->list);
+	sched->high[work->bucket]--;
+	if (!list_empty(normal)) {
+		sched->burst++;
+		sched->promoted++;
+	}
+	return work;
+
+run_normal:
+	sched->burst = 0;
+	list_del(&work->list);
+	sched->waiting[work->bucket]--;
+	return work;
+}
+
+static void *cifsd_worker_fn(void *arg)
+{
+	struct cifsd_worker *worker = (struct cifsd_worker *)arg;
+	struct cifsd_work *work;
+
+	pthread_mutex_lock(&worker->lock);
+	for (;;) {
+		while (!(work = cifsd_sched_next(&worker->sched)) &&
+		       !worker->stop)
+			pthread_cond_wait(&worker->cond, &worker->lock);
+
+		if (!work)
+			break;
+
+		pthread_mutex_unlock(&worker->lock);
+
+		work->fn(work);
+
+		pthread_mutex_lock(&worker->lock);
+	}
+	pthread_mutex_unlock(&worker->lock);
+	return NULL;
+}
+
+/**
+ * cifsd_queue_work_on() - queue work on the worker of a shard
+ * @work:	work item, @work->fn is called from the worker thread
+ * @shard:	shard below cifsd_nr_shards()
+ * @key:	key ordering @work with other work of the key
+ *
+ * Without workers @work runs right away on the calling thread, or once
+ * cifsd_unplug_work() is called if the queue is plugged.
+ */
+void cifsd_queue_work_on(struct cifsd_work *work, unsigned int shard,
+		__u64 key)
+{
+	struct cifsd_worker *worker;
+
+	if (!nr_running) {
+		cifsd_sched_add(&inline_sched, work, key);
+		if (!inline_plugged)
+			cifsd_unplug_work();
+		return;
+	}
+
+	worker = &workers[shard];
+	pthread_mutex_lock(&worker->lock);
+	cifsd_sched_add(&worker->sched, work, key);
+	pthread_cond_signal(&worker->cond);
+	pthread_mutex_unlock(&worker->lock);
+}
+
+/**
+ * cifsd_queue_work() - queue work on the worker owning @key
+ * @work:	work item, @work->fn is called from the worker thread
+ * @key:	shard key, work with the same key runs in queueing order
+ */
+void cifsd_queue_work(struct cifsd_work *work, __u64 key)
+{
+	cifsd_queue_work_on(work, cifsd_shard_of(key), key);
+}
+
+/**
+ * cifsd_plug_work() - hold back work queued without workers
+ *
+ * Lets a batch of events be queued before any runs, so high priority
+ * ones get ahead of the batch. Workers are not affected.
+ */
+void cifsd_plug_work(void)
+{
+	inline_plugged = 1;
+}
+
+/**
+ * cifsd_unplug_work() - run the work held back by cifsd_plug_work()
+ */
+void cifsd_unplug_work(void)
+{
+	struct cifsd_work *work;
+
+	inline_plugged = 0;
+	while ((work = cifsd_sched_next(&inline_sched)))
+		work->fn(work);
+}
+
+/**
+ * cifsd_nr_shards() - number of ways work is split by key
+ *
+ * Return:	number of running workers, 1 when work runs inline
+ */
+unsigned int cifsd_nr_shards(void)
+{
+	return nr_running ? nr_running : 1;
+}
+
+/**
+ * cifsd_shard_of() - shard, and so worker, owning a key
+ * @key:	shard key, the server handle of a client
+ *
+ * Return:	shard below cifsd_nr_shards()
+ */
+unsigned int cifsd_shard_of(__u64 key)
+{
+	/* the high hash bits, the low ones pick the scheduler bucket */
+	return ((__u64)cifsd_key_hash(key) * cifsd_nr_shards()) >> 32;
+}
+
+/**
+ * cifsd_workers_dump() - print how often the priority classes reordered
+ * @fp:		output stream
+ */
+void cifsd_workers_dump(FILE *fp)
+{
+	unsigned long promoted = inline_sched.promoted;
+	unsigned long forced = inline_sched.forced;
+	unsigned int i;
+
+	for (i = 0; i < nr_running; i++) {
+		promoted += workers[i].sched.promoted;
+		forced += workers[i].sched.forced;
+	}
+
+	fprintf(fp, "sched high work run ahead %lu, normal work run to not "
+		"starve %lu\n", promoted, forced);
+}
+
+/**
+ * cifsd_workers_init() - start cifsd_nr_workers worker threads
+ *
+ * Return:	0 on success, -1 on error
+ */
+int cifsd_workers_init(void)
+{
+	struct cifsd_worker *worker;
+	unsigned int i;
+
+	if (!cifsd_nr_workers)
+		return 0;
+
+	if (cifsd_nr_workers > CIFSD_MAX_WORKERS)
+		cifsd_nr_workers = CIFSD_MAX_WORKERS;
+
+	workers = calloc(cifsd_nr_workers, sizeof(*workers));
+	if (!workers) {
+		cifsd_err("failed to allocate workers\n");
+		return -1;
+	}
+
+	for (i = 0; i < cifsd_nr_workers; i++) {
+		worker = &workers[i];
+		pthread_mutex_init(&worker->lock, NULL);
+		pthread_cond_init(&worker->cond, NULL);
+		cifsd_sched_init(&worker->sched);
+
+		if (pthread_create(&worker->thread, NULL, cifsd_worker_fn,
+					worker)) {
+			cifsd_err("failed to start worker %u\n", i);
+			cifsd_workers_exit();
+			return -1;
+		}
+		nr_running++;
+	}
+
+	cifsd_debug("started %u workers\n", nr_running);
+	return 0;
+}
+
+/**
+ * cifsd_workers_exit() - run queued work to completion and stop workers
+ */
+void cifsd_workers_exit(void)
+{
+	struct cifsd_worker *worker;
+	unsigned int i;
+
+	for (i = 0; i < nr_running; i++) {
+		worker = &workers[i];
+		pthread_mutex_lock(&worker->lock);
+		worker->stop = 1;
+		pthread_cond_signal(&worker->cond);
+		pthread_mutex_unlock(&worker->lock);
+	}
+
+	for (i = 0; i < nr_running; i++)
+		pthread_join(workers[i].thread, NULL);
+
+	nr_running = 0;
+	free(workers);
+	workers = NULL;
+}
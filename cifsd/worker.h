@@ -0,0 +1,75 @@
+/*
+ *   cifsd-tools/cifsd/worker.h
+ *
+ *   Copyright (C) 2016 Namjae Jeon <namjae.jeon@protocolfreedom.org>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ */
+
+#ifndef __CIFSD_TOOLS_WORKER_H
+#define __CIFSD_TOOLS_WORKER_H
+
+#include <pthread.h>
+#include "cifsd.h"
+
+#define CIFSD_MAX_WORKERS	64
+
+/*
+ * Priority classes. High work runs ahead of queued normal work unless an
+ * earlier normal work of the same key is waiting, so work of one key
+ * never reorders. After CIFSD_PRIO_BURST high ones in a row a waiting
+ * normal one runs, normal work is never starved. That normal work is
+ * never one queued behind high work of its key bucket.
+ */
+#define CIFSD_PRIO_NORMAL	0
+#define CIFSD_PRIO_HIGH		1
+#define CIFSD_NR_PRIO		2
+
+#define CIFSD_PRIO_BURST	8
+#define CIFSD_SCHED_BUCKETS	256	/* key hash buckets of waiting work */
+
+struct cifsd_work {
+	struct list_head	list;
+	void			(*fn)(struct cifsd_work *work);
+	unsigned int		prio;	/* CIFSD_PRIO_*, normal if zeroed */
+	unsigned int		bucket;	/* set by cifsd_queue_work */
+};
+
+struct cifsd_sched {
+	struct list_head	queue[CIFSD_NR_PRIO];
+	/* normal work waiting, per key bucket */
+	unsigned int		waiting[CIFSD_SCHED_BUCKETS];
+	/* high work queued, per key bucket */
+	unsigned int		high[CIFSD_SCHED_BUCKETS];
+	unsigned int		burst;
+	unsigned long		promoted;	/* high work run ahead */
+	unsigned long		forced;		/* normal work run to not starve */
+};
+
+/* number of worker threads, 0 runs all work on the netlink thread */
+extern unsigned int cifsd_nr_workers;
+
+int cifsd_workers_init(void);
+void cifsd_workers_exit(void);
+void cifsd_queue_work(struct cifsd_work *work, __u64 key);
+void cifsd_queue_work_on(struct cifsd_work *work, unsigned int shard,
+		__u64 key);
+void cifsd_plug_work(void);
+void cifsd_unplug_work(void);
+unsigned int cifsd_nr_shards(void);
+unsigned int cifsd_shard_of(__u64 key);
+void cifsd_workers_dump(FILE *fp);
+
+#endif /* __CIFSD_TOOLS_WORKER_H */
@@ -26,6 +26,8 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <arpa/inet.h>
 #include <errno.h>
 
@@ -44,6 +46,7 @@
 
 #define O_SERVER 1
 #define O_CLIENT 2
+#define O_DAEMON 4
 
 /**
  * readstat() - reads data from cifsd statistics control interface
@@ -138,6 +141,47 @@ int getstats(char *node)
 	return 0;
 }
 
+/**
+ * getdaemonstats() - reads request latency stats from cifsd stats socket
+ * @path:	AF_UNIX socket given to cifsd with -s
+ *
+ * Return:	0 on success and -1 on failure
+ */
+int getdaemonstats(char *path)
+{
+	struct sockaddr_un addr;
+	char buf[BUF_SIZE];
+	ssize_t rc;
+	int fd;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stdout, "Too long socket path (%s)\n", path);
+		return -1;
+	}
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) {
+		fprintf(stdout, "Failed to create socket, err(%d)\n", errno);
+		return -1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+		fprintf(stdout, "Not able to connect to (%s), err(%d)\n",
+				path, errno);
+		close(fd);
+		return -1;
+	}
+
+	while ((rc = read(fd, buf, sizeof(buf))) > 0)
+		fwrite(buf, sizeof(char), rc, stdout);
+
+	close(fd);
+	return rc < 0 ? -1 : 0;
+}
+
 /**
  * is_validIP() - utility function to validate IP address
  * @ipaddr:	source buffer containing IP to verify
@@ -162,11 +206,18 @@ int is_validIP(char *ipaddr)
  * @flags:	user selected option to process
  * @client:	client IP under request
  * @sz:	length of client IP address
+ * @daemon:	cifsd stats socket path
  *
  * Return:	success: 0; fail: -1
  */
-int process_args(int flags, char *client, int size)
+int process_args(int flags, char *client, int size, char *daemon)
 {
+	if (flags & O_DAEMON) {
+		if (getdaemonstats(daemon))
+			return -1;
+		flags &= ~O_DAEMON;
+	}
+
 	if (flags & O_SERVER) {
 		if (setstatopt(OPT_SERVER, strlen(OPT_SERVER)))
 			return -1;
@@ -195,7 +246,8 @@ void usage(void)
 			"options:\n"
 			"	-h help\n"
 			"	-s show server stat\n"
-			"	-c <client IP> show client stat\n");
+			"	-c <client IP> show client stat\n"
+			"	-d <socket> show cifsd request latency stat\n");
 }
 
 /**
@@ -208,11 +260,12 @@ void usage(void)
 int main(int argc, char *argv[])
 {
 	char client[MAX_IPLEN];
+	char *daemon = NULL;
 	int flags = 0, opt;
 
 	memset(client, 0, MAX_IPLEN);
 
-	while ((opt = getopt(argc, argv, "hsc:")) != -1) {
+	while ((opt = getopt(argc, argv, "hsc:d:")) != -1) {
 		switch (opt) {
 			case 's':
 				flags |= O_SERVER;
@@ -227,13 +280,17 @@ int main(int argc, char *argv[])
 					exit(EXIT_FAILURE);
 				}
 				break;
+			case 'd':
+				daemon = optarg;
+				flags |= O_DAEMON;
+				break;
 			case 'h':
 			default: /* '?' */
 				usage();
 				exit(EXIT_FAILURE);
 		}
 	}
-	if (process_args(flags, client, strlen(client)))
+	if (process_args(flags, client, strlen(client), daemon))
 		fprintf(stdout, "Unable to process request, try again\n");
 
 	return 0;
@@ -35,6 +35,7 @@
 #include <signal.h>
 #include <iconv.h>
 #include <errno.h>
+#include <pthread.h>
 
 #include "list.h"
 #include "nterr.h"
@@ -89,16 +90,43 @@ struct cifsd_pipe_table {
 
 #define INVALID_PIPE   0xFFFFFFFF
 
+/* concurrently open instances of one pipe type per client */
+#define CIFSD_PIPE_SLOTS	4
+
+/* responses pipelined behind the one being read out */
+#define CIFSD_PIPE_MAX_CALLS	8
+
+/* a response not read yet, the pending fields of struct cifsd_pipe */
+struct cifsd_rpc_call {
+	struct list_head list;
+	__u32 call_id;
+	int pkt_type;
+	int opnum;
+	char *data;
+	int datasize;
+	int sent;
+};
+
 struct cifsd_pipe {
-        struct list_head list;
-        int id;
+        __u64 id;	/* instance id given by the kernel at create */
+	time_t last_used;	/* monotonic seconds, for the reaper */
+	unsigned int charged;	/* response bytes counted against the cap */
+	struct cifsd_client_info *client;	/* owner, for its accounting */
+	/* calls written after the one whose response is pending below */
+	struct list_head calls;
+	unsigned int nr_calls;
+	unsigned int queued_bytes;	/* datasize of the queued calls */
+	__u32 call_id;
         char *data;
         int pkt_type;
         unsigned int pipe_type;
         int opnum;
-        char *buf;
         int datasize;
         int sent;
+	/* request fragments received so far, see rpc_reassemble() */
+	char *frag_buf;
+	int frag_len;
+	__u16 max_xmit_frag;	/* response fragment size, set at bind */
 	char codepage[CIFSD_CODEPAGE_LEN];
 	char username[CIFSD_USERNAME_LEN];
 };
@@ -107,7 +135,18 @@ struct cifsd_client_info {
         struct list_head list;
         __u64 hash;
 	void *local_nls; // To be replaced with actual encoding logic
-        struct list_head pipelist;
+	/* open pipes, instance id hashes to a slot of its pipe type */
+	struct cifsd_pipe *pipes[MAX_PIPE][CIFSD_PIPE_SLOTS];
+	unsigned int nr_pipes;
+	time_t last_used;	/* monotonic seconds, for the reaper */
+	/* usage, for the per client quotas and cifsstat */
+	unsigned long bytes;	/* responses held by its pipes */
+	unsigned long requests;
+	unsigned long refused;
+	__u64 cpu_ns;		/* spent handling its requests */
+	time_t window;		/* second the window_* counts are for */
+	unsigned int window_requests;
+	__u64 window_cpu_ns;
 };
 
 /* max string size for share and parameters */
@@ -145,6 +184,10 @@ struct cifsd_share {
 
 extern struct list_head cifsd_share_list;
 extern int cifsd_num_shares;
+/* protects the share list, workgroup and server_string across reloads */
+extern pthread_rwlock_t cifsd_share_lock;
+/* bumped under cifsd_share_lock each time the share list is rebuilt */
+extern unsigned int cifsd_share_gen;
 
 char *guestAccountName;
 //char *server_string;
@@ -190,10 +233,14 @@ int get_entry(int fd, char **buf, int *isEOF);
 void tlws(char *src, char *dst, int *sz);
 
 int process_rpc_rsp(struct cifsd_pipe *pipe, char *data_buf, int size);
-int process_rpc(struct cifsd_pipe *pipe, char *data);
-int handle_lanman_pipe(struct cifsd_pipe *pipe, char *in_data,
-		char *out_data, int *param_len);
-
+int process_rpc(struct cifsd_pipe *pipe, char *data, int len);
+void rpc_free_pipe_data(struct cifsd_pipe *pipe);
+int rpc_transact(struct cifsd_pipe *pipe, char *in_data, int in_len,
+		char *out_data, int size);
+int handle_lanman_pipe(struct cifsd_pipe *pipe, char *in_data, int in_len,
+		char *out_data, int out_len, int *param_len);
+
+size_t strlen_w(const unsigned short *src);
 int smbConvertToUTF16(__le16 *target, char *source, int slen,
                 int targetlen, const char *codepage);
 char *smb_strndup_from_utf16(char *src, const int maxlen,
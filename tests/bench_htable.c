@@ -0,0 +1,135 @@
+/*
+ *   cifsd-tools/tests/bench_htable.c
+ *
+ *   Copyright (C) 2016 Namjae Jeon <namjae.jeon@protocolfreedom.org>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ */
+
+/*
+ * Client lookup cost: the server_handle hash table against the list scan
+ * lookup_client() used to do, from 10 to 100k clients with random
+ * handles.
+ *
+ * usage: bench_htable [lookups]
+ */
+
+#include <time.h>
+#include "htable.c"
+
+/* list scans done per client count are capped to this many entries */
+#define BENCH_SCAN_BUDGET	200000000ULL
+
+struct bench_client {
+	struct list_head	list;
+	__u64			hash;
+};
+
+static __u64 bench_seed = 0x9e3779b97f4a7c15ULL;
+
+static __u64 bench_rand(void)
+{
+	bench_seed ^= bench_seed << 13;
+	bench_seed ^= bench_seed >> 7;
+	bench_seed ^= bench_seed << 17;
+	return bench_seed;
+}
+
+static __u64 bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static struct bench_client *bench_scan(struct list_head *head, __u64 hash)
+{
+	struct bench_client *client;
+
+	list_for_each_entry(client, head, list) {
+		if (client->hash == hash)
+			return client;
+	}
+	return NULL;
+}
+
+static int bench_run(unsigned int nr, unsigned long lookups)
+{
+	struct bench_client *clients;
+	struct cifsd_htable ht;
+	LIST_HEAD(head);
+	unsigned long i, scans;
+	__u64 start, ht_ns, list_ns;
+	unsigned int k;
+
+	clients = calloc(nr, sizeof(*clients));
+	if (!clients)
+		return 1;
+
+	cifsd_htable_init(&ht);
+	for (k = 0; k < nr; k++) {
+		/* kernel pointer like handles */
+		clients[k].hash = 0xffff880000000000ULL |
+			((bench_rand() & 0xffffffffffULL) << 6);
+		if (cifsd_htable_insert(&ht, clients[k].hash, &clients[k])) {
+			k--;
+			continue;
+		}
+		list_add(&clients[k].list, &head);
+	}
+
+	start = bench_now();
+	for (i = 0; i < lookups; i++) {
+		k = bench_rand() % nr;
+		if (cifsd_htable_lookup(&ht, clients[k].hash) != &clients[k])
+			return 1;
+	}
+	ht_ns = bench_now() - start;
+
+	scans = BENCH_SCAN_BUDGET / nr;
+	if (scans > lookups)
+		scans = lookups;
+	start = bench_now();
+	for (i = 0; i < scans; i++) {
+		k = bench_rand() % nr;
+		if (bench_scan(&head, clients[k].hash) != &clients[k])
+			return 1;
+	}
+	list_ns = bench_now() - start;
+
+	printf("%8u %10.0f %10.0f\n", nr, (double)ht_ns / lookups,
+		(double)list_ns / scans);
+
+	cifsd_htable_free(&ht);
+	free(clients);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	static const unsigned int nrs[] = { 10, 100, 1000, 10000, 100000 };
+	unsigned long lookups = argc > 1 ? strtoul(argv[1], NULL, 0) : 2000000;
+	unsigned int i;
+
+	printf("%8s %10s %10s\n", "clients", "htable ns", "list ns");
+	for (i = 0; i < sizeof(nrs) / sizeof(nrs[0]); i++) {
+		if (bench_run(nrs[i], lookups)) {
+			printf("lookup of %u clients failed\n", nrs[i]);
+			return 1;
+		}
+	}
+	return 0;
+}
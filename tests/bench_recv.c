@@ -0,0 +1,198 @@
+/*
+ *   cifsd-tools/tests/bench_recv.c
+ *
+ *   Copyright (C) 2016 Namjae Jeon <namjae.jeon@protocolfreedom.org>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ */
+
+/*
+ * Receive cost per kernel event: the MSG_PEEK sequence cifsd_handle_event()
+ * used, one recvmsg with MSG_TRUNC per event, and recvmmsg batches as
+ * cifsd_handle_event() reads them now. Events go over a SOCK_SEQPACKET
+ * socketpair, which keeps the datagram semantics of the netlink socket.
+ *
+ * usage: bench_recv [events]
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "netlink.h"
+
+/* events written to the socket before they are read back */
+#define BENCH_BURST	16
+
+static int bench_fd[2];
+static char bench_buf[BENCH_BURST][NETLINK_CIFSD_MAX_BUF];
+static unsigned long bench_syscalls;
+
+static __u64 bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int bench_read(char *buf, unsigned int buflen, int flags)
+{
+	struct iovec iov = { .iov_base = buf, .iov_len = buflen };
+	struct msghdr msg;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+
+	bench_syscalls++;
+	return recvmsg(bench_fd[1], &msg, flags);
+}
+
+/* the receive sequence before the single read path */
+static int bench_recv_peek(void)
+{
+	struct nlmsghdr *nlh = (struct nlmsghdr *)bench_buf[0];
+	struct cifsd_uevent *ev = NLMSG_DATA(nlh);
+	int len;
+
+	len = bench_read(bench_buf[0], NLMSG_SPACE(sizeof(*ev)), MSG_PEEK);
+	if (len != NLMSG_SPACE(sizeof(*ev)))
+		return -1;
+
+	if (len != nlh->nlmsg_len && ev->buflen) {
+		len = bench_read(bench_buf[0], nlh->nlmsg_len, MSG_PEEK);
+		if (len != nlh->nlmsg_len)
+			return -1;
+	}
+
+	len = bench_read(bench_buf[0], nlh->nlmsg_len, 0);
+	return len == nlh->nlmsg_len ? 1 : -1;
+}
+
+static int bench_recv_trunc(void)
+{
+	struct nlmsghdr *nlh = (struct nlmsghdr *)bench_buf[0];
+	int len;
+
+	len = bench_read(bench_buf[0], NETLINK_CIFSD_MAX_BUF, MSG_TRUNC);
+	if (len < (int)NLMSG_SPACE(sizeof(struct cifsd_uevent)) ||
+	    len > (int)NETLINK_CIFSD_MAX_BUF || len != nlh->nlmsg_len)
+		return -1;
+	return 1;
+}
+
+static int bench_recv_mmsg(void)
+{
+	struct mmsghdr mmsg[BENCH_BURST];
+	struct iovec iov[BENCH_BURST];
+	int i, n;
+
+	memset(mmsg, 0, sizeof(mmsg));
+	for (i = 0; i < BENCH_BURST; i++) {
+		iov[i].iov_base = bench_buf[i];
+		iov[i].iov_len = NETLINK_CIFSD_MAX_BUF;
+		mmsg[i].msg_hdr.msg_iov = &iov[i];
+		mmsg[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	bench_syscalls++;
+	n = recvmmsg(bench_fd[1], mmsg, BENCH_BURST, MSG_DONTWAIT, NULL);
+	for (i = 0; i < n; i++) {
+		if (mmsg[i].msg_len !=
+		    ((struct nlmsghdr *)bench_buf[i])->nlmsg_len)
+			return -1;
+	}
+	return n;
+}
+
+static void bench_send(unsigned int payload)
+{
+	char buf[NETLINK_CIFSD_MAX_BUF];
+	struct nlmsghdr *nlh = (struct nlmsghdr *)buf;
+	struct cifsd_uevent *ev = NLMSG_DATA(nlh);
+
+	memset(buf, 0, sizeof(buf));
+	nlh->nlmsg_len = NLMSG_SPACE(sizeof(*ev)) + payload;
+	nlh->nlmsg_type = payload ? CIFSD_KEVENT_WRITE_PIPE :
+		CIFSD_KEVENT_READ_PIPE;
+	ev->type = nlh->nlmsg_type;
+	ev->buflen = payload;
+
+	if (send(bench_fd[0], buf, nlh->nlmsg_len, 0) != nlh->nlmsg_len) {
+		perror("send");
+		exit(1);
+	}
+}
+
+static int bench_run(const char *name, int (*recv_fn)(void),
+		unsigned int payload, unsigned long events)
+{
+	unsigned long done = 0, burst;
+	__u64 ns = 0, start;
+	int n;
+
+	bench_syscalls = 0;
+	while (done < events) {
+		for (burst = 0; burst < BENCH_BURST; burst++)
+			bench_send(payload);
+
+		start = bench_now();
+		for (burst = 0; burst < BENCH_BURST; burst += n) {
+			n = recv_fn();
+			if (n <= 0) {
+				printf("%s: receive failed\n", name);
+				return 1;
+			}
+		}
+		ns += bench_now() - start;
+		done += burst;
+	}
+
+	printf("%-6s %7u %8.2f %10.0f\n", name, payload,
+		(double)bench_syscalls / done, (double)ns / done);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	static const unsigned int payloads[] = { 0, 512, 4096 };
+	unsigned long events = argc > 1 ? strtoul(argv[1], NULL, 0) : 100000;
+	int sndbuf = 4 << 20;
+	unsigned int i;
+	int ret = 0;
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, bench_fd)) {
+		perror("socketpair");
+		return 1;
+	}
+	setsockopt(bench_fd[0], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+
+	printf("%-6s %7s %8s %10s\n", "read", "payload", "calls/ev", "ns/ev");
+	for (i = 0; i < sizeof(payloads) / sizeof(payloads[0]); i++) {
+		ret |= bench_run("peek", bench_recv_peek, payloads[i], events);
+		ret |= bench_run("trunc", bench_recv_trunc, payloads[i], events);
+		ret |= bench_run("mmsg", bench_recv_mmsg, payloads[i], events);
+	}
+
+	close(bench_fd[0]);
+	close(bench_fd[1]);
+	return ret;
+}
@@ -0,0 +1,138 @@
+/*
+ *   cifsd-tools/tests/test_htable.c
+ *
+ *   Copyright (C) 2016 Namjae Jeon <namjae.jeon@protocolfreedom.org>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ */
+
+#include "htable.c"
+
+/* distinct keys the random operations pick from */
+#define TEST_NR_KEYS	20000
+#define TEST_NR_OPS	3000000
+
+static int test_present[TEST_NR_KEYS];
+static __u64 test_seed = 0x2545f4914f6cdd1dULL;
+
+static __u64 test_rand(void)
+{
+	test_seed ^= test_seed << 13;
+	test_seed ^= test_seed >> 7;
+	test_seed ^= test_seed << 17;
+	return test_seed;
+}
+
+/* server handles look like kernel pointers, 64 byte aligned */
+static __u64 test_key(unsigned int i)
+{
+	return 0xffff880000000000ULL + (__u64)i * 64;
+}
+
+/* random inserts, deletes and lookups checked against test_present */
+static int test_random_ops(void)
+{
+	struct cifsd_htable ht;
+	unsigned int op, i, count = 0;
+	void *val;
+	int ret;
+
+	cifsd_htable_init(&ht);
+	for (op = 0; op < TEST_NR_OPS; op++) {
+		i = test_rand() % TEST_NR_KEYS;
+		val = &test_present[i];
+
+		switch (test_rand() % 3) {
+		case 0:
+			ret = cifsd_htable_insert(&ht, test_key(i), val);
+			if (ret != (test_present[i] ? -EEXIST : 0)) {
+				printf("insert of %u returned %d\n", i, ret);
+				return 1;
+			}
+			if (!test_present[i])
+				count++;
+			test_present[i] = 1;
+			break;
+		case 1:
+			if (cifsd_htable_del(&ht, test_key(i)) !=
+			    (test_present[i] ? val : NULL)) {
+				printf("delete of %u is wrong\n", i);
+				return 1;
+			}
+			if (test_present[i])
+				count--;
+			test_present[i] = 0;
+			break;
+		default:
+			if (cifsd_htable_lookup(&ht, test_key(i)) !=
+			    (test_present[i] ? val : NULL)) {
+				printf("lookup of %u is wrong\n", i);
+				return 1;
+			}
+			break;
+		}
+
+		if (ht.count != count) {
+			printf("count %u, expected %u\n", ht.count, count);
+			return 1;
+		}
+	}
+
+	for (i = 0; i < TEST_NR_KEYS; i++) {
+		if (cifsd_htable_lookup(&ht, test_key(i)) !=
+		    (test_present[i] ? &test_present[i] : NULL)) {
+			printf("final lookup of %u is wrong\n", i);
+			return 1;
+		}
+	}
+
+	cifsd_htable_free(&ht);
+	return 0;
+}
+
+/* every key stays reachable while the table grows and migrates */
+static int test_grow(void)
+{
+	struct cifsd_htable ht;
+	unsigned int i, j;
+
+	cifsd_htable_init(&ht);
+	for (i = 0; i < TEST_NR_KEYS; i++) {
+		if (cifsd_htable_insert(&ht, test_key(i), &test_present[i])) {
+			printf("insert of %u failed\n", i);
+			return 1;
+		}
+		for (j = i & ~63; j <= i; j++) {
+			if (cifsd_htable_lookup(&ht, test_key(j)) !=
+			    &test_present[j]) {
+				printf("key %u lost after %u inserts\n", j,
+					i + 1);
+				return 1;
+			}
+		}
+	}
+
+	cifsd_htable_free(&ht);
+	return 0;
+}
+
+int main(void)
+{
+	int ret = 0;
+
+	ret |= test_grow();
+	ret |= test_random_ops();
+	return ret;
+}
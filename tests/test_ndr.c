@@ -0,0 +1,98 @@
+/*
+ *   cifsd-tools/tests/test_ndr.c
+ *
+ *   Copyright (C) 2016 Namjae Jeon <namjae.jeon@protocolfreedom.org>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ */
+
+#include "conv.c"
+#include "ndr.c"
+
+struct test_unistr {
+	const char		*str;		/* UTF-8 */
+	unsigned short		units[8];	/* UTF-16, with the NUL */
+	unsigned int		count;
+};
+
+static const struct test_unistr test_unistrs[] = {
+	{ "IPC$", { 'I', 'P', 'C', '$', 0 }, 5 },
+	{ "", { 0 }, 1 },
+	/* two and four byte sequences, the last one a surrogate pair */
+	{ "sh\xc3\xa9\xf0\x9f\x98\x80",
+	  { 's', 'h', 0xe9, 0xd83d, 0xde00, 0 }, 6 },
+	{ "\xe5\x85\xb1\xe6\x9c\x89", { 0x5171, 0x6709, 0 }, 3 },
+};
+
+static __u32 test_le32(const char *p)
+{
+	__le32 v;
+
+	memcpy(&v, p, sizeof(v));
+	return __le32_to_cpu(v);
+}
+
+static int test_one_unistr(const struct test_unistr *t)
+{
+	char buf[128];
+	struct cifsd_ndr ndr;
+	unsigned int i, size;
+	__le16 unit;
+
+	memset(buf, 0xff, sizeof(buf));
+	cifsd_ndr_init(&ndr, buf, sizeof(buf), "UTF-8");
+	cifsd_ndr_unistr(&ndr, t->str);
+	cifsd_ndr_u32(&ndr, 0x11223344);
+	if (ndr.err) {
+		printf("\"%s\": encoding failed, %d\n", t->str, ndr.err);
+		return 1;
+	}
+
+	if (test_le32(buf) != t->count || test_le32(buf + 4) != 0 ||
+	    test_le32(buf + 8) != t->count) {
+		printf("\"%s\": max_count %u offset %u actual_count %u, "
+			"expected %u\n", t->str, test_le32(buf),
+			test_le32(buf + 4), test_le32(buf + 8), t->count);
+		return 1;
+	}
+
+	for (i = 0; i < t->count; i++) {
+		memcpy(&unit, buf + 12 + 2 * i, sizeof(unit));
+		if (__le16_to_cpu(unit) != t->units[i]) {
+			printf("\"%s\": unit %u is 0x%x, expected 0x%x\n",
+				t->str, i, __le16_to_cpu(unit), t->units[i]);
+			return 1;
+		}
+	}
+
+	/* padded to 4, the room a multibyte string did not use given back */
+	size = 12 + ((t->count * 2 + 3) & ~3);
+	if (ndr.offset != size + 4 || test_le32(buf + size) != 0x11223344) {
+		printf("\"%s\": next field at %d, expected %u\n", t->str,
+			ndr.offset - 4, size);
+		return 1;
+	}
+	return 0;
+}
+
+int main(void)
+{
+	unsigned int i;
+	int ret = 0;
+
+	for (i = 0; i < sizeof(test_unistrs) / sizeof(test_unistrs[0]); i++)
+		ret |= test_one_unistr(&test_unistrs[i]);
+	return ret;
+}
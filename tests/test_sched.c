@@ -0,0 +1,138 @@
+/*
+ *   cifsd-tools/tests/test_sched.c
+ *
+ *   Copyright (C) 2016 Namjae Jeon <namjae.jeon@protocolfreedom.org>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ */
+
+/* the scheduler is static, test it from the same translation unit */
+#include "worker.c"
+
+#define TEST_MAX_WORK	64
+
+struct test_work {
+	struct cifsd_work	work;
+	__u64			key;
+	int			seq;
+};
+
+static struct test_work test_works[TEST_MAX_WORK];
+static int nr_queued;
+static struct test_work *run_order[TEST_MAX_WORK];
+static int nr_run;
+
+static void test_work_fn(struct cifsd_work *work)
+{
+	run_order[nr_run++] = list_entry(work, struct test_work, work);
+}
+
+static void test_queue(__u64 key, unsigned int prio)
+{
+	struct test_work *tw = &test_works[nr_queued];
+
+	tw->key = key;
+	tw->seq = nr_queued++;
+	tw->work.fn = test_work_fn;
+	tw->work.prio = prio;
+	cifsd_queue_work(&tw->work, key);
+}
+
+static void test_reset(void)
+{
+	memset(test_works, 0, sizeof(test_works));
+	nr_queued = 0;
+	nr_run = 0;
+	cifsd_plug_work();
+}
+
+/* every work ran once, work of one key in queueing order */
+static int test_check_order(const char *name)
+{
+	int i, j;
+
+	if (nr_run != nr_queued) {
+		printf("%s: %d of %d work ran\n", name, nr_run, nr_queued);
+		return 1;
+	}
+
+	for (i = 0; i < nr_run; i++) {
+		for (j = i + 1; j < nr_run; j++) {
+			if (run_order[i]->key == run_order[j]->key &&
+			    run_order[i]->seq > run_order[j]->seq) {
+				printf("%s: work %d of key %llu ran before %d\n",
+					name, run_order[j]->seq,
+					run_order[j]->key, run_order[i]->seq);
+				return 1;
+			}
+		}
+	}
+	return 0;
+}
+
+/* a burst of high work, then mixed high and normal work of one key */
+static int test_one_key(void)
+{
+	int i, ret;
+
+	test_reset();
+	for (i = 0; i < CIFSD_PRIO_BURST + 2; i++)
+		test_queue(1, CIFSD_PRIO_HIGH);
+	for (i = 0; i < 4; i++) {
+		test_queue(1, CIFSD_PRIO_NORMAL);
+		test_queue(1, CIFSD_PRIO_HIGH);
+	}
+	cifsd_unplug_work();
+
+	ret = test_check_order("one key");
+	for (i = 0; !ret && i < nr_run; i++) {
+		if (run_order[i]->seq != i) {
+			printf("one key: work %d ran as %d\n",
+				run_order[i]->seq, i);
+			ret = 1;
+		}
+	}
+	return ret;
+}
+
+/* normal work of another key still runs once the burst is spent */
+static int test_starvation(void)
+{
+	int i, ret;
+
+	test_reset();
+	for (i = 0; i < CIFSD_PRIO_BURST + 2; i++)
+		test_queue(1, CIFSD_PRIO_HIGH);
+	test_queue(1, CIFSD_PRIO_NORMAL);
+	test_queue(2, CIFSD_PRIO_NORMAL);
+	cifsd_unplug_work();
+
+	ret = test_check_order("starvation");
+	if (!ret && run_order[CIFSD_PRIO_BURST]->key != 2) {
+		printf("starvation: key 2 did not run after %d high work\n",
+			CIFSD_PRIO_BURST);
+		ret = 1;
+	}
+	return ret;
+}
+
+int main(void)
+{
+	int ret = 0;
+
+	ret |= test_one_key();
+	ret |= test_starvation();
+	return ret;
+}